@@ -33,6 +33,8 @@ class PrintType(IntEnum):
     PRINT_THOUGHT_CHUNK     =14,    # same as PRINT_CHAT_CHUNK, but this from "thoughts".
                                     # possible leading or trailing tags (such as <think>, </think>) are removed.
                                     # use `+detect_thoughts` to enable this.
+    PRINTLN_BATCH_REPLY     =15,    # print a whole line: a reply of `batch_user_input` with a prefix of its index
+                                    # (example: "0,....")
 
     PRINT_EVT_ASYNC_COMPLETED       = 100,   # last async operation completed (utf8_str is null)
     PRINT_EVT_THOUGHT_COMPLETED     = 101,   # thought completed
@@ -97,6 +99,7 @@ class LibChatLLM:
         self._chatllm_text_tokenize     = self._lib.chatllm_text_tokenize
         self._chatllm_text_embedding    = self._lib.chatllm_text_embedding
         self._chatllm_qa_rank           = self._lib.chatllm_qa_rank
+        self._chatllm_batch_user_input  = self._lib.chatllm_batch_user_input
         self._chatllm_rag_select_store  = self._lib.chatllm_rag_select_store
         self._chatllm_abort_generation  = self._lib.chatllm_abort_generation
         self._chatllm_restart           = self._lib.chatllm_restart
@@ -164,6 +167,9 @@ class LibChatLLM:
         self._chatllm_qa_rank.restype = c_int
         self._chatllm_qa_rank.argtypes = [c_void_p, c_char_p, c_char_p]
 
+        self._chatllm_batch_user_input.restype = c_int
+        self._chatllm_batch_user_input.argtypes = [c_void_p, c_int, POINTER(c_char_p)]
+
         self._chatllm_rag_select_store.restype = c_int
         self._chatllm_rag_select_store.argtypes = [c_void_p, c_char_p]
 
@@ -224,6 +230,8 @@ class LibChatLLM:
             obj.callback_print_log(txt)
         elif print_type == PrintType.PRINTLN_BEAM_SEARCH.value:
             obj.callback_print_beam_search(txt)
+        elif print_type == PrintType.PRINTLN_BATCH_REPLY.value:
+            obj.callback_print_batch_reply(txt)
         elif print_type == PrintType.PRINT_EVT_ASYNC_COMPLETED.value:
             obj.callback_async_done()
         elif print_type == PrintType.PRINTLN_MODEL_INFO.value:
@@ -326,6 +334,10 @@ class LibChatLLM:
     def qa_rank(self, obj: c_void_p, q: str, a: str) -> float:
         return self._chatllm_qa_rank(obj, c_char_p(q.encode()), c_char_p(a.encode()))
 
+    def batch_user_input(self, obj: c_void_p, inputs: List[str]) -> int:
+        arr = (c_char_p * len(inputs))(*[s.encode() for s in inputs])
+        return self._chatllm_batch_user_input(obj, c_int(len(inputs)), arr)
+
     def rag_select_store(self, obj: c_void_p, store_name: str) -> str:
         return self._chatllm_rag_select_store(obj, c_char_p(store_name.encode()))
 
@@ -379,6 +391,7 @@ class ChatLLM:
         self.rewritten_query = ''
         self._result_embedding = None
         self._result_ranking = None
+        self._result_batch_replies = None
         self._result_text_tokenize = None
         self._model_info = None
         self.is_first_thought_chunk = True
@@ -480,6 +493,11 @@ class ChatLLM:
         assert self._lib.qa_rank(self._chat, q, a) == 0, 'qa_rank failed'
         return float(self._result_ranking)
 
+    def batch_chat(self, user_inputs: List[str]) -> List[str]:
+        self._result_batch_replies = [''] * len(user_inputs)
+        assert self._lib.batch_user_input(self._chat, user_inputs) == 0, 'batch_chat failed'
+        return self._result_batch_replies
+
     def select_vector_store(self, name: str):
         assert self._lib.rag_select_store(self._chat, name) == 0
 
@@ -547,6 +565,10 @@ class ChatLLM:
     def callback_print_ranking(self, s: str) -> None:
         self._result_ranking = s
 
+    def callback_print_batch_reply(self, s: str) -> None:
+        l = s.split(',', maxsplit=1)
+        self._result_batch_replies[int(l[0])] = l[1]
+
     def callback_text_tokenize(self, s: str) -> None:
         self._result_text_tokenize = s
 
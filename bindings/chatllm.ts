@@ -8,6 +8,20 @@ enum PrintType {
     PRINTLN_ERROR           = 2,    // print a whole line: error message
     PRINTLN_REF             = 3,    // print a whole line: reference
     PRINTLN_REWRITTEN_QUERY = 4,    // print a whole line: rewritten query
+    PRINTLN_HISTORY_USER    = 5,    // print a whole line: user input history
+    PRINTLN_HISTORY_AI      = 6,    // print a whole line: AI output history
+    PRINTLN_TOOL_CALLING    = 7,    // print a whole line: tool calling (supported by only a few models)
+    PRINTLN_EMBEDDING       = 8,    // print a whole line: embedding (example: "0.1,0.3,...")
+    PRINTLN_RANKING         = 9,    // print a whole line: ranking (example: "0.8")
+    PRINTLN_TOKEN_IDS       =10,    // print a whole line: token ids (example: "1,3,5,8,...")
+    PRINTLN_LOGGING         =11,    // print a whole line: internal logging with the first char indicating level
+    PRINTLN_BEAM_SEARCH     =12,    // print a whole line: a result of beam search with a prefix of probability
+    PRINTLN_MODEL_INFO      =13,    // when a model is started, print a whole line of basic model information (json format)
+    PRINT_THOUGHT_CHUNK     =14,    // same as PRINT_CHAT_CHUNK, but this from "thoughts".
+    PRINTLN_BATCH_REPLY     =15,    // print a whole line: a reply of `chatllm_batch_user_input` with a prefix of its index
+
+    PRINT_EVT_ASYNC_COMPLETED   = 100,  // last async operation completed
+    PRINT_EVT_THOUGHT_COMPLETED = 101,  // thought completed
 }
 
 const {
@@ -48,6 +48,8 @@ enum PrintType
     PRINT_THOUGHT_CHUNK     =14,    // same as PRINT_CHAT_CHUNK, but this from "thoughts".
                                     // possible leading or trailing tags (such as <think>, </think>) are removed.
                                     // use `+detect_thoughts` to enable this.
+    PRINTLN_BATCH_REPLY     =15,    // print a whole line: a reply of `chatllm_batch_user_input` with a prefix of its index
+                                    // (example: "0,....")
 
     PRINT_EVT_ASYNC_COMPLETED       = 100,   // last async operation completed (utf8_str is "" to keep callback code simple)
     PRINT_EVT_THOUGHT_COMPLETED     = 101,   // thought completed
@@ -346,6 +348,21 @@ DLL_DECL int chatllm_text_embedding(struct chatllm_obj *obj, const char *utf8_st
  */
 DLL_DECL int chatllm_qa_rank(struct chatllm_obj *obj, const char *utf8_str_q, const char *utf8_str_a);
 
+/**
+ * @brief user inputs of several independent chats
+ *
+ * Each input is a single user turn (chat history is not used), and replies are generated concurrently
+ * by continuous batching. Replies are emitted through `PRINTLN_BATCH_REPLY`.
+ *
+ * Note: Only models supporting sequence batches can do this. Current chat is kept.
+ *
+ * @param[in] obj               model object
+ * @param[in] num               number of inputs
+ * @param[in] utf8_strs         inputs
+ * @return                      0 if succeeded
+ */
+DLL_DECL int chatllm_batch_user_input(struct chatllm_obj *obj, int num, const char **utf8_strs);
+
 /**
  * @brief switching RAG vector store
  *
@@ -22,6 +22,8 @@ type
         PRINT_THOUGHT_CHUNK     =14,    ## same as PRINT_CHAT_CHUNK, but this from "thoughts".
                                         ## possible leading or trailing tags (such as <think>, </think>) are removed.
                                         ## use `+detect_thoughts` to enable this.
+        PRINTLN_BATCH_REPLY     =15,    ## print a whole line: a reply of `chatllm_batch_user_input` with a prefix of its index
+                                        ## (example: "0,....")
 
         PRINT_EVT_ASYNC_COMPLETED       = 100   ##  last async operation completed (utf8_str is "")
         PRINT_EVT_THOUGHT_COMPLETED     = 101,  ## thought completed
@@ -271,6 +273,21 @@ proc chatllm_text_embedding*(obj: ptr chatllm_obj; utf8_str: cstring; purpose: c
 proc chatllm_qa_rank*(obj: ptr chatllm_obj; utf8_str_q: cstring;
                       utf8_str_a: cstring): cint {.stdcall, dynlib: libName, importc.}
 
+##
+##  @brief user inputs of several independent chats
+##
+##  Each input is a single user turn (chat history is not used), and replies are generated concurrently
+##  by continuous batching. Replies are emitted through `PRINTLN_BATCH_REPLY`.
+##
+##  Note: Only models supporting sequence batches can do this. Current chat is kept.
+##
+##  @param[in] obj               model object
+##  @param[in] num               number of inputs
+##  @param[in] utf8_strs         inputs
+##  @return                      0 if succeeded
+##
+proc chatllm_batch_user_input*(obj: ptr chatllm_obj; num: cint; utf8_strs: cstringArray): cint {.stdcall, dynlib: libName, importc.}
+
 ##
 ##  @brief switching RAG vector store
 ##
@@ -536,6 +553,7 @@ type
         result_ranking*: string
         result_token_ids*: string
         result_beam_search: seq[string]
+        result_batch_replies*: seq[string]
         model_info*: string
         fe_options*: FrontendOptions
         chan_output: Channel[StreamerMessage]
@@ -593,6 +611,8 @@ proc streamer_on_print(user_data: pointer, print_type: cint, utf8_str: cstring)
             streamer.model_info = $utf8_str
         of PrintType.PRINT_THOUGHT_CHUNK:
             streamer.chan_output.send((t: StreamerMessageType.ThoughtChunk, chunk: $utf8_str))
+        of PrintType.PRINTLN_BATCH_REPLY:
+            streamer.result_batch_replies.add $utf8_str
         of PrintType.PRINT_EVT_ASYNC_COMPLETED:
             streamer.chan_output.send((t: StreamerMessageType.Done, chunk: ""))
         of PrintType.PRINT_EVT_THOUGHT_COMPLETED:
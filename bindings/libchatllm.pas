@@ -38,6 +38,8 @@ type
       PRINT_THOUGHT_CHUNK     =14,    // same as PRINT_CHAT_CHUNK, but this from "thoughts".
                                       // possible leading or trailing tags (such as <think>, </think>) are removed.
                                       // use `+detect_thoughts` to enable this.
+      PRINTLN_BATCH_REPLY     =15,    // print a whole line: a reply of `chatllm_batch_user_input` with a prefix of its index
+                                      // (example: "0,....")
 
       PRINT_EVT_ASYNC_COMPLETED       = 100,   // last async operation completed (utf8_str is null)
       PRINT_EVT_THOUGHT_COMPLETED     = 101    // thought completed
@@ -225,6 +227,21 @@ type
   }
   function ChatLLMQARank(Obj: PChatLLMObj; AUTF8StrQ, AUTF8StrA: PAnsiChar): Integer; stdcall; external CHATLLMLIB name 'chatllm_qa_rank';
 
+  {
+    @brief user inputs of several independent chats
+
+    Each input is a single user turn (chat history is not used), and replies are generated concurrently
+    by continuous batching. Replies are emitted through `PRINTLN_BATCH_REPLY`.
+
+    Note: Only models supporting sequence batches can do this. Current chat is kept.
+
+    @param[in] obj               model object
+    @param[in] num               number of inputs
+    @param[in] utf8_strs         inputs
+    @return                      0 if succeeded
+  }
+  function ChatLLMBatchUserInput(Obj: PChatLLMObj; Num: Integer; AUTF8Strs: PPAnsiChar): Integer; stdcall; external CHATLLMLIB name 'chatllm_batch_user_input';
+
   {
     @brief switching RAG vector store
 
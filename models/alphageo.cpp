@@ -219,6 +219,8 @@ namespace chatllm::alphageo
             set_prec(ggml::prec::GGML_PREC_F32);
         }
 
+        bool supports_sequence_batch(void) const override { return false; }
+
         int64_t get_param_num(bool effective_only) const override
         {
             int64_t r = BaseAttention::get_param_num(effective_only);
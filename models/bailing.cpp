@@ -167,6 +167,11 @@ namespace chatllm::bailing::moe2
             }
         }
 
+        bool supports_sequence_batch(void) const override
+        {
+            return (nullptr == mask) && sequence_batch_cells_usable();
+        }
+
         ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *attn_scores) override
         {
@@ -91,6 +91,12 @@ namespace chatllm::bce::embedding
     {
         return config.hidden_size;
     }
+
+    void ConditionalGeneration::text_embedding_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                                    std::vector<float> &embeddings)
+    {
+        CHATLLM_CHECK(run_packed(gen_config, inputs, get_text_embedding_dim(), embeddings)) << "text embedding failed";
+    }
 }
 
 namespace chatllm::bce::ranker
@@ -148,6 +154,12 @@ namespace chatllm::bce::ranker
                                     config.intermediate_size, config.num_attention_heads, config.max_length);
     }
 
+    void ConditionalGeneration::qa_rank_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                                    std::vector<float> &scores)
+    {
+        CHATLLM_CHECK(run_packed(gen_config, inputs, 1, scores)) << "ranking failed";
+    }
+
     void ConditionalGeneration::load(ModelLoader &loader)
     {
         embedding::fix_tensor_names(loader);
@@ -31,6 +31,8 @@ namespace chatllm::bce::embedding
         ConditionalGeneration(const Config &config, const RuntimeConfig &runtime_config);
         void load(ModelLoader &loader) override;
         int get_text_embedding_dim(void) const override;
+        void text_embedding_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                                    std::vector<float> &embeddings) override;
     public:
         Config config;
     };
@@ -62,6 +64,8 @@ namespace chatllm::bce::ranker
         ConditionalGeneration(const Config &config, const RuntimeConfig &runtime_config, ModelType type);
 
         void load(ModelLoader &loader) override;
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                            std::vector<float> &scores) override;
     public:
         Config config;
     };
@@ -17,6 +17,9 @@ namespace chatllm::glm::v1
 
         void encode(const std::string &text, std::vector<int> &ids) const override;
 
+        // punctuations next to CJK characters are replaced
+        bool has_context_postprocess(void) const override { return true; }
+
     protected:
         std::string preprocess(const std::string &text) const override;
         std::string postprocess(const std::string &text) const override;
@@ -50,22 +50,17 @@ namespace chatllm::gigachat
     {
         tp = new tokenizer::BPEProcessor2(
             {
-                // FIXME: different form llama3
-
-                // llama3: (?i:'s|'t|'re|'ve|'m|'ll|'d)
-                // [^\r\n\p{L}\p{N}]?\p{L}+
-                //  \p{N}{1,3}
-                //  ?[^\s\p{L}\p{N}]+[\r\n]*
-                // \s*[\r\n]+|\s+(?!\S)
-                // \s+
-
                 // [^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]*[\p{Ll}\p{Lm}\p{Lo}\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?
                 // [^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]+[\p{Ll}\p{Lm}\p{Lo}\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?
                 // \p{N}{1,3}
                 //  ?[^\s\p{L}\p{N}]+[\r\n/]*
                 //  \s*[\r\n]+|\s+(?!\S)
                 // \s+
-                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+                "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+                "|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?"
+                "|\\p{N}{1,3}"
+                "| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+"
+                "|\\s+(?!\\S)|\\s+",
             }
         );
         size_t size = tp->Load(buffer, n_vocab);
@@ -836,6 +836,8 @@ Always prioritize using tools to provide the most accurate and helpful response.
             ctx->get_allocator()->alloc(attn_scale);
         }
 
+        bool supports_sequence_batch(void) const override { return false; }
+
         ggml::tensor *calc_attn_scores(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *key_layer, ggml::tensor *query_layer, ggml::tensor *value_layer) override
         {
@@ -863,7 +865,7 @@ Always prioritize using tools to provide the most accurate and helpful response.
 
     static float get_llama_4_attn_scale(int pos, float beta, int max_position_embeddings)
     {
-        return 1.0f + beta * std::logf(1.0f + std::floorf((float)pos / max_position_embeddings));
+        return 1.0f + beta * std::log(1.0f + std::floor((float)pos / max_position_embeddings));
     }
 
     #define MAX_PROJECTED_TOKENS    2048
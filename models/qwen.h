@@ -615,6 +615,8 @@ namespace chatllm::qwen
         {
         public:
             QWen3SelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length);
+
+            bool supports_sequence_batch(void) const override { return sequence_batch_cells_usable(); }
         };
 
         class QWen3Block : public LMBlock1<RMSNorm, QWen3SelfAttention, RMSNorm, SiLUMLP>
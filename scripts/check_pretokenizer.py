@@ -0,0 +1,91 @@
+"""
+Check pre-tokenizer splits of `main --bench_pretokenizer` against Python's `regex` module, then benchmark them
+against std::regex (`+bench_pretokenizer_stl`), where std::regex supports the pattern.
+
+    python check_pretokenizer.py path/to/main [seed]
+"""
+import os, random, subprocess, sys, tempfile
+
+import regex
+
+C  = "'s|'t|'re|'ve|'m|'ll|'d"
+CI = "(?i:'s|'t|'re|'ve|'m|'ll|'d)"
+CC = "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])"
+U  = "[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]"
+L  = "[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]"
+P  = "[^\\r\\n\\p{L}\\p{N}]?"
+T  = "| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+
+PATTERNS = {
+    'gpt2':     C + "| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    'llama3':   CC + "|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    'qwen2':    CI + "|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    'gpt4o':    P + U + "*" + L + "+" + CC + "?|" + P + U + "+" + L + "*" + CC + "?|\\p{N}{1,3}" + T,
+    'apertus':  P + U + "*" + L + "+|" + P + U + "+" + L + "*|\\p{N}" + T,
+    'n+':       "\\p{N}+",
+    'n3':       "\\p{N}{1,3}",
+    'n1':       "\\p{N}",
+}
+
+ALPHABET = list("abcXYZ  '''sStTlLdD0123456789.,!?/-\r\n\t") + \
+           ["é", "É", "ǅ", "ᾈ", "ß", "中", "文", "́", "Ω", "ω", "　", "😀", "١", "²", "ʰ", " "]
+
+BENCH_WORDS = ["Hello", "world", "it's", "ÉCOLE", "naïve", "2024", "中文", "文本", "don't", "CamelCase",
+               "x/y", "!!", "\n", "  ", "42", "über", "Ωmega"]
+
+def split_by_main(main: str, expr: str, text: str, stl: bool = False) -> tuple[list[int], str]:
+    with tempfile.NamedTemporaryFile('wb', delete=False) as f:
+        f.write(text.encode('utf-8'))
+        fn = f.name
+    try:
+        r = subprocess.run([main, '--bench_pretokenizer', expr, '--prompt_file', fn] + (['+bench_pretokenizer_stl'] if stl else []),
+                           capture_output=True, check=True)
+    finally:
+        os.remove(fn)
+    return [int(x) for x in r.stdout.decode().split()], r.stderr.decode().strip()
+
+# lengths (in bytes) of matches, and of the text between them
+def split_by_regex(rx, text: str) -> list[int]:
+    lengths = []
+    last = 0
+    for m in rx.finditer(text):
+        if m.start() > last: lengths.append(len(text[last:m.start()].encode('utf-8')))
+        if m.end() > m.start(): lengths.append(len(m.group().encode('utf-8')))
+        last = m.end()
+    if last < len(text): lengths.append(len(text[last:].encode('utf-8')))
+    return lengths
+
+def check(main: str, rounds: int = 300) -> bool:
+    ok = True
+    for name, expr in PATTERNS.items():
+        rx = regex.compile(expr)
+        bad = 0
+        for _ in range(rounds):
+            text = ''.join(random.choice(ALPHABET) for _ in range(random.randint(1, 40)))
+            got, _ = split_by_main(main, expr, text)
+            ref = split_by_regex(rx, text)
+            if got != ref:
+                bad += 1
+                if bad <= 2: print(f"{name}: {text!r}\n    got {got}\n    ref {ref}")
+        print(f"{name:10} mismatches: {bad}")
+        ok = ok and (bad == 0)
+    return ok
+
+def bench(main: str, size: int = 200000) -> None:
+    rng = random.Random(1)
+    text = ''
+    while len(text) < size:
+        text += rng.choice(BENCH_WORDS) + ' '
+    for name, expr in PATTERNS.items():
+        _, timing = split_by_main(main, expr, text)
+        try:
+            _, timing_stl = split_by_main(main, expr, text, stl=True)
+        except subprocess.CalledProcessError:
+            timing_stl = 'not supported by std::regex'
+        print(f"{name:10} {timing}\n{'':10} {timing_stl}")
+
+if __name__ == '__main__':
+    random.seed(int(sys.argv[2]) if len(sys.argv) > 2 else 0)
+    ok = check(sys.argv[1])
+    bench(sys.argv[1])
+    sys.exit(0 if ok else 1)
@@ -111,6 +111,19 @@ namespace chatllm
         return r;
     }
 
+    BackendBuffer *LayerBufAllocator::wrap_host_ptr(void *ptr, size_t size, Usage usage)
+    {
+        if (get_allocator(usage) != ggml_backend_cpu_buffer_type()) return nullptr;
+        if ((uintptr_t)ptr % get_alignment(usage) != 0) return nullptr;
+
+        ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+        if (nullptr == buf) return nullptr;
+
+        auto r = new BackendBuffer(buf);
+        buffers.emplace_back(r);
+        return r;
+    }
+
     bool LayerBufAllocator::alloc(ggml::tensor *tensor, Usage usage)
     {
         BackendBuffer *buf = alloc(get_alloc_size(tensor), usage);
@@ -768,11 +781,13 @@ namespace chatllm
 
     bool BackendContext::reserve_memory(ggml_cgraph *gf)
     {
+        alloc_serial++;
         return ggml_backend_sched_reserve(sched, gf);
     }
 
     bool BackendContext::alloc_graph(ggml_cgraph *gf)
     {
+        alloc_serial++;
         return ggml_backend_sched_alloc_graph(sched, gf);
     }
 
@@ -806,6 +821,7 @@ namespace chatllm
 
     void BackendContext::reset()
     {
+        alloc_serial++;
         ggml_backend_sched_reset(sched);
     }
 
@@ -933,7 +949,6 @@ namespace chatllm
     void ComputeContext::compute(void)
     {
         backend_context->compute_graph(get_cgraph());
-        temp_params.clear();
     }
 
     void ComputeContext::synchronize(void)
@@ -953,6 +968,8 @@ namespace chatllm
 
     void ComputeContext::reset(void)
     {
+        // params are referenced by ops, and a graph may be computed more than once (see `GraphCache`)
+        temp_params.clear();
         backend_context->reset();
         if (get_ctx())
             ggml_reset(get_ctx());
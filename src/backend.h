@@ -160,6 +160,10 @@ namespace chatllm
         size_t get_alloc_size(ggml::tensor *tensor) override;
         size_t get_alloc_size(ggml::tensor *tensor, Usage usage) override;
 
+        // wrap host memory (owned by caller) as a buffer, without copying.
+        // nullptr if this is not a plain CPU allocator, or `ptr` is not aligned.
+        BackendBuffer *wrap_host_ptr(void *ptr, size_t size, Usage usage);
+
         bool supported_by_backend(Backend *backend, ggml::tensor *tensor) override;
 
         size_t get_alignment(Usage usage) const override;
@@ -347,6 +351,9 @@ namespace chatllm
 
         void reset();
 
+        // changes whenever allocation of the scheduler is reset or redone
+        int get_alloc_serial(void) const { return alloc_serial; }
+
         void dump_graph(ggml_cgraph *gf, const char *file_name);
 
         void set_abort_callback(struct llama_context *ctx, bool (*abort_callback)(void * data), void * abort_callback_data);
@@ -378,6 +385,7 @@ namespace chatllm
     protected:
         ggml_abort_callback abort_callback      = nullptr;
         void *              abort_callback_data = nullptr;
+        int                 alloc_serial        = 0;
 
         std::vector<ggml_backend_t> gg_backends;
         std::vector<ggml_backend_buffer_type_t> gg_bufts;
@@ -388,6 +396,8 @@ namespace chatllm
         void *                                        observe_tensor_callback_data = nullptr;
     };
 
+    class SequenceBatchInputs;
+
     class ComputeContext
     {
     public:
@@ -437,6 +447,7 @@ namespace chatllm
 
     public:
         UserOptions user_options;
+        SequenceBatchInputs *seq_inputs = nullptr;
 
     protected:
         virtual ggml_backend_sched_t get_sched(void);
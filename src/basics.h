@@ -72,11 +72,17 @@ namespace utils
     bool ends_with(const std::string& value, const std::string& ending);
 
     // for (i = start; i < end; i++) { func(i); }
+    // the first exception thrown by `func` is rethrown after all threads complete
     void parallel_for(int64_t start, int64_t end, std::function<void(int64_t)> func, int num_threads = 0);
+    // true on threads of `parallel_for`, where nested fan-outs are better avoided
+    bool is_parallel_worker(void);
 
     std::string load_file(const char *fn);
     bool save_as_bin_file(const void *data, size_t size, const char *filename);
 
+    // rename `from` to `to`, replacing `to` if it exists (which `std::rename` does not on Windows)
+    bool replace_file(const char *from, const char *to);
+
     std::string num2words(int value);
 
     std::string sec2hms(double seconds, bool hour_2digits = false, bool show_ms = false);
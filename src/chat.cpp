@@ -12,6 +12,8 @@
 #include <regex>
 #include <string>
 #include <functional>
+#include <future>
+#include <mutex>
 
 #include <sys/stat.h>
 #include <thread>
@@ -381,6 +383,49 @@ namespace chatllm
     {
         is_prompt = false;
 
+        std::string printable_text;
+        if (tokenizer->has_context_postprocess())
+            get_printable_line(output_ids, printable_text);
+        else
+            get_printable_pieces(output_ids, printable_text);
+
+        if (printable_text.size() > 0)
+        {
+            call_put_chunk(is_first, printable_text);
+            is_first = false;
+        }
+    }
+
+    void BaseStreamer::get_printable_pieces(const std::vector<int> &output_ids, std::string &printable_text)
+    {
+        // only new tokens are decoded
+        for (auto id : output_ids)
+            pending.append(get_piece(id));
+
+        if (pending.empty())
+        {
+            return;
+        }
+
+        if ((pending.back() == '\n') || (pending.back() == '\r'))
+        {
+            // flush after newline
+            printable_text.swap(pending);
+        }
+        else
+        {
+            size_t end = tokenizer::get_end_of_valid_utf8(pending, 0);
+            if (end > 0)
+            {
+                printable_text = pending.substr(0, end);
+                pending.erase(0, end);
+            }
+        }
+    }
+
+    void BaseStreamer::get_printable_line(const std::vector<int> &output_ids, std::string &printable_text)
+    {
+        // postprocessing depends on neighbouring tokens, so the whole line is decoded again
         token_cache.insert(token_cache.end(), output_ids.begin(), output_ids.end());
         std::string text = tokenizer->decode(token_cache);
         if (text.empty())
@@ -388,7 +433,6 @@ namespace chatllm
             return;
         }
 
-        std::string printable_text;
         if ((text.back() == '\n') || (text.back() == '\r'))
         {
             // flush the cache after newline
@@ -405,25 +449,28 @@ namespace chatllm
                 print_len = end;
             }
         }
+    }
 
-        if (printable_text.size() > 0)
-        {
-            call_put_chunk(is_first, printable_text);
-            is_first = false;
-        }
+    const std::string &BaseStreamer::get_piece(int id)
+    {
+        auto it = piece_cache.find(id);
+        if (it != piece_cache.end())
+            return it->second;
+        return piece_cache.emplace(id, tokenizer->decode_piece(id)).first->second;
     }
 
     void BaseStreamer::end()
     {
-        if (tokenizer)
+        if (tokenizer && tokenizer->has_context_postprocess())
         {
             std::string text = tokenizer->decode(token_cache);
             size_t end = tokenizer::get_end_of_valid_utf8(text, print_len);
             if (end > print_len)
-            {
                 call_put_chunk(is_first, text.substr(print_len));
-                print_len = end;
-            }
+        }
+        else if (tokenizer && (tokenizer::get_end_of_valid_utf8(pending, 0) > 0))
+        {
+            call_put_chunk(is_first, pending);
         }
 
         if (interceptor)
@@ -436,6 +483,7 @@ namespace chatllm
 
         is_first = true;
         is_prompt = true;
+        pending.clear();
         token_cache.clear();
         print_len = 0;
     }
@@ -660,6 +708,30 @@ namespace chatllm
         return ids;
     }
 
+    void BaseTokenizer::encode_batch(const std::vector<std::string> &texts, std::vector<std::vector<int>> &ids) const
+    {
+        ids.clear();
+        ids.resize(texts.size());
+        utils::parallel_for(0, (int64_t)texts.size(), [&](int64_t i) {
+            encode(texts[i], ids[i]);
+        });
+    }
+
+    void BaseTokenizer::encode_embedding_batch(const std::vector<std::string> &texts, std::vector<std::vector<int>> &ids, EmbeddingPurpose purpose) const
+    {
+        ids.clear();
+        ids.resize(texts.size());
+        utils::parallel_for(0, (int64_t)texts.size(), [&](int64_t i) {
+            encode_embedding(texts[i], ids[i], purpose);
+        });
+    }
+
+    std::string BaseTokenizer::decode_piece(int id) const
+    {
+        if (is_special_id(id)) return "";
+        return postprocess(tp->IdToPiece(id));
+    }
+
     std::string BaseTokenizer::decode(const std::vector<int> &ids) const
     {
         // filter out special tokens
@@ -995,7 +1067,8 @@ namespace chatllm
         CHATLLM_CHECK(fstat(fd, &sb) == 0) << strerror(errno);
         _size = sb.st_size;
 
-        data = (char *)mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        // private (copy-on-write) mapping: weights backed by the file may be patched after loading
+        data = (char *)mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
         CHATLLM_CHECK(data != MAP_FAILED) << strerror(errno);
 
         CHATLLM_CHECK(close(fd) == 0) << strerror(errno);
@@ -1015,10 +1088,10 @@ namespace chatllm
 
         HANDLE hFile = (HANDLE)_get_osfhandle(fd);
 
-        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
         CHATLLM_CHECK(hMapping != NULL) << strerror(errno);
 
-        data = (char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        data = (char *)MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
         CloseHandle(hMapping);
 
         CHATLLM_CHECK(data != NULL) << strerror(errno);
@@ -1058,6 +1131,31 @@ namespace chatllm
         return len;
     }
 
+    const void *MappedFile::get_mapped(int64_t offset)
+    {
+        return data + offset;
+    }
+
+    size_t MappedFile::read_at(int64_t offset, void *output, size_t len)
+    {
+        if (offset >= size()) return 0;
+        size_t remain = size() - offset;
+        if (len > remain) len = remain;
+        memcpy(output, data + offset, len);
+        return len;
+    }
+
+    void MappedFile::will_need(int64_t offset, size_t len)
+    {
+#ifdef _POSIX_MAPPED_FILES
+        const int64_t page = sysconf(_SC_PAGESIZE);
+        const int64_t start = offset / page * page;
+        if (start >= size()) return;
+        len = std::min((size_t)(size() - start), len + (size_t)(offset - start));
+        madvise(data + start, len, MADV_WILLNEED);
+#endif
+    }
+
     SimpleFile::SimpleFile(const std::string &path)
     {
         f = std::fopen(path.c_str(), "rb");
@@ -1096,6 +1194,111 @@ namespace chatllm
         return fread(output, 1, len, f);
     }
 
+    size_t SimpleFile::read_at(int64_t offset, void *output, size_t len)
+    {
+#if defined(_WIN32)
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        seek(offset, SEEK_SET);
+        return read_buffer(output, len);
+#else
+        const int fd = fileno(f);
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t r = pread(fd, (uint8_t *)output + done, len - done, offset + done);
+            if (r < 0)
+            {
+                if (errno == EINTR) continue;
+                CHATLLM_THROW << "SimpleFile::read_at: fails offset = " << offset + done << ": " << strerror(errno);
+            }
+            if (r == 0) break;
+            done += r;
+        }
+        return done;
+#endif
+    }
+
+    void SimpleFile::will_need(int64_t offset, size_t len)
+    {
+#if defined(__linux__)
+        posix_fadvise(fileno(f), offset, len, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    // Tensor data is read by several threads in chunks, so that there are more outstanding I/O requests.
+    static const size_t LOADER_CHUNK_SIZE = 4 * 1024 * 1024;
+    static const size_t LOADER_READ_AHEAD = 64 * 1024 * 1024;
+
+    static int loader_io_threads(void)
+    {
+        int n = (int)std::thread::hardware_concurrency();
+        return std::max(1, std::min(8, n));
+    }
+
+    static void read_parallel(tokenizer::DataReader *reader, int64_t offset, void *output, size_t len)
+    {
+        const int64_t n_chunks = (int64_t)((len + LOADER_CHUNK_SIZE - 1) / LOADER_CHUNK_SIZE);
+        if (n_chunks <= 1)
+        {
+            CHATLLM_CHECK(reader->read_at(offset, output, len) == len) << "read_parallel: unexpected EOF at " << offset;
+            return;
+        }
+
+        // errors are checked after the join: an exception must not escape a worker
+        std::vector<uint8_t> ok(n_chunks, 0);
+        utils::parallel_for(0, n_chunks, [=, &ok](int64_t i) {
+            const size_t pos = i * LOADER_CHUNK_SIZE;
+            const size_t size = std::min(LOADER_CHUNK_SIZE, len - pos);
+            try
+            {
+                ok[i] = reader->read_at(offset + pos, (uint8_t *)output + pos, size) == size;
+            }
+            catch (...)
+            {
+            }
+        }, (int)std::min((int64_t)loader_io_threads(), n_chunks));
+
+        for (int64_t i = 0; i < n_chunks; i++)
+            CHATLLM_CHECK(ok[i]) << "read_parallel: failed to read at " << offset + i * (int64_t)LOADER_CHUNK_SIZE;
+    }
+
+    // `consume` is called on this thread, while the next block is being read.
+    static void read_streaming(tokenizer::DataReader *reader, int64_t offset, size_t len,
+                               std::function<void(size_t pos, const uint8_t *data, size_t size)> consume)
+    {
+        const size_t block = LOADER_CHUNK_SIZE * loader_io_threads();
+        std::vector<uint8_t> bufs[2];
+
+        auto fetch = [&bufs, reader, offset, len, block](int id, size_t pos) -> size_t
+        {
+            const size_t size = std::min(block, len - pos);
+            bufs[id].resize(size);
+            read_parallel(reader, offset + pos, bufs[id].data(), size);
+            return size;
+        };
+
+        int cur = 0;
+        size_t pos = 0;
+        size_t size = len > 0 ? fetch(cur, 0) : 0;
+        while (pos < len)
+        {
+            const size_t next_pos = pos + size;
+            std::future<size_t> next;
+            if (next_pos < len)
+                next = std::async(std::launch::async, fetch, 1 - cur, next_pos);
+
+            consume(pos, bufs[cur].data(), size);
+
+            pos = next_pos;
+            if (next.valid())
+            {
+                size = next.get();
+                cur = 1 - cur;
+            }
+        }
+    }
+
     TensorInfo::TensorInfo(ggml::type type, int n_dim, const int64_t *ne, size_t _offset, const char *name)
         : _offset(_offset), data(nullptr), original_type(ggml::type::GGML_TYPE_F32)
     {
@@ -1138,9 +1341,23 @@ namespace chatllm
         this->original_type = ggml::type_of(tensor);
         ggml::change_type(&tensor, target_type);
         size_t alloc_size = std::max(override_buffer_size, alloc->get_alloc_size(&tensor, usage));
+        this->alloc = alloc;
+
+        // zero-copy: backed by the mapped file directly
+        const void *mapped = reader && (original_type == target_type) && (alloc_size == ggml::nbytes(&tensor))
+                                ? reader->get_mapped(aligned_data_start(_offset)) : nullptr;
+        if (mapped)
+        {
+            data = alloc->wrap_host_ptr(const_cast<void *>(mapped), alloc_size, usage);
+            if (data)
+            {
+                data->assign_to(&tensor);
+                return true;
+            }
+        }
+
         data = alloc->alloc(alloc_size, usage);
         data->assign_to(&tensor);
-        this->alloc = alloc;
 
         if (reader)
             read_tensor_data(reader, _offset, 0, ggml::nbytes(&tensor), target_type);
@@ -1162,7 +1379,7 @@ namespace chatllm
         CHATLLM_CHECK(target_type == ggml::type_of(tensor)) << "tensor type mismatch!";
         CHATLLM_CHECK(data->get_size() >= write_offset + data_size) << "read_tensor_data(" << ggml::get_name(&tensor) << "): write data exceeds tensor data size";
 
-        reader->seek(aligned_data_start(read_offset), SEEK_SET);
+        const int64_t file_offset = aligned_data_start(read_offset);
 
         if (target_type != original_type)
         {
@@ -1173,43 +1390,13 @@ namespace chatllm
                     && (ggml::type::GGML_TYPE_F32 == target_type))
                 return read_tensor_data_f16_f32(reader, read_offset, write_offset, data_size);
             else
-            {
-                std::vector<uint8_t> buf;
-                std::vector<uint8_t> buf_q;
-
-                ggml::tensor t;
-                ggml::init_tensor(&t, ggml::type::GGML_TYPE_F32, 4, tensor.ne);
-                buf.resize(ggml::nbytes(&t));
-
-                if (ggml::type::GGML_TYPE_F32 == original_type)
-                {
-                    reader->read_buffer(buf.data(), buf.size());
-                }
-                else
-                {
-                    ggml::init_tensor(&t, original_type, 4, tensor.ne);
-                    buf_q.resize(ggml::nbytes(&t));
-                    reader->read_buffer(buf_q.data(), buf_q.size());
-
-                    ggml::to_float(original_type, buf_q.data(), (float *)buf.data(), ggml::get_dim(&t, 0), ggml::nrows(&t));
-                }
-
-                ggml::init_tensor(&t, target_type, 4, tensor.ne);
-                buf_q.resize(ggml::nbytes(&t));
-                ggml::from_float(target_type, (const float *)buf.data(), (void *)buf_q.data(), ggml::get_dim(&t, 0), ggml::nrows(&t));
-
-                CHATLLM_CHECK(buf_q.size() == data_size) << "size mismatch? " << buf_q.size() << " : " << data_size;
-
-                alloc->get_backend()->write_tensor_data(&tensor, buf_q.data(), write_offset, buf_q.size());
-
-                return buf_q.size();
-            }
+                return read_tensor_data_converted(reader, read_offset, write_offset, data_size);
         }
 
 
         if (data->is_host())
         {
-            reader->read_buffer((uint8_t *)data->get_base() + write_offset, data_size);
+            read_parallel(reader, file_offset, (uint8_t *)data->get_base() + write_offset, data_size);
 #if (0)
             if (std::string(tensor.name).find("embed_tokens.weight") != std::string::npos)
             {
@@ -1247,20 +1434,87 @@ namespace chatllm
         }
         else
         {
-            const int BUF_SIZE = 1024 * 1000;
-            std::vector<uint8_t> buf;
-            buf.resize(BUF_SIZE);
-            size_t remain = data_size;
-            size_t offset = write_offset;
-            while (remain > 0)
-            {
-                size_t block = remain > buf.size() ? buf.size() : remain;
-                reader->read_buffer(buf.data(), block);
-                alloc->get_backend()->write_tensor_data(&tensor, buf.data(), offset, block);
+            read_streaming(reader, file_offset, data_size, [this, write_offset](size_t pos, const uint8_t *p, size_t size) {
+                alloc->get_backend()->write_tensor_data(&tensor, p, write_offset + pos, size);
+            });
+        }
 
-                remain -= block;
-                offset += block;
-            }
+        return data_size;
+    }
+
+    // rows are converted in tiles by several threads, without full-size staging buffers.
+    // each thread reads its own tile, so that reading and conversion are overlapped.
+    size_t TensorInfo::read_tensor_data_converted(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size)
+    {
+        const ggml::type target_type = ggml::type_of(tensor);
+        const int64_t ne0 = tensor.ne[0];
+        const size_t src_row_size = ggml::row_size(original_type, ne0);
+        const size_t dst_row_size = ggml::row_size(target_type, ne0);
+        CHATLLM_CHECK(data_size % dst_row_size == 0) << "read_tensor_data(" << ggml::get_name(&tensor) << "): partial rows: " << data_size;
+
+        const auto to_float   = ggml_get_type_traits(original_type)->to_float;
+        const auto from_float = ggml_get_type_traits(target_type)->from_float_ref;
+        CHATLLM_CHECK((ggml::type::GGML_TYPE_F32 == original_type) || to_float)   << "to_float: type not supported: "   << original_type;
+        CHATLLM_CHECK((ggml::type::GGML_TYPE_F32 == target_type)   || from_float) << "from_float: type not supported: " << target_type;
+
+        const int64_t n_rows    = (int64_t)(data_size / dst_row_size);
+        const int64_t tile_rows = std::max((int64_t)1, (int64_t)(LOADER_CHUNK_SIZE / (ne0 * sizeof(float))));
+        const int     n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        const int64_t file_offset = aligned_data_start(read_offset);
+
+        // tiles are processed in rounds. for device buffers, converted data of a round is written at once.
+        const bool host = data->is_host();
+        uint8_t *dst_base = (uint8_t *)data->get_base() + write_offset;
+        const int64_t round_rows = tile_rows * n_threads;
+        std::vector<uint8_t> round_buf(host ? 0 : std::min(n_rows, round_rows) * dst_row_size);
+
+        for (int64_t r0 = 0; r0 < n_rows; r0 += round_rows)
+        {
+            const int64_t r1 = std::min(n_rows, r0 + round_rows);
+            const int64_t n_tiles = (r1 - r0 + tile_rows - 1) / tile_rows;
+            std::vector<uint8_t> ok(n_tiles, 0);
+
+            utils::parallel_for(0, n_tiles, [&](int64_t i) {
+                const int64_t row  = r0 + i * tile_rows;
+                const int64_t rows = std::min(tile_rows, r1 - row);
+
+                std::vector<uint8_t> raw(rows * src_row_size);
+                try
+                {
+                    if (reader->read_at(file_offset + row * src_row_size, raw.data(), raw.size()) != raw.size())
+                        return;
+                }
+                catch (...)
+                {
+                    return;
+                }
+
+                std::vector<float> f32;
+                const float *src = (const float *)raw.data();
+                if (ggml::type::GGML_TYPE_F32 != original_type)
+                {
+                    f32.resize(rows * ne0);
+                    for (int64_t k = 0; k < rows; k++)
+                        to_float(raw.data() + k * src_row_size, f32.data() + k * ne0, ne0);
+                    src = f32.data();
+                }
+
+                uint8_t *dst = host ? dst_base + row * dst_row_size : round_buf.data() + (row - r0) * dst_row_size;
+                if (ggml::type::GGML_TYPE_F32 == target_type)
+                    memcpy(dst, src, rows * dst_row_size);
+                else
+                {
+                    for (int64_t k = 0; k < rows; k++)
+                        from_float(src + k * ne0, dst + k * dst_row_size, ne0);
+                }
+                ok[i] = 1;
+            }, (int)n_tiles);
+
+            for (int64_t i = 0; i < n_tiles; i++)
+                CHATLLM_CHECK(ok[i]) << "read_tensor_data(" << ggml::get_name(&tensor) << "): failed to read at " << file_offset + (r0 + i * tile_rows) * (int64_t)src_row_size;
+
+            if (!host)
+                alloc->get_backend()->write_tensor_data(&tensor, round_buf.data(), write_offset + r0 * dst_row_size, (r1 - r0) * dst_row_size);
         }
 
         return data_size;
@@ -1270,7 +1524,7 @@ namespace chatllm
     {
         std::vector<uint8_t> buf;
         buf.resize(data_size * 2);
-        reader->read_buffer(buf.data(), buf.size());
+        read_parallel(reader, aligned_data_start(read_offset), buf.data(), buf.size());
 
         ggml_fp16_t *p16 = (ggml_fp16_t *)buf.data();
            float    *p32 = (      float *)buf.data();
@@ -1291,7 +1545,7 @@ namespace chatllm
     {
         std::vector<uint8_t> buf;
         buf.resize(data_size);
-        reader->read_buffer(buf.data(), data_size / 2);
+        read_parallel(reader, aligned_data_start(read_offset), buf.data(), data_size / 2);
 
         ggml_fp16_t *p16 = (ggml_fp16_t *)buf.data();
            float    *p32 = (      float *)buf.data();
@@ -1317,6 +1571,8 @@ namespace chatllm
     {
         if (tensor_dict.size() > 0) return;
 
+        offset_tensors = tell();
+
         while (tell() < _file->size())
         {
             std::string weight_name;
@@ -1343,6 +1599,7 @@ namespace chatllm
             tensor_dict.emplace(weight_name, TensorInfo(dtype, ndim, ne, tell(), weight_name.c_str()));
 
             TensorInfo &t = tensor_dict.at(weight_name);
+            tensors_in_file.emplace(t._offset, &t);
 
             seek(t.aligned_size(), SEEK_CUR);
         }
@@ -1461,11 +1718,116 @@ namespace chatllm
             override_alloc_size = allocator->get_alloc_size(tensor, t.usage);
         }
 
+        read_ahead(t);
+
         CHATLLM_CHECK(t.load(_file.get(), allocator, tensor->type, override_alloc_size)) << "failed to load tensor: " << name;
 
         t.assign_to(tensor);
     }
 
+    static void write_or_die(FILE *f, const void *data, size_t size)
+    {
+        CHATLLM_CHECK(fwrite(data, 1, size, f) == size) << "write file failed: " << strerror(errno);
+    }
+
+    // saved as GGMM. model type, config and tokenizer are copied, with `dtype` of config patched.
+    // tensors loaded by the model are saved in their loaded types, and others are copied as is.
+    void ModelLoader::save_as(const std::string &path, int config_dtype, const std::string &new_meta)
+    {
+        CHATLLM_CHECK(offset_tensors > 0) << "save_as: tensors not loaded yet";
+
+        FILE *f = std::fopen(path.c_str(), "wb");
+        CHATLLM_CHECK(f != nullptr) << "cannot open file " << path << ": " << strerror(errno);
+
+        std::string meta_bytes = new_meta.size() > 0 ? new_meta : meta;
+        meta_bytes.resize((meta_bytes.size() + 3) / 4 * 4, '\0');
+
+        const size_t body_start = ff == FileFormat::GGMM ? ggml_header.offset_config : 4;
+        const size_t new_body_start = 4 + sizeof(uint32_t) + sizeof(GGMMHeader) + meta_bytes.size();
+        const int64_t delta = (int64_t)new_body_start - (int64_t)body_start;
+
+        const uint32_t GGMM_VER = 1;
+        GGMMHeader header = {
+            .offset_config      = (uint32_t)new_body_start,
+            .offset_tokenizer   = (uint32_t)(offset_tokenizer + delta),
+            .offset_tensors     = (uint32_t)(offset_tensors + delta),
+        };
+        write_or_die(f, "ggmm", 4);
+        write_or_die(f, &GGMM_VER, sizeof(GGMM_VER));
+        write_or_die(f, &header, sizeof(header));
+        write_or_die(f, meta_bytes.data(), meta_bytes.size());
+
+        std::vector<uint8_t> buf(offset_tensors - body_start);
+        CHATLLM_CHECK(_file->read_at(body_start, buf.data(), buf.size()) == buf.size()) << "save_as: unexpected EOF";
+        if (config_dtype >= 0)
+        {
+            CHATLLM_CHECK((offset_config >= body_start) && (offset_config + sizeof(ggml::type) <= offset_tensors)) << "save_as: bad config offset";
+            ggml::type dtype = (ggml::type)config_dtype;
+            memcpy(buf.data() + offset_config - body_start + offsetof(BaseConfig, dtype), &dtype, sizeof(dtype));
+        }
+        write_or_die(f, buf.data(), buf.size());
+
+        size_t offset = new_body_start + buf.size();
+        for (auto &kv : tensors_in_file)
+        {
+            TensorInfo &t = *kv.second;
+            const bool loaded = t.data != nullptr;
+            const std::string name = ggml::get_name(&t.tensor);
+
+            // a piece of a concatenated tensor is saved from the loaded one
+            auto piece = concat_pieces.find(name);
+            TensorInfo *concat = (!loaded && (piece != concat_pieces.end()) && piece->second.first->data) ? piece->second.first : nullptr;
+
+            int name_size = (int)name.size();
+            int ndim = ggml::n_dims(&t.tensor);
+            int dtype = loaded ? ggml::type_of(t.tensor) : concat ? ggml::type_of(concat->tensor) : t.tensor.type;
+            write_or_die(f, &name_size, sizeof(name_size));
+            write_or_die(f, name.data(), name.size());
+            write_or_die(f, &ndim, sizeof(ndim));
+            for (int i = ndim - 1; i >= 0; i--)
+            {
+                int dim_size = (int)t.tensor.ne[i];
+                write_or_die(f, &dim_size, sizeof(dim_size));
+            }
+            write_or_die(f, &dtype, sizeof(dtype));
+            offset += sizeof(int) * (3 + ndim) + name.size();
+
+            const size_t padding = t.aligned_data_start(offset) - offset;
+            buf.assign(padding, 0);
+            write_or_die(f, buf.data(), padding);
+            offset += padding;
+
+            const size_t size = concat ? ggml::row_size((ggml::type)dtype, t.tensor.ne[0]) * (ggml::nelements(&t.tensor) / t.tensor.ne[0])
+                                       : t.get_nbytes();
+            buf.resize(size);
+            if (loaded)
+                Backend::read_tensor_data(&t.tensor, buf.data(), 0, size);
+            else if (concat)
+            {
+                CHATLLM_CHECK(piece->second.second + size <= concat->get_nbytes()) << "save_as: " << name << " exceeds " << ggml::get_name(&concat->tensor);
+                Backend::read_tensor_data(&concat->tensor, buf.data(), piece->second.second, size);
+            }
+            else
+                read_parallel(_file.get(), t.aligned_data_start(t._offset), buf.data(), size);
+            write_or_die(f, buf.data(), size);
+            offset += size;
+        }
+
+        CHATLLM_CHECK(std::fclose(f) == 0) << "write file failed: " << strerror(errno);
+    }
+
+    // let OS prefetch tensors following `t` in the file, while `t` is being loaded (and converted)
+    void ModelLoader::read_ahead(const TensorInfo &t)
+    {
+        size_t budget = LOADER_READ_AHEAD;
+        for (auto it = tensors_in_file.upper_bound(t._offset); (it != tensors_in_file.end()) && (budget > 0); ++it)
+        {
+            size_t len = std::min(budget, it->second->aligned_size());
+            _file->will_need(it->first, len);
+            budget -= len;
+        }
+    }
+
     std::string ModelLoader::translate_tensor_name(const std::string &name) const
     {
         std::string translated_name = name;
@@ -1524,6 +1886,7 @@ namespace chatllm
 
             size_t size = search->second.get_nbytes();
             t.read_tensor_data(_file.get(), search->second._offset, write_offset, size, tensor->type);
+            concat_pieces[translated] = std::make_pair(&t, write_offset);
 
             write_offset += size;
             total_size -= size;
@@ -1571,15 +1934,140 @@ namespace chatllm
     {
     }
 
+    // identity of a model file, without reading through it: size, mtime, and hash of its head and tail.
+    static json::JSON model_file_identity(const std::string &path)
+    {
+        struct stat sb;
+        CHATLLM_CHECK(stat(path.c_str(), &sb) == 0) << "cannot stat file " << path << ": " << strerror(errno);
+
+        SimpleFile file(path);
+        const size_t SAMPLE_SIZE = 1024 * 1024;
+        const int64_t size = file.size();
+        std::vector<uint8_t> buf((size_t)std::min((int64_t)SAMPLE_SIZE * 2, size));
+        const size_t head = std::min(buf.size(), SAMPLE_SIZE);
+        file.read_at(0, buf.data(), head);
+        file.read_at(size - (int64_t)(buf.size() - head), buf.data() + head, buf.size() - head);
+
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (auto b : buf)
+        {
+            hash ^= b;
+            hash *= 0x100000001b3ull;
+        }
+
+        std::ostringstream oss;
+        oss << std::hex << std::setw(16) << std::setfill('0') << hash;
+
+        json::JSON r = json::Object();
+        r["size"]  = (long long)size;
+        r["mtime"] = (long long)sb.st_mtime;
+        r["hash"]  = oss.str();
+        return r;
+    }
+
+    // cache of a model transformed by loading options (`re_quantize` and `layer_spec`), saved next to the model file.
+    static std::string model_cache_path(const std::string &path, const ModelObject::extra_args &args, std::string &key)
+    {
+        json::JSON options = json::Object();
+        options["source"]       = model_file_identity(path);
+        options["re_quantize"]  = args.re_quantize >= 0 ? ggml::type_to_str((ggml::type)args.re_quantize) : std::string("");
+        options["layer_spec"]   = args.layer_spec;
+        key = options.dumpMinified();
+
+        uint32_t hash = 0x811c9dc5;
+        for (auto c : key)
+        {
+            hash ^= (uint8_t)c;
+            hash *= 0x01000193;
+        }
+
+        std::ostringstream oss;
+        oss << path << "." << std::hex << std::setw(8) << std::setfill('0') << hash << ".cache";
+        return oss.str();
+    }
+
+    static void drop_model_cache(const std::string &cache_path, const char *reason)
+    {
+        ggml::log(GGML_LOG_LEVEL_WARN, "bad model cache %s (%s), reloading from source\n", cache_path.c_str(), reason);
+        std::remove(cache_path.c_str());
+    }
+
+    static bool is_valid_model_cache(const std::string &cache_path, const std::string &key)
+    {
+        struct stat sb;
+        if (stat(cache_path.c_str(), &sb) != 0) return false;
+
+        try
+        {
+            ModelLoader cache(cache_path);
+            ModelFactory::load_file_header(cache);
+            return cache.meta_json["model_cache"].dumpMinified() == key;
+        }
+        catch (std::exception &e)
+        {
+            drop_model_cache(cache_path, e.what());
+            return false;
+        }
+    }
+
     ModelObject::ModelObject(const std::string &path, const extra_args &args)
         : loader(nullptr), loaded(path.size() > 0)
     {
         ModelFactory::Result result = {nullptr, nullptr};
         if (path.size() > 0)
         {
-            loader = std::unique_ptr<ModelLoader>(new ModelLoader(path));
-            if (!ModelFactory::load(*loader, result, args))
-                CHATLLM_THROW << "ModelFactory::load() failed";
+            // `layer_spec` selects which tensors are loaded (thus re-quantized), so it is a part of the key.
+            const bool use_cache = args.model_cache && (args.re_quantize >= 0);
+            std::string key;
+            const std::string cache_path = use_cache ? model_cache_path(path, args, key) : "";
+
+            bool from_cache = false;
+            if (use_cache && is_valid_model_cache(cache_path, key))
+            {
+                // weights are already in target types, and can be used directly from the mapped file
+                extra_args cache_args(args);
+                cache_args.re_quantize = -1;
+                cache_args.use_mmap = true;
+                try
+                {
+                    loader = std::unique_ptr<ModelLoader>(new ModelLoader(cache_path, true));
+                    if (!ModelFactory::load(*loader, result, cache_args))
+                        CHATLLM_THROW << "ModelFactory::load() failed";
+                    from_cache = true;
+                }
+                catch (std::exception &e)
+                {
+                    result.model.reset();
+                    result.tokenizer.reset();
+                    loader.reset();
+                    drop_model_cache(cache_path, e.what());
+                }
+            }
+
+            if (!from_cache)
+            {
+                loader = std::unique_ptr<ModelLoader>(new ModelLoader(path, args.use_mmap));
+                if (!ModelFactory::load(*loader, result, args))
+                    CHATLLM_THROW << "ModelFactory::load() failed";
+
+                if (use_cache)
+                {
+                    json::JSON meta = loader->meta_json;
+                    meta["model_cache"] = json::JSON::Load(key);
+
+                    const std::string tmp_path = cache_path + ".tmp";
+                    try
+                    {
+                        loader->save_as(tmp_path, args.re_quantize, meta.dumpMinified());
+                        CHATLLM_CHECK(utils::replace_file(tmp_path.c_str(), cache_path.c_str())) << strerror(errno);
+                    }
+                    catch (std::exception &e)
+                    {
+                        std::remove(tmp_path.c_str());
+                        ggml::log(GGML_LOG_LEVEL_WARN, "failed to save model cache %s: %s\n", cache_path.c_str(), e.what());
+                    }
+                }
+            }
         }
 
         tokenizer = std::move(result.tokenizer);
@@ -1592,7 +2080,7 @@ namespace chatllm
         return ModelFactory::load_model_again(*loader, args);
     }
 
-    ModelSessionMemory::ModelSessionMemory() : n_past(0), n_past_offset(0)
+    ModelSessionMemory::ModelSessionMemory() : n_past(0), n_past_offset(0), n_cells(0)
     {
     }
 
@@ -1647,15 +2135,26 @@ namespace chatllm
         return n_past_offset;
     }
 
+    void ModelSessionMemory::set_n_cells(int n_cells)
+    {
+        this->n_cells = n_cells;
+    }
+
+    int ModelSessionMemory::get_n_cells(void) const
+    {
+        return n_cells;
+    }
+
     void ModelSessionMemory::copy_from(const ModelSessionMemory &sess)
     {
         if (this == &sess) return;
 
         n_past = sess.n_past;
         n_past_offset = sess.n_past_offset;
+        n_cells = sess.n_cells;
 
-        for (int i = 0; i < (int)buffers.size(); i++)
-            memcpy(buffers[i].data(), sess.buffers[i].data(), buffers[i].size());
+        // sizes differ when `n_cells` does
+        buffers = sess.buffers;
     }
 
     void ModelSessionMemory::dump(const char *fn)
@@ -1679,8 +2178,275 @@ namespace chatllm
         fclose(f);
     }
 
+    void SequenceBatch::clear(void)
+    {
+        ids.clear();
+        pos.clear();
+        cells.clear();
+        outputs.clear();
+        mask.clear();
+        n_cells = 0;
+    }
+
+    int SequenceBatch::add(int id, int pos, int cell, bool output)
+    {
+        const int index = (int)ids.size();
+        ids.push_back(id);
+        this->pos.push_back(pos);
+        cells.push_back(cell);
+        if (output)
+            outputs.push_back(index);
+        if (cell >= n_cells)
+            n_cells = cell + 1;
+        return index;
+    }
+
+    KVCellBlockAllocator::KVCellBlockAllocator(int n_cells, int block_size)
+        : block_size(block_size > 0 ? block_size : 1)
+    {
+        blocks.resize(n_cells / this->block_size);
+        for (int i = 0; i < (int)blocks.size(); i++)
+            free_blocks.insert(i);
+    }
+
+    int KVCellBlockAllocator::get_used_cells(void) const
+    {
+        int n = (int)blocks.size();
+        while ((n > 0) && (blocks[n - 1].ref == 0))
+            n--;
+        return n * block_size;
+    }
+
+    int KVCellBlockAllocator::alloc(void)
+    {
+        // lowest blocks first, so that the range of cells in use stays compact
+        if (free_blocks.empty()) return -1;
+        const int block = *free_blocks.begin();
+        free_blocks.erase(free_blocks.begin());
+        blocks[block].ref = 1;
+        return block;
+    }
+
+    void KVCellBlockAllocator::unref(int block)
+    {
+        auto &b = blocks[block];
+        if (--b.ref > 0) return;
+
+        if (b.hash != 0)
+            published.erase(b.hash);
+        b.hash = 0;
+        b.parent = -1;
+        b.tokens.clear();
+        free_blocks.insert(block);
+    }
+
+    bool KVCellBlockAllocator::reserve(std::vector<int> &table, int n_tokens)
+    {
+        const size_t n_owned = table.size();
+        while ((int)table.size() * block_size < n_tokens)
+        {
+            const int block = alloc();
+            if (block < 0)
+            {
+                // all or nothing
+                for (size_t i = n_owned; i < table.size(); i++)
+                    unref(table[i]);
+                table.resize(n_owned);
+                return false;
+            }
+            table.push_back(block);
+        }
+        return true;
+    }
+
+    void KVCellBlockAllocator::release(std::vector<int> &table)
+    {
+        for (auto b : table)
+            unref(b);
+        table.clear();
+    }
+
+    uint64_t KVCellBlockAllocator::hash_block(uint64_t parent_hash, const int *tokens, int n)
+    {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ULL ^ parent_hash;
+        for (int i = 0; i < n; i++)
+        {
+            h ^= (uint32_t)tokens[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h != 0 ? h : 1;
+    }
+
+    void KVCellBlockAllocator::publish(const std::vector<int> &table, const std::vector<int> &tokens)
+    {
+        const int n = std::min((int)table.size(), (int)tokens.size() / block_size);
+        uint64_t h = 0;
+        for (int i = 0; i < n; i++)
+        {
+            auto &b = blocks[table[i]];
+            if (b.hash != 0)
+            {
+                h = b.hash;
+                continue;
+            }
+
+            h = hash_block(h, tokens.data() + i * block_size, block_size);
+            if (published.find(h) != published.end())
+                continue;
+
+            b.hash   = h;
+            b.parent = i > 0 ? table[i - 1] : -1;
+            b.tokens.assign(tokens.begin() + i * block_size, tokens.begin() + (i + 1) * block_size);
+            published.emplace(h, table[i]);
+        }
+    }
+
+    int KVCellBlockAllocator::match(const std::vector<int> &tokens, int max_tokens, std::vector<int> &table)
+    {
+        CHATLLM_CHECK(table.size() == 0) << "match: table must be empty";
+
+        const int n = std::min(max_tokens, (int)tokens.size()) / block_size;
+        uint64_t h = 0;
+        int parent = -1;
+        for (int i = 0; i < n; i++)
+        {
+            const int *p = tokens.data() + i * block_size;
+            h = hash_block(h, p, block_size);
+
+            auto it = published.find(h);
+            if (it == published.end()) break;
+
+            // verify, hash is not trusted
+            auto &b = blocks[it->second];
+            if ((b.parent != parent) || !std::equal(b.tokens.begin(), b.tokens.end(), p)) break;
+
+            b.ref++;
+            table.push_back(it->second);
+            parent = it->second;
+        }
+        return (int)table.size() * block_size;
+    }
+
+    void KVCellBlockAllocator::share(const std::vector<int> &table, std::vector<int> &copy)
+    {
+        CHATLLM_CHECK(copy.size() == 0) << "share: copy must be empty";
+        for (auto b : table)
+        {
+            blocks[b].ref++;
+            copy.push_back(b);
+        }
+    }
+
+    void KVCellBlockAllocator::build_mask(SequenceBatch &batch, const std::vector<const std::vector<int> *> &tables) const
+    {
+        // padded, so that the shape (thus the graph) of decoding steps seldom changes
+        const int pad = 256;
+        const int n_cells  = std::min((get_used_cells() + pad - 1) / pad * pad, (int)blocks.size() * block_size);
+        const int n_tokens = batch.get_n_tokens();
+        batch.n_cells = n_cells;
+
+        batch.mask.assign((size_t)n_tokens * n_cells, -INFINITY);
+        for (int t = 0; t < n_tokens; t++)
+        {
+            const auto &table = *tables[t];
+            float *row = batch.mask.data() + (size_t)t * n_cells;
+            for (int pos = 0; pos <= batch.pos[t]; pos++)
+                row[cell_of(table, pos)] = 0.0f;
+        }
+    }
+
     // ===== pipeline =====
 
+    void PrefixCache::set_capacity(int capacity)
+    {
+        this->capacity = capacity;
+        if (capacity <= 0)
+            clear();
+        while ((int)entries.size() > this->capacity)
+        {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+                if (it->second->last_used < lru->second->last_used) lru = it;
+            lengths.erase(lengths.find(lru->second->tokens.size()));
+            entries.erase(lru);
+        }
+    }
+
+    void PrefixCache::clear(void)
+    {
+        entries.clear();
+        lengths.clear();
+    }
+
+    uint64_t PrefixCache::hash(uint64_t h, int token)
+    {
+        // FNV-1a
+        h ^= (uint32_t)token;
+        return h * 0x100000001b3ULL;
+    }
+
+    int PrefixCache::restore(AbstractModel *model, const std::vector<int> &input_ids)
+    {
+        if (entries.size() < 1) return 0;
+
+        Entry *best = nullptr;
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i + 1 < input_ids.size(); i++)
+        {
+            h = hash(h, input_ids[i]);
+            if (lengths.find(i + 1) == lengths.end()) continue;
+
+            auto it = entries.find(h);
+            if (it == entries.end()) continue;
+
+            auto &tokens = it->second->tokens;
+            if ((tokens.size() == i + 1) && std::equal(tokens.begin(), tokens.end(), input_ids.begin()))
+                best = it->second.get();
+        }
+
+        if (nullptr == best) return 0;
+        if (model->load_session(best->session) != 0) return 0;
+        model->set_sampling_prefix(best->tokens);
+
+        best->last_used = ++tick;
+        return (int)best->tokens.size();
+    }
+
+    void PrefixCache::save(AbstractModel *model, const std::vector<int> &prefix)
+    {
+        if ((capacity <= 0) || (prefix.size() < 1)) return;
+        if (model->get_n_past() < (int)prefix.size()) return;
+
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (auto id : prefix)
+            h = hash(h, id);
+
+        auto it = entries.find(h);
+        if (it != entries.end())
+        {
+            it->second->last_used = ++tick;
+            return;
+        }
+
+        auto entry = std::make_unique<Entry>();
+        // cells are addressed by positions, so only those of the prefix are kept
+        if (model->supports_sequence_batch())
+            entry->session.set_n_cells((int)prefix.size());
+        if (model->save_session(entry->session) != 0) return;
+
+        // positions are shifted, KV does not match token ids any more
+        if (entry->session.get_n_past_offset() != 0) return;
+
+        entry->session.set_n_past((int)prefix.size());
+        entry->tokens    = prefix;
+        entry->last_used = ++tick;
+
+        entries[h] = std::move(entry);
+        lengths.insert(prefix.size());
+        set_capacity(capacity);
+    }
+
     Pipeline::Pipeline(const std::string &path)
         : Pipeline(path, ModelObject::extra_args())
     {
@@ -1711,7 +2477,8 @@ namespace chatllm
         input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
         add_ai_prefix(input_ids, gen_config, streamer);
 
-        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
+        std::vector<int> output_ids = continuous ? model->generate(input_ids, gen_config, continuous, completed, &performance, streamer)
+                                                 : generate_from_scratch(input_ids, gen_config, completed, streamer);
         if (!completed)
         {
             if (continuous)
@@ -1719,7 +2486,7 @@ namespace chatllm
                 streamer->putln("\nRUN OUT OF CONTEXT. Let me forget something and try again ...\n");
                 input_ids = tokenizer->encode_history(history, gen_config.max_context_length, false, true, gen_config.reversed_role);
                 add_ai_prefix(input_ids, gen_config, streamer);
-                output_ids = model->generate(input_ids, gen_config, false, completed, &performance, streamer);
+                output_ids = generate_from_scratch(input_ids, gen_config, completed, streamer);
             }
             else
                 streamer->putln("\nRUN OUT OF CONTEXT. I have to stop now.\n");
@@ -1745,7 +2512,8 @@ namespace chatllm
         input_ids = tokenizer->encode_history(history, gen_config.max_context_length, continuous, true, gen_config.reversed_role);
         add_ai_prefix(input_ids, gen_config, streamer);
 
-        std::vector<int> output_ids = model->generate(input_ids, gen_config, continuous, completed, &performance, streamer);
+        std::vector<int> output_ids = continuous ? model->generate(input_ids, gen_config, continuous, completed, &performance, streamer)
+                                                 : generate_from_scratch(input_ids, gen_config, completed, streamer);
         if (!completed)
         {
             streamer->putln("\nRUN OUT OF CONTEXT. I have to stop now.\n");
@@ -1789,6 +2557,28 @@ namespace chatllm
         return output;
     }
 
+    std::vector<int> Pipeline::generate_from_scratch(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
+                               bool &completed, BaseStreamer *streamer)
+    {
+        const int reused = prefix_cache.restore(model, input_ids);
+        std::vector<int> output_ids;
+        if (reused > 0)
+        {
+            std::vector<int> suffix(input_ids.begin() + reused, input_ids.end());
+            output_ids = model->generate(suffix, gen_config, true, completed, &performance, streamer);
+        }
+        else
+            output_ids = model->generate(input_ids, gen_config, false, completed, &performance, streamer);
+
+        // KV of system prompt is still there, as long as the history starts with it
+        std::vector<int> sys_ids = tokenizer->encode_sys_prompt();
+        if ((sys_ids.size() > 0) && (sys_ids.size() < input_ids.size())
+            && std::equal(sys_ids.begin(), sys_ids.end(), input_ids.begin()))
+            prefix_cache.save(model, sys_ids);
+
+        return output_ids;
+    }
+
     void Pipeline::eval_sys_prompt(const GenerationConfig &gen_config)
     {
         bool completed = false;
@@ -1796,7 +2586,10 @@ namespace chatllm
 
         GenerationConfig copy(gen_config);
         copy.max_new_tokens = 1;
-        model->generate(input_ids, copy, false, completed, &performance, nullptr);
+        const int reused = prefix_cache.restore(model, input_ids);
+        std::vector<int> suffix(input_ids.begin() + reused, input_ids.end());
+        model->generate(suffix, copy, reused > 0, completed, &performance, nullptr);
+        prefix_cache.save(model, input_ids);
 
         // just in case that chatting is continued
         tokenizer->set_skip_sys_prompt(true);
@@ -1936,6 +2729,22 @@ namespace chatllm
         model->text_embedding(gen_config, input_ids, result);
     }
 
+    void Pipeline::text_embedding(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose)
+    {
+        if (!modelobj.loaded) return;
+        performance.Reset();
+
+        std::vector<std::vector<int>> input_ids;
+        tokenizer->encode_embedding_batch(inputs, input_ids, purpose);
+
+        size_t n_tokens = 0;
+        for (auto &ids : input_ids)
+            n_tokens += ids.size();
+
+        model->text_embedding_batch(gen_config, input_ids, result);
+        performance.Accumulate(ModelPerfInfo::Type::Prompt, n_tokens);
+    }
+
     bool Pipeline::speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels)
     {
         if (!modelobj.loaded) return false;
@@ -2055,6 +2864,48 @@ namespace chatllm
         return model->qa_rank(gen_config, input_ids);
     }
 
+    bool Pipeline::chat_batch(const std::vector<std::string> &prompts, const GenerationConfig &gen_config, std::vector<std::string> &replies)
+    {
+        if (!modelobj.loaded || !model->supports_sequence_batch()) return false;
+
+        // the batch takes over the whole KV cache, so the current chat is saved and restored afterwards
+        ModelSessionMemory session;
+        const bool resume = model->get_n_past() > 0;
+        if (resume)
+            CHATLLM_CHECK(model->save_session(session) == 0) << "chat_batch: failed to save session";
+
+        replies.assign(prompts.size(), "");
+        performance.Reset();
+
+        ContinuousBatchScheduler scheduler(model, tokenizer, gen_config);
+        std::map<int, size_t> index_of;
+        scheduler.on_completed = [&](int id, const std::vector<int> &output_ids)
+        {
+            replies[index_of[id]] = tokenizer->decode(output_ids);
+            performance.Accumulate(ModelPerfInfo::Type::Generation, output_ids.size());
+        };
+
+        for (size_t i = 0; i < prompts.size(); i++)
+        {
+            Messages history;
+            history.push_back(prompts[i], MsgRole::User);
+            std::vector<int> input_ids = tokenizer->encode_history(history, gen_config.max_context_length);
+            if (input_ids.size() < 1) continue;
+
+            index_of[scheduler.add_request(input_ids)] = i;
+            performance.Accumulate(ModelPerfInfo::Type::Prompt, input_ids.size());
+        }
+
+        while (scheduler.step())
+            ;
+
+        if (resume)
+            CHATLLM_CHECK(model->load_session(session) == 0) << "chat_batch: failed to restore session";
+        else
+            model->set_n_past(0);
+        return true;
+    }
+
     void Pipeline::set_system_prompt(const std::string &prompt)
     {
         if (!modelobj.loaded) return;
@@ -2071,6 +2922,7 @@ namespace chatllm
         if (!modelobj.loaded) return;
         tokenizer->set_additional_args(args);
         model->set_additional_args(args);
+        prefix_cache.set_capacity(utils::get_opt(args, "prefix_cache", prefix_cache.get_capacity()));
     }
 
     void Pipeline::before_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
@@ -2087,7 +2939,7 @@ namespace chatllm
         : Pipeline(path, args),
           composer(),
           hide_reference(false),
-          retrieve_top_n(5), rerank_top_n(3),
+          retrieve_top_n(5), retrieve_probes(0), rerank_top_n(3),
           dump(false),
           rerank_score_threshold(0.5f),
           rag_post_extending(0),
@@ -2104,16 +2956,20 @@ namespace chatllm
         std::vector<float> scores;
         std::vector<size_t> order;
         std::vector<int64_t> result;
+        std::vector<std::vector<int>> input_ids(candidates.size());
 
+        // a few candidates only; tokenizers may run in parallel themselves for long texts
         for (size_t i = 0; i < candidates.size(); i++)
         {
-            std::vector<int> input_ids;
             std::string c, m;
             vs.get()->GetRecord(candidates[i], c, m);
-            reranker->tokenizer->encode_qa(query, c, input_ids);
-            scores.push_back(reranker->model->qa_rank(gen_config, input_ids));
+            reranker->tokenizer->encode_qa(query, c, input_ids[i]);
         }
 
+        // all candidates are scored in a few runs
+        reranker->model->qa_rank_batch(gen_config, input_ids, scores);
+        CHATLLM_CHECK(scores.size() == candidates.size()) << "rerank: scores missing";
+
         utils::ordering(scores, order, true);
 
         if (top_n > (int)order.size()) top_n = (int)order.size();
@@ -2186,7 +3042,7 @@ namespace chatllm
 
         text_embedding(rewritten_query, gen_config, query_emb, BaseTokenizer::EmbeddingPurpose::Query);
 
-        vs.get()->Query(query_emb, selected, retrieve_top_n);
+        vs.get()->Query(query_emb, selected, retrieve_top_n, retrieve_probes);
 
         if (reranker != nullptr)
             rerank(rerank_rewrite ? rewritten_query : query, selected, gen_config, rerank_top_n);
@@ -2625,10 +3481,12 @@ final:
     {
         std::vector<int> input_ids = tokenizer->encode_history(history, gen_config.max_context_length, false, true, gen_config.reversed_role);
 
+        // like `do_chat_batched`, `max_length` counts the prompt as well
+        const int max_new_tokens = std::max(1, gen_config.max_length - (int)input_ids.size());
         for (auto &beam : beams)
         {
             beam.clear({});
-            beam.set_max_length(gen_config.max_length);
+            beam.set_max_length(max_new_tokens);
         }
         model->set_n_past(0);
 
@@ -2648,11 +3506,11 @@ final:
         }
     }
 
-    void BeamSearchPipeline::do_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
+    void BeamSearchPipeline::do_chat_with_sessions(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
     {
         bool completed = false;
-        std::vector<int> input_ids;
 
+        pool.reset();
         do_chat0(history, gen_config, streamer);
 
         while (!completed)
@@ -2678,85 +3536,208 @@ final:
             if (completed)
                 break;
 
-            std::vector<int> selected_ids;
-            std::vector<int> remaining_beams;
-            std::vector<float> all_logits;
-            for (int i = 0; i < (int)beams.size(); i++)
-            {
-                if (beams[i].completed)
-                    continue;
-                remaining_beams.push_back(i);
+            select_beams();
+        }
+    }
 
-                all_logits.insert(all_logits.end(), beams[i].scores.begin(), beams[i].scores.end());
-            }
+    void BeamSearchPipeline::fork_beam(Beam &dst, const Beam &src)
+    {
+        if (pool)
+        {
+            pool->release(dst.blocks);
+            pool->share(src.blocks, dst.blocks);
+        }
+        else
+            dst.session.copy_from(src.session);
+    }
 
-            topk_sampling(all_logits, (int)beams.size(), selected_ids);
+    void BeamSearchPipeline::select_beams(void)
+    {
+        std::vector<int> selected_ids;
+        std::vector<int> remaining_beams;
+        std::vector<float> all_logits;
+        for (int i = 0; i < (int)beams.size(); i++)
+        {
+            if (beams[i].completed)
+                continue;
+            remaining_beams.push_back(i);
 
-            std::vector<std::vector<int>> selected_traces;
-            for (int i = 0; i < (int)selected_ids.size(); i++)
-            {
-                int beam_id = selected_ids[i] / tokenizer->get_vocab_size();
-                beam_id = remaining_beams[beam_id];
+            all_logits.insert(all_logits.end(), beams[i].scores.begin(), beams[i].scores.end());
+        }
 
-                selected_traces.push_back({});
+        topk_sampling(all_logits, (int)beams.size(), selected_ids);
 
-                selected_traces[i].insert(selected_traces[i].end(), beams[beam_id].trace.begin(), beams[beam_id].trace.end());
-            }
+        std::vector<std::vector<int>> selected_traces;
+        for (int i = 0; i < (int)selected_ids.size(); i++)
+        {
+            int beam_id = selected_ids[i] / tokenizer->get_vocab_size();
+            beam_id = remaining_beams[beam_id];
+
+            selected_traces.push_back({});
+
+            selected_traces[i].insert(selected_traces[i].end(), beams[beam_id].trace.begin(), beams[beam_id].trace.end());
+        }
 
-            std::set<int> updated_beams;
-            std::vector<int> candidates;
-            for (int i = 0; i < (int)remaining_beams.size(); i++)
+        std::set<int> updated_beams;
+        std::vector<int> candidates;
+        for (int i = 0; i < (int)remaining_beams.size(); i++)
+        {
+            int beam_id = selected_ids[i] / tokenizer->get_vocab_size();
+            beam_id = remaining_beams[beam_id];
+            if (updated_beams.find(beam_id) != updated_beams.end())
             {
-                int beam_id = selected_ids[i] / tokenizer->get_vocab_size();
-                beam_id = remaining_beams[beam_id];
-                if (updated_beams.find(beam_id) != updated_beams.end())
-                {
-                    candidates.push_back(i);
-                    continue;
-                }
+                candidates.push_back(i);
+                continue;
+            }
+
+            updated_beams.emplace(beam_id);
+
+            int tok_id = selected_ids[i] % tokenizer->get_vocab_size();
+            beams[beam_id].add(tok_id, beams[beam_id].scores[tok_id]);
+        }
 
-                updated_beams.emplace(beam_id);
+        int candidate_id = 0;
+        for (int i = 0; i < (int)beams.size(); i++)
+        {
+            if ((beams[i].completed) || (updated_beams.find(i) != updated_beams.end()))
+                continue;
+            updated_beams.emplace(i);
+
+            const int selection = candidates[candidate_id++];
+
+            int beam_id = selected_ids[selection] / tokenizer->get_vocab_size();
+            beam_id = remaining_beams[beam_id];
+            int tok_id = selected_ids[selection] % tokenizer->get_vocab_size();
 
-                int tok_id = selected_ids[i] % tokenizer->get_vocab_size();
-                beams[beam_id].add(tok_id, beams[beam_id].scores[tok_id]);
+            beams[i].clear(selected_traces[selection]);
+            beams[i].add(tok_id, beams[beam_id].scores[tok_id]);
+            fork_beam(beams[i], beams[beam_id]);
+        }
+
+        int selection = (int)remaining_beams.size();
+        for (int i = 0; i < (int)beams.size(); i++)
+        {
+            if (updated_beams.find(i) != updated_beams.end()) continue;
+
+            int beam_id = selected_ids[selection] / tokenizer->get_vocab_size();
+            beam_id = remaining_beams[beam_id];
+            int tok_id = selected_ids[selection] % tokenizer->get_vocab_size();
+
+            if (beams[i].score > beams[beam_id].scores[tok_id]) continue;
+
+            beams[i].clear(selected_traces[selection]);
+            beams[i].add(tok_id, beams[beam_id].scores[tok_id]);
+            fork_beam(beams[i], beams[beam_id]);
+
+            selection++;
+        }
+    }
+
+    bool BeamSearchPipeline::do_chat_batched(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
+    {
+        if (!model->supports_sequence_batch()) return false;
+
+        const int max_tokens_per_step = 512;
+        std::vector<int> input_ids = tokenizer->encode_history(history, gen_config.max_context_length, false, true, gen_config.reversed_role);
+        const int n_prompt = (int)input_ids.size();
+        if ((n_prompt < 1) || (n_prompt >= gen_config.max_length)) return false;
+
+        // one cell per block, so that beams can share any prefix
+        pool.reset(new KVCellBlockAllocator(model->get_max_length(), 1));
+
+        std::vector<int> root;
+        CHATLLM_CHECK(pool->reserve(root, n_prompt)) << "out of KV cells";
+
+        SequenceBatch batch;
+        std::vector<const std::vector<int> *> tables;
+        std::vector<float> lm_logits;
+        for (int i = 0; i < n_prompt; i += max_tokens_per_step)
+        {
+            const int n = std::min(max_tokens_per_step, n_prompt - i);
+            batch.clear();
+            tables.assign(n, &root);
+            for (int j = i; j < i + n; j++)
+                batch.add(input_ids[j], j, pool->cell_of(root, j), j == i + n - 1);
+            pool->build_mask(batch, tables);
+
+            if (!model->decode_batch(gen_config, batch, lm_logits))
+            {
+                pool.reset();
+                return false;
             }
+        }
+
+        log_soft_max(lm_logits);
+
+        std::vector<int> selected_ids;
+        topk_sampling(lm_logits, (int)beams.size(), selected_ids);
 
-            int candidate_id = 0;
-            for (int i = 0; i < (int)beams.size(); i++)
+        for (int i = 0; i < (int)beams.size(); i++)
+        {
+            beams[i].clear({});
+            beams[i].set_max_length(gen_config.max_length - n_prompt);
+            beams[i].add(selected_ids[i], lm_logits[selected_ids[i]]);
+            beams[i].blocks.clear();
+            pool->share(root, beams[i].blocks);
+        }
+        pool->release(root);
+
+        while (true)
+        {
+            // all live beams are decoded in a single batch
+            std::vector<Beam *> live;
+            batch.clear();
+            tables.clear();
+            for (auto &beam : beams)
             {
-                if ((beams[i].completed) || (updated_beams.find(i) != updated_beams.end()))
+                if (beam.completed)
+                    continue;
+
+                const int pos = n_prompt + (int)beam.trace.size() - 1;
+                if (!pool->reserve(beam.blocks, pos + 1))
+                {
+                    beam.completed = true;
                     continue;
-                updated_beams.emplace(i);
+                }
 
-                const int selection = candidates[candidate_id++];
+                batch.add(beam.get_last_token(), pos, pool->cell_of(beam.blocks, pos), true);
+                tables.push_back(&beam.blocks);
+                live.push_back(&beam);
+            }
 
-                int beam_id = selected_ids[selection] / tokenizer->get_vocab_size();
-                beam_id = remaining_beams[beam_id];
-                int tok_id = selected_ids[selection] % tokenizer->get_vocab_size();
+            if (live.size() < 1)
+                break;
 
-                beams[i].clear(selected_traces[selection]);
-                beams[i].add(tok_id, beams[beam_id].scores[tok_id]);
-                beams[i].session.copy_from(beams[beam_id].session);
+            pool->build_mask(batch, tables);
+            if (!model->decode_batch(gen_config, batch, lm_logits))
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "decode_batch failed");
+                break;
             }
 
-            int selection = (int)remaining_beams.size();
-            for (int i = 0; i < (int)beams.size(); i++)
+            const size_t vocab_size = lm_logits.size() / live.size();
+            for (size_t i = 0; i < live.size(); i++)
             {
-                if (updated_beams.find(i) != updated_beams.end()) continue;
+                live[i]->scores.assign(lm_logits.begin() + i * vocab_size, lm_logits.begin() + (i + 1) * vocab_size);
+                live[i]->refresh_scores();
+            }
 
-                int beam_id = selected_ids[selection] / tokenizer->get_vocab_size();
-                beam_id = remaining_beams[beam_id];
-                int tok_id = selected_ids[selection] % tokenizer->get_vocab_size();
+            select_beams();
+        }
 
-                if (beams[i].score > beams[beam_id].scores[tok_id]) continue;
+        for (auto &beam : beams)
+            pool->release(beam.blocks);
+        pool.reset();
 
-                beams[i].clear(selected_traces[selection]);
-                beams[i].add(tok_id, beams[beam_id].scores[tok_id]);
-                beams[i].session.copy_from(beams[beam_id].session);
+        // KV cache is not in the layout of a single sequence any more
+        model->set_n_past(0);
+        return true;
+    }
 
-                selection++;
-            }
-        }
+    void BeamSearchPipeline::do_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer)
+    {
+        if (!do_chat_batched(history, gen_config, streamer))
+            do_chat_with_sessions(history, gen_config, streamer);
     }
 
     std::string BeamSearchPipeline::chat(Messages &history, const GenerationConfig &gen_config,
@@ -2792,4 +3773,53 @@ final:
         return r;
     }
 
+    static ModelObject::extra_args draft_args(const ModelObject::extra_args &args)
+    {
+        ModelObject::extra_args r(args);
+        r.layer_spec = "";
+        return r;
+    }
+
+    SpeculativePipeline::SpeculativePipeline(const std::string &path, const ModelObject::extra_args &args,
+                                             const std::string &draft_model_path, int draft_len)
+        : Pipeline(path, args),
+          draft(new ModelObject(draft_model_path, draft_args(args))),
+          draft_len(draft_len)
+    {
+        if (!modelobj.loaded || !draft->loaded) return;
+
+        CHATLLM_CHECK(draft->tokenizer->get_vocab_size() == tokenizer->get_vocab_size())
+            << "draft model must share the same vocabulary: " << draft->tokenizer->get_vocab_size() << " vs " << tokenizer->get_vocab_size();
+
+        model->set_draft_model(draft->model.get(), draft_len);
+    }
+
+    SpeculativePipeline::~SpeculativePipeline()
+    {
+        if (modelobj.loaded)
+            model->set_draft_model(nullptr, 0);
+    }
+
+    void SpeculativePipeline::set_additional_args(const std::map<std::string, std::string> &args)
+    {
+        Pipeline::set_additional_args(args);
+        draft->model->set_additional_args(args);
+
+        draft_len = utils::get_opt(args, "draft_len", draft_len);
+        if (modelobj.loaded && draft->loaded)
+            model->set_draft_model(draft->model.get(), draft_len);
+    }
+
+    std::string SpeculativePipeline::get_additional_description(void) const
+    {
+        std::ostringstream oss;
+
+        int64_t total_param_num = draft->model->get_param_num(false);
+
+        oss << "Drafted by " << draft->model->type_name() << " (" << std::fixed << std::setprecision(1) << (double)total_param_num / 1000000000. << "B), "
+            << draft_len << " tokens per step.";
+
+        return oss.str();
+    }
+
 } // namespace chatllm
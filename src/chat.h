@@ -287,8 +287,19 @@ namespace chatllm
         virtual void encode_qa(const std::string &q, const std::string &a, std::vector<int> &ids) const;
         virtual void encode_embedding(const std::string &text, std::vector<int> &ids, EmbeddingPurpose purpose) const;
 
+        // texts are encoded in parallel
+        void encode_batch(const std::vector<std::string> &texts, std::vector<std::vector<int>> &ids) const;
+        void encode_embedding_batch(const std::vector<std::string> &texts, std::vector<std::vector<int>> &ids, EmbeddingPurpose purpose) const;
+
         virtual std::string decode(const std::vector<int> &ids) const;
 
+        // text of a single token. `decode` of a sequence equals the concatenation of these,
+        // unless `has_context_postprocess`.
+        virtual std::string decode_piece(int id) const;
+
+        // true if `postprocess` depends on neighbouring tokens (i.e. it can't be applied per token)
+        virtual bool has_context_postprocess(void) const { return false; }
+
         virtual std::vector<int> encode_history(const Messages &history, int max_length,
                                                 const bool incremental = false,
                                                 const bool ai_opening = true,
@@ -555,6 +566,7 @@ namespace chatllm
             BEAM_SEARCH     =12,
             MODEL_INFO      =13,
             THOUGHT_CHUNK   =14,
+            BATCH_REPLY     =15,
         };
         BaseStreamer(BaseTokenizer *tokenizer);
         virtual ~BaseStreamer() = default;
@@ -573,6 +585,7 @@ namespace chatllm
         virtual void set_tokenizer(BaseTokenizer *tokenizer)
         {
             this->tokenizer = tokenizer;
+            piece_cache.clear();
         }
 
         // used for RAG
@@ -598,14 +611,21 @@ namespace chatllm
         }
 
         virtual void call_put_chunk(bool first, const std::string &chunk);
+
+        const std::string &get_piece(int id);
+        void get_printable_pieces(const std::vector<int> &output_ids, std::string &printable_text);
+        void get_printable_line(const std::vector<int> &output_ids, std::string &printable_text);
     public:
         bool is_prompt;
         BaseTokenizer *tokenizer;
         int log_level;
     protected:
         bool is_first;
-        size_t print_len;
+        std::string pending;        // decoded but not printed yet, e.g. an incomplete UTF-8 sequence
+        std::unordered_map<int, std::string> piece_cache;
+        // tokens of current line, for tokenizers `has_context_postprocess`
         std::vector<int> token_cache;
+        size_t print_len;
         ChunkInterceptor *interceptor; // first interceptor in the chain
     };
 
@@ -645,6 +665,12 @@ namespace chatllm
 
         size_t read_buffer(void *output, size_t len) override;
 
+        const void *get_mapped(int64_t offset) override;
+
+        size_t read_at(int64_t offset, void *output, size_t len) override;
+
+        void will_need(int64_t offset, size_t len) override;
+
     protected:
         char *data;
         const char *ptr;
@@ -661,6 +687,10 @@ namespace chatllm
         void seek(int64_t offset, int whence) override;
 
         size_t read_buffer(void *output, size_t len) override;
+
+        size_t read_at(int64_t offset, void *output, size_t len) override;
+
+        void will_need(int64_t offset, size_t len) override;
     protected:
         FILE *f;
     };
@@ -684,6 +714,7 @@ namespace chatllm
         void assign_to(ggml::tensor *tensor);
 
     protected:
+        size_t read_tensor_data_converted(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size);
         size_t read_tensor_data_f32_f16(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size);
         size_t read_tensor_data_f16_f32(tokenizer::DataReader *reader, size_t read_offset, size_t write_offset, size_t data_size);
 
@@ -699,8 +730,8 @@ namespace chatllm
     class ModelLoader : public TensorLoader
     {
     public:
-        ModelLoader(const std::string &path)
-            : ModelLoader(new SimpleFile(path))
+        ModelLoader(const std::string &path, bool use_mmap = false)
+            : ModelLoader(use_mmap ? (tokenizer::DataReader *)new MappedFile(path) : new SimpleFile(path))
         {
         }
 
@@ -740,6 +771,9 @@ namespace chatllm
 
         void load_all_tensors(void);
 
+        // save as a new model file, e.g. to keep re-quantized weights
+        void save_as(const std::string &path, int config_dtype = -1, const std::string &new_meta = "");
+
         tokenizer::DataReader *get_reader()
         {
             return _file.get();
@@ -773,11 +807,14 @@ namespace chatllm
                          const std::vector<std::string> &concat_list, ggml::tensor *tensor, LayerBufAllocator *allocator);
 
         std::string translate_tensor_name(const std::string &name) const;
+
+        void read_ahead(const TensorInfo &t);
     private:
         ModelLoader(tokenizer::DataReader *mapped_file)
             : _file(std::unique_ptr<tokenizer::DataReader>(mapped_file)),
               offset_config(0),
               offset_tokenizer(0),
+              offset_tensors(0),
               model_type(-1), version(-1),
               ff(FileFormat::Unknown)
         {
@@ -788,10 +825,13 @@ namespace chatllm
     public:
         size_t offset_config;
         size_t offset_tokenizer;
+        size_t offset_tensors;
         int model_type;
         int version;
         std::map<std::string, TensorInfo> tensor_dict;
     protected:
+        std::map<size_t, TensorInfo *> tensors_in_file;    // keyed by offset
+        std::map<std::string, std::pair<TensorInfo *, size_t>> concat_pieces;   // piece -> (concatenated tensor, offset)
         LayerAllocatorManager *alloc_manager(void);
         std::vector<LayerAllocatorManager *>alloc_managers;
         std::vector<std::pair<std::string, std::string>> name_translation;
@@ -852,6 +892,18 @@ namespace chatllm
         std::string ai_prefix;
         std::string dump_dot;
         std::string emb_rank_query_sep;
+        int lookup_ngram = 0;       // prompt lookup decoding, 0: disabled
+        int lookup_len = 8;
+        float min_p = 0.0f;
+        float typical_p = 1.0f;
+        int   mirostat = 0;             // 0: disabled, 2: mirostat 2.0
+        float mirostat_tau = 5.0f;
+        float mirostat_eta = 0.1f;
+        float dry_multiplier = 0.0f;    // 0: DRY disabled
+        float dry_base = 1.75f;
+        int   dry_allowed_length = 2;
+        int   no_repeat_ngram = 0;
+        std::map<int, float> logit_bias;
 
         GenerationConfig()
         {
@@ -914,6 +966,10 @@ namespace chatllm
         int get_n_past(void) const;
         int get_n_past_offset(void) const;
 
+        // when > 0, only KV of cells [0, n_cells) is saved and loaded
+        void set_n_cells(int n_cells);
+        int  get_n_cells(void) const;
+
         void copy_from(const ModelSessionMemory &sess);
 
         void dump(const char *fn);
@@ -923,6 +979,24 @@ namespace chatllm
         std::vector<std::vector<uint8_t>> buffers;
         int n_past;
         int n_past_offset;
+        int n_cells;
+    };
+
+    // tokens of several independent sequences evaluated in a single step over a shared KV cache.
+    // each token has its own position and KV cell, and `mask` ([n_tokens, n_cells]) decides
+    // which cells a token can attend to (0 or -INFINITY).
+    struct SequenceBatch
+    {
+        std::vector<int>   ids;
+        std::vector<int>   pos;
+        std::vector<int>   cells;
+        std::vector<int>   outputs;     // indices of tokens whose logits are returned
+        std::vector<float> mask;
+        int n_cells = 0;
+
+        void clear(void);
+        int  add(int id, int pos, int cell, bool output);
+        int  get_n_tokens(void) const { return (int)ids.size(); }
     };
 
     class AbstractModel
@@ -943,12 +1017,47 @@ namespace chatllm
 
         virtual bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) { return true; };
 
+        // true if `decode_batch` can be used, i.e. every layer stores tokens into their own KV cells
+        virtual bool supports_sequence_batch(void) { return false; }
+
+        // logits of `batch.outputs` are returned one after another.
+        // returns false when sequence batches are not supported.
+        virtual bool decode_batch(const GenerationConfig &gen_config, const SequenceBatch &batch, std::vector<float> &lm_logits) { return false; }
+
+        // speculative decoding: `draft` (sharing the same vocabulary) proposes up to `draft_len` tokens,
+        // which are then verified in a single run. Pass `nullptr` to disable it.
+        virtual void set_draft_model(AbstractModel *draft, int draft_len) {}
+
+        // tokens already in KV cache before `input_ids` of the next (continuous) `generate`, such as a restored prefix.
+        // like `input_ids`, they are part of the history of the sampler (penalties, ...).
+        virtual void set_sampling_prefix(const std::vector<int> &ids) {}
+
         virtual void abort_generation(void) = 0;
 
         virtual void text_embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                     std::vector<float> &embedding) = 0;
+
+        // embeddings of `inputs` are returned one after another. models may evaluate several inputs at once.
+        virtual void text_embedding_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                                    std::vector<float> &embeddings)
+        {
+            std::vector<float> embedding;
+            for (auto &input_ids : inputs)
+            {
+                text_embedding(gen_config, input_ids, embedding);
+                embeddings.insert(embeddings.end(), embedding.begin(), embedding.end());
+            }
+        }
         virtual float qa_rank(const GenerationConfig &gen_config,
                               const std::vector<int> &input_ids) = 0;
+
+        // scores of `inputs` are returned one after another. models may evaluate several inputs at once.
+        virtual void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                              std::vector<float> &scores)
+        {
+            for (auto &input_ids : inputs)
+                scores.push_back(qa_rank(gen_config, input_ids));
+        }
         virtual int get_text_embedding_dim(void) const = 0;
 
         // image input
@@ -1034,6 +1143,17 @@ namespace chatllm
             return model->generate_next_token(input_ids, gen_config, lm_logits);
         }
 
+        bool supports_sequence_batch(void) override { return model->supports_sequence_batch(); }
+
+        bool decode_batch(const GenerationConfig &gen_config, const SequenceBatch &batch, std::vector<float> &lm_logits) override
+        {
+            return model->decode_batch(gen_config, batch, lm_logits);
+        }
+
+        void set_draft_model(AbstractModel *draft, int draft_len) override { model->set_draft_model(draft, draft_len); }
+
+        void set_sampling_prefix(const std::vector<int> &ids) override { model->set_sampling_prefix(ids); }
+
         void abort_generation(void) override { model->abort_generation(); }
 
         void text_embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
@@ -1042,9 +1162,18 @@ namespace chatllm
             model->text_embedding(gen_config, input_ids, embedding);
         }
 
+        void text_embedding_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                                    std::vector<float> &embeddings) override
+        {
+            model->text_embedding_batch(gen_config, inputs, embeddings);
+        }
+
         float qa_rank(const GenerationConfig &gen_config,
                               const std::vector<int> &input_ids) override { return model->qa_rank(gen_config, input_ids); }
 
+        void qa_rank_batch(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs,
+                              std::vector<float> &scores) override { model->qa_rank_batch(gen_config, inputs, scores); }
+
 
         void speech_synthesis(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                 std::vector<int16_t> &audio, int &sample_rate, int &channels) override
@@ -1311,6 +1440,8 @@ namespace chatllm
             int re_quantize;
             std::map<std::string, std::string> model_n_gpu_layers;
             std::map<std::string, std::string> additional;
+            bool use_mmap = false;
+            bool model_cache = false;
             extra_args(int max_length, const std::string &layer_spec, bool moe_on_cpu, int n_threads, int batch_size, const std::string &cache_type,
                 const std::string &re_quantize = "")
                 : max_length(max_length), layer_spec(layer_spec), moe_on_cpu(moe_on_cpu), n_threads(n_threads),
@@ -1344,6 +1475,8 @@ namespace chatllm
 
         static bool load(ModelLoader &loader, Result &result, const ModelObject::extra_args &args);
 
+        static void load_file_header(ModelLoader &loader);
+
         static AbstractModel *load_model_again(ModelLoader &loader, const ModelObject::extra_args &args);
 
         static std::string load_info(ModelLoader &loader);
@@ -1352,6 +1485,155 @@ namespace chatllm
         static bool load(int model_type, int version, ModelLoader &loader, Result &result, const ModelObject::extra_args &args);
     };
 
+    // Hands out cells of the model's (preallocated) KV cache in fixed-size blocks.
+    // Each sequence keeps a block table, so position `i` lives in cell
+    // `table[i / block_size] * block_size + i % block_size`. Full blocks are reference counted
+    // and can be shared by sequences having the same prefix.
+    //
+    // Note: this is not a paged KV cache. No KV memory is allocated here: all sequences together
+    // are limited to the `max_length` cells of the model's cache, which is allocated at full size anyway.
+    class KVCellBlockAllocator
+    {
+    public:
+        KVCellBlockAllocator(int n_cells, int block_size = 16);
+
+        int get_block_size(void) const { return block_size; }
+        int get_free_block_num(void) const { return (int)free_blocks.size(); }
+
+        // upper bound (exclusive) of cells in use
+        int get_used_cells(void) const;
+
+        // returns false (leaving `table` unchanged) when running out of blocks
+        bool reserve(std::vector<int> &table, int n_tokens);
+        void release(std::vector<int> &table);
+
+        // `copy` takes shared references to all blocks of `table`.
+        // Note: there is no copy-on-write, nobody shall write into a shared block.
+        void share(const std::vector<int> &table, std::vector<int> &copy);
+
+        int  cell_of(const std::vector<int> &table, int pos) const
+        {
+            return table[pos / block_size] * block_size + pos % block_size;
+        }
+
+        // prefix sharing: full blocks of `tokens` are made available to later `match` calls,
+        // which take shared references to the longest matched prefix (of whole blocks).
+        void publish(const std::vector<int> &table, const std::vector<int> &tokens);
+        int  match(const std::vector<int> &tokens, int max_tokens, std::vector<int> &table);
+
+        // token `t` of `batch` sees positions [0, pos] of its own sequence through `tables[t]`
+        void build_mask(SequenceBatch &batch, const std::vector<const std::vector<int> *> &tables) const;
+
+    protected:
+        int  alloc(void);
+        void unref(int block);
+        static uint64_t hash_block(uint64_t parent_hash, const int *tokens, int n);
+
+    protected:
+        struct Block
+        {
+            int ref = 0;
+            int parent = -1;
+            uint64_t hash = 0;              // 0: not published
+            std::vector<int> tokens;
+        };
+
+        const int block_size;
+        std::vector<Block> blocks;
+        std::set<int> free_blocks;
+        std::unordered_map<uint64_t, int> published;
+    };
+
+    // KV snapshots keyed on token-id prefixes (system prompt, few-shot examples, ...), so that
+    // a new conversation only evaluates tokens after the longest cached prefix.
+    class PrefixCache
+    {
+    public:
+        PrefixCache(int capacity = 0) : capacity(capacity), tick(0) {}
+
+        void set_capacity(int capacity);
+        int  get_capacity(void) const { return capacity; }
+
+        // returns length of the restored prefix, at most `input_ids.size() - 1`.
+        // restored tokens are passed to `model->set_sampling_prefix`.
+        int  restore(AbstractModel *model, const std::vector<int> &input_ids);
+
+        // KV of `prefix` must be in the first `prefix.size()` positions of `model`
+        void save(AbstractModel *model, const std::vector<int> &prefix);
+
+        void clear(void);
+
+    protected:
+        static uint64_t hash(uint64_t h, int token);
+
+        struct Entry
+        {
+            std::vector<int> tokens;
+            ModelSessionMemory session;
+            uint64_t last_used;
+        };
+
+        int capacity;
+        uint64_t tick;
+        std::unordered_map<uint64_t, std::unique_ptr<Entry>> entries;
+        std::multiset<size_t> lengths;      // one for each entry
+    };
+
+    class Sampler;
+
+    // Continuous batching: independent requests share one model and one KV cache, whose cells are handed out in blocks.
+    // Each step packs pending tokens of all active requests into a single forward pass;
+    // requests can be added or cancelled between steps.
+    //
+    // Note: KV cache is taken over by the scheduler, i.e. do not mix with `generate`.
+    // The model must support sequence batches (see `AbstractModel::supports_sequence_batch`).
+    class ContinuousBatchScheduler
+    {
+    public:
+        ContinuousBatchScheduler(AbstractModel *model, BaseTokenizer *tokenizer, const GenerationConfig &gen_config,
+                                 int max_tokens_per_step = 512, int block_size = 16);
+        ~ContinuousBatchScheduler();
+
+        // returns id of the request
+        int  add_request(const std::vector<int> &input_ids, int max_new_tokens = -1);
+        void cancel(int id);
+
+        // returns false if there is nothing to do, or on errors
+        bool step(void);
+
+        int  get_active_num(void) const { return (int)requests.size(); }
+        int  get_free_block_num(void) const { return pool.get_free_block_num(); }
+
+    public:
+        std::function<void (int id, int token_id)> on_token;
+        std::function<void (int id, const std::vector<int> &output_ids)> on_completed;
+
+    protected:
+        struct Request
+        {
+            int id;
+            std::vector<int> tokens;        // tokens whose KV are (being) computed
+            std::vector<int> pending;
+            std::vector<int> output;
+            std::vector<int> blocks;
+            int max_new_tokens;
+            std::unique_ptr<Sampler> sampler;
+            bool completed;
+        };
+
+        void complete(Request *req);
+
+    protected:
+        AbstractModel *model;
+        BaseTokenizer *tokenizer;
+        const GenerationConfig gen_config;
+        const int max_tokens_per_step;
+        int next_id;
+        std::vector<std::unique_ptr<Request>> requests;
+        KVCellBlockAllocator pool;
+        SequenceBatch batch;
+    };
+
     class Pipeline
     {
     public:
@@ -1380,9 +1662,16 @@ namespace chatllm
         virtual void set_additional_args(const std::map<std::string, std::string> &args);
 
         void text_embedding(const std::string &input, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose = BaseTokenizer::EmbeddingPurpose::Document);
+        // inputs are tokenized in parallel, and embeddings are returned one after another.
+        // tokens are accumulated into `performance` as `Prompt`.
+        void text_embedding(const std::vector<std::string> &inputs, const GenerationConfig &gen_config, std::vector<float> &result, BaseTokenizer::EmbeddingPurpose purpose = BaseTokenizer::EmbeddingPurpose::Document);
         void text_tokenize(const std::string &input, const GenerationConfig &gen_config, std::vector<int> &result);
         float qa_rank(const std::string &q, const std::string &a, const GenerationConfig &gen_config);
 
+        // each prompt is a single user turn, and replies are generated concurrently (see `ContinuousBatchScheduler`).
+        // the current chat (and its KV cache) is kept. returns false if not supported by the model.
+        bool chat_batch(const std::vector<std::string> &prompts, const GenerationConfig &gen_config, std::vector<std::string> &replies);
+
         bool speech_synthesis(const std::string &input, const GenerationConfig &gen_config, std::vector<int16_t> &audio, int &sample_rate, int &channels);
 
         int get_text_embedding_dim(void);
@@ -1417,6 +1706,7 @@ namespace chatllm
         ExtendingMethod extending;
         ModelObject modelobj;
         bool ids_selection = false;
+        PrefixCache prefix_cache;
 
         void add_ai_prefix(std::vector<int> &input_ids, const GenerationConfig &gen_config, BaseStreamer *streamer);
 
@@ -1429,6 +1719,10 @@ namespace chatllm
         virtual std::string chat_without_extending(const Messages &history, const GenerationConfig &gen_config,
                                BaseStreamer *streamer);
 
+        // generate from scratch, but reuse KV of the longest cached prefix
+        std::vector<int> generate_from_scratch(const std::vector<int> &input_ids, const GenerationConfig &gen_config,
+                               bool &completed, BaseStreamer *streamer);
+
         virtual void before_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
         virtual void post_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
     };
@@ -1441,9 +1735,19 @@ namespace chatllm
         std::string chat(Messages &history, const GenerationConfig &gen_config,
                          BaseStreamer *streamer = nullptr) override;
     private:
+        class Beam;
+
         void do_chat(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
         void do_chat0(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
 
+        // all live beams are decoded as a batch, sharing KV of common prefixes.
+        // returns false if the model does not support batched decoding.
+        bool do_chat_batched(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
+        void do_chat_with_sessions(Messages &history, const GenerationConfig &gen_config, BaseStreamer *streamer);
+
+        void select_beams(void);
+        void fork_beam(Beam &dst, const Beam &src);
+
         class Beam
         {
         public:
@@ -1454,6 +1758,7 @@ namespace chatllm
             void refresh_scores(void);
             void set_max_length(int max_length);
             ModelSessionMemory session;
+            std::vector<int> blocks;
             std::vector<float> scores;
             std::vector<int> trace;
             float score;
@@ -1462,6 +1767,22 @@ namespace chatllm
             BaseTokenizer *tokenizer;
         };
         std::vector<Beam> beams;
+        std::unique_ptr<KVCellBlockAllocator> pool;
+    };
+
+    class SpeculativePipeline: public Pipeline
+    {
+    public:
+        SpeculativePipeline(const std::string &path, const ModelObject::extra_args &args,
+                            const std::string &draft_model_path, int draft_len = 4);
+        ~SpeculativePipeline() override;
+
+        std::string get_additional_description(void) const override;
+        void set_additional_args(const std::map<std::string, std::string> &args) override;
+
+    protected:
+        std::unique_ptr<ModelObject> draft;
+        int draft_len;
     };
 
     class AugmentedQueryComposer
@@ -1513,6 +1834,7 @@ namespace chatllm
         AugmentedQueryComposer composer;
         bool    hide_reference;
         int     retrieve_top_n;
+        int     retrieve_probes;
         int     rerank_top_n;
         bool    dump;
         float   rerank_score_threshold;
@@ -12,6 +12,7 @@
 #include <regex>
 #include <string>
 #include <functional>
+#include <typeinfo>
 #include "backend.h"
 
 #include "ggml-cpu.h"
@@ -1604,10 +1605,20 @@ namespace chatllm
     {
         int qlen = (int)input->ne[0];
 
-        ggml::tensor *idx = ggml::view_1d(ctx, indices, qlen, 0);
-
         ggml::tensor *output1 = ggml::get_rows(ctx, word_weight, input);
-        ggml::tensor *output2 = ggml::get_rows(ctx, position_weight, idx);
+        ggml::tensor *output2 = nullptr;
+        if (ctx->seq_inputs)
+        {
+            // packed sequences: each token has its own position
+            ggml::tensor *weight = ggml::view_2d(ctx, position_weight, ggml::get_dim(position_weight, 0), ggml::get_dim(position_weight, 1) - pad_index,
+                                                 ggml::row_size(position_weight), pad_index * ggml::row_size(position_weight));
+            output2 = ggml::get_rows(ctx, weight, ctx->seq_inputs->get_positions(ctx));
+        }
+        else
+        {
+            ggml::tensor *idx = ggml::view_1d(ctx, indices, qlen, 0);
+            output2 = ggml::get_rows(ctx, position_weight, idx);
+        }
 
         ggml::tensor *output = ggml::add_inplace(ctx, output1, output2);
 
@@ -1775,8 +1786,10 @@ namespace chatllm
         int hidden_size = (int)hidden_states->ne[0];
 
         // We "pool" the model by simply taking the hidden state corresponding to the first token.
-        ggml::tensor *first_token_tensor = ggml::view_2d(ctx, hidden_states, hidden_size, 1,
-                                                      hidden_size * ggml::element_size(hidden_states), 0);
+        // For a packed batch, first tokens are already gathered, and scores are [1, n].
+        ggml::tensor *first_token_tensor = ctx->seq_inputs ? hidden_states
+                                                           : ggml::view_2d(ctx, hidden_states, hidden_size, 1,
+                                                                           hidden_size * ggml::element_size(hidden_states), 0);
         ggml::tensor *output = dense.forward(ctx, first_token_tensor);
         output = ggml::act(ctx, act, output);
         output = out_proj.forward(ctx, output);
@@ -1794,7 +1807,8 @@ namespace chatllm
     ggml::tensor *BCEFinalNorm::forward(ComputeContext *ctx, ggml::tensor *hidden_states)
     {
         int hidden_size = (int)hidden_states->ne[0];
-        ggml::tensor *first_token_tensor = ggml::view_1d(ctx, hidden_states, hidden_size, 0);
+        // first tokens of a packed batch are already gathered
+        ggml::tensor *first_token_tensor = ctx->seq_inputs ? hidden_states : ggml::view_1d(ctx, hidden_states, hidden_size, 0);
         ggml::tensor *output = ggml::simple_norm(ctx, first_token_tensor, eps);
         return output;
     }
@@ -1980,12 +1994,21 @@ namespace chatllm
 
         attn_scores = apply_pos_embedding_kq(ctx, attn_scores, hidden_size, qlen, pos);
 
-        // attn_masked = mask_past(attn_scores)
-        ggml::tensor * attn_masked = causal ? ggml::diag_mask_inf_inplace(ctx, attn_scores, n_past)
-                                                  : attn_scores;
+        ggml::tensor * attn_probs = nullptr;
+        if (ctx->seq_inputs)
+        {
+            // tokens come from different sequences, so causal mask (if any) is not enough
+            attn_probs = ggml::soft_max_ext(ctx, attn_scores, ctx->seq_inputs->get_mask(ctx), 1.0f, 0.0f);
+        }
+        else
+        {
+            // attn_masked = mask_past(attn_scores)
+            ggml::tensor * attn_masked = causal ? ggml::diag_mask_inf_inplace(ctx, attn_scores, n_past)
+                                                      : attn_scores;
 
-        // attn_probs = soft_max(attn_masked)
-        ggml::tensor * attn_probs = ggml::soft_max_inplace(ctx, attn_masked);
+            // attn_probs = soft_max(attn_masked)
+            attn_probs = ggml::soft_max_inplace(ctx, attn_masked);
+        }
 
         ggml::soft_max_attach_sinks(attn_probs, sinks);
 
@@ -2085,6 +2108,102 @@ namespace chatllm
         fill_pos_vector(ctx, v_pos, pos, n_past, qlen);
     }
 
+    void BaseTensorPosHelper::prepare_pos_tensor(ComputeContext *ctx, ggml::tensor *pos, const std::vector<int> &positions)
+    {
+        CHATLLM_CHECK(ggml::type_of(pos) == GGML_TYPE_I32) << "per-token positions are not supported by this model";
+        pos->ne[0] = (int64_t)positions.size();
+        Backend::write_tensor_data(pos, positions.data(), 0, positions.size() * sizeof(positions[0]));
+    }
+
+    ggml::tensor *SequenceBatchInputs::get_mask(ComputeContext *ctx)
+    {
+        if (nullptr == mask)
+        {
+            mask = ggml::new_tensor_2d(ctx, GGML_TYPE_F32, batch->n_cells, batch->get_n_tokens());
+            ggml::set_input(mask);
+        }
+        return mask;
+    }
+
+    ggml::tensor *SequenceBatchInputs::get_cells(ComputeContext *ctx)
+    {
+        if (nullptr == cells)
+        {
+            cells = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, batch->get_n_tokens());
+            ggml::set_input(cells);
+        }
+        return cells;
+    }
+
+    ggml::tensor *SequenceBatchInputs::get_outputs(ComputeContext *ctx)
+    {
+        if (nullptr == outputs)
+        {
+            outputs = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, batch->outputs.size());
+            ggml::set_input(outputs);
+        }
+        return outputs;
+    }
+
+    ggml::tensor *SequenceBatchInputs::get_positions(ComputeContext *ctx)
+    {
+        if (nullptr == positions)
+        {
+            positions = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, batch->get_n_tokens());
+            ggml::set_input(positions);
+        }
+        return positions;
+    }
+
+    ggml::tensor *SequenceBatchInputs::get_v_cells(ComputeContext *ctx, int cache_length, int v_hidden_size)
+    {
+        for (auto &v : v_cells)
+        {
+            if ((v.cache_length == cache_length) && (v.v_hidden_size == v_hidden_size))
+                return v.tensor;
+        }
+
+        VCells v = {cache_length, v_hidden_size, nullptr};
+        v.tensor = ggml::new_tensor_1d(ctx, GGML_TYPE_I32, (int64_t)batch->get_n_tokens() * v_hidden_size);
+        ggml::set_input(v.tensor);
+        v_cells.push_back(std::move(v));
+        return v_cells.back().tensor;
+    }
+
+    void SequenceBatchInputs::add_pos(ggml::tensor *pos)
+    {
+        if (std::find(pos_tensors.begin(), pos_tensors.end(), pos) == pos_tensors.end())
+            pos_tensors.push_back(pos);
+    }
+
+    void SequenceBatchInputs::write(void)
+    {
+        if (mask)
+            Backend::write_tensor_data(mask, batch->mask.data());
+        if (cells)
+            Backend::write_tensor_data(cells, batch->cells.data());
+        if (outputs)
+            Backend::write_tensor_data(outputs, batch->outputs.data());
+        if (positions)
+            Backend::write_tensor_data(positions, batch->pos.data());
+        for (auto pos : pos_tensors)
+            Backend::write_tensor_data(pos, batch->pos.data(), 0, batch->pos.size() * sizeof(batch->pos[0]));
+
+        // V is stored transposed, so each element of a token is a "row" of its own:
+        // element (t, h) goes to h * cache_length + cells[t]
+        const int n_tokens = batch->get_n_tokens();
+        for (auto &v : v_cells)
+        {
+            v.data.resize((size_t)n_tokens * v.v_hidden_size);
+            for (int h = 0; h < v.v_hidden_size; h++)
+            {
+                for (int t = 0; t < n_tokens; t++)
+                    v.data[(size_t)h * n_tokens + t] = h * v.cache_length + batch->cells[t];
+            }
+            Backend::write_tensor_data(v.tensor, v.data.data());
+        }
+    }
+
     void TensorPosHelperParam::set(BaseTensorPosHelper *helper)
     {
         TensorPosHelperParam::helper = helper;
@@ -2114,7 +2233,13 @@ namespace chatllm
 
     void CoreAttention::prepare_pos_tensor(ComputeContext *ctx, const int n_past, const int qlen)
     {
-        pos_helper->prepare_pos_tensor(ctx, pos, n_past, qlen);
+        if (ctx->seq_inputs)
+        {
+            pos_helper->prepare_pos_tensor(ctx, pos, ctx->seq_inputs->get_batch().pos);
+            ctx->seq_inputs->add_pos(pos);
+        }
+        else
+            pos_helper->prepare_pos_tensor(ctx, pos, n_past, qlen);
     }
 
     void CoreAttention::before_forward(ComputeContext *ctx, const int n_past, const int qlen)
@@ -2164,6 +2289,73 @@ namespace chatllm
         return r;
     }
 
+    size_t KVCacheAttention::get_cache_cells_size(int n_cells) const
+    {
+        if (cache_length < 1) return 0;
+        n_cells = std::min(n_cells, cache_length);
+        return ggml::nbytes(k_cache) / cache_length * n_cells + ggml::element_size(v_cache) * n_cells * v_hidden_size;
+    }
+
+    size_t KVCacheAttention::read_cache_cells(int n_cells, void *buffer, size_t buffer_size) const
+    {
+        const size_t size = get_cache_cells_size(n_cells);
+        if ((size < 1) || (buffer_size < size)) return 0;
+        n_cells = std::min(n_cells, cache_length);
+
+        uint8_t *p = (uint8_t *)buffer;
+        const size_t k_size = ggml::nbytes(k_cache) / cache_length * n_cells;
+        Backend::read_tensor_data(k_cache, p, 0, k_size);
+        p += k_size;
+
+        // v_cache is transposed: cells are columns
+        const size_t v_row_size = ggml::nbytes(v_cache) / v_hidden_size;
+        const size_t v_size = ggml::element_size(v_cache) * n_cells;
+        for (int i = 0; i < v_hidden_size; i++, p += v_size)
+            Backend::read_tensor_data(v_cache, p, i * v_row_size, v_size);
+        return size;
+    }
+
+    size_t KVCacheAttention::write_cache_cells(int n_cells, const void *buffer, size_t buffer_size)
+    {
+        const size_t size = get_cache_cells_size(n_cells);
+        if ((size < 1) || (buffer_size < size)) return 0;
+        n_cells = std::min(n_cells, cache_length);
+
+        const uint8_t *p = (const uint8_t *)buffer;
+        const size_t k_size = ggml::nbytes(k_cache) / cache_length * n_cells;
+        Backend::write_tensor_data(k_cache, p, 0, k_size);
+        p += k_size;
+
+        const size_t v_row_size = ggml::nbytes(v_cache) / v_hidden_size;
+        const size_t v_size = ggml::element_size(v_cache) * n_cells;
+        for (int i = 0; i < v_hidden_size; i++, p += v_size)
+            Backend::write_tensor_data(v_cache, p, i * v_row_size, v_size);
+        return size;
+    }
+
+    bool KVCacheAttention::sequence_batch_cells_usable(void) const
+    {
+        // cells are addressed by index, and positions are plain 1-D ones
+        return (cache_length >= max_length) && (typeid(*pos_helper) == typeid(BaseTensorPosHelper));
+    }
+
+    void KVCacheAttention::clear_cache_cells(int first, int count)
+    {
+        if (cache_length < 1) return;
+        if (first + count > cache_length) count = cache_length - first;
+        if (count < 1) return;
+
+        const size_t k_cell_size = ggml::nbytes(k_cache) / cache_length;
+        std::vector<uint8_t> zeros(std::max(k_cell_size, (size_t)ggml::element_size(v_cache)) * count, 0);
+
+        Backend::write_tensor_data(k_cache, zeros.data(), first * k_cell_size, count * k_cell_size);
+
+        // v_cache is transposed: cells are columns
+        const size_t v_row_size = ggml::nbytes(v_cache) / v_hidden_size;
+        for (int i = 0; i < v_hidden_size; i++)
+            Backend::write_tensor_data(v_cache, zeros.data(), i * v_row_size + first * ggml::element_size(v_cache), count * ggml::element_size(v_cache));
+    }
+
     void KVCacheAttention::before_forward(ComputeContext *ctx, const int n_past, const int qlen)
     {
         CoreAttention::before_forward(ctx, n_past, qlen);
@@ -2198,6 +2390,12 @@ namespace chatllm
     {
         // important: storing RoPE-ed version of K in the KV cache!
 
+        if (ctx->seq_inputs)
+        {
+            save_to_cache_cells(ctx, qlen, k, v);
+            return;
+        }
+
         int batch = ggml::get_dim(v, 2);
         CHATLLM_CHECK((batch <= reserved_batch_size) && ((reserved_batch_size % batch) == 0));
         batch_size = batch;
@@ -2244,6 +2442,28 @@ namespace chatllm
 
     }
 
+    void KVCacheAttention::save_to_cache_cells(ComputeContext *ctx, const int qlen, ggml::tensor *k, ggml::tensor *v)
+    {
+        CHATLLM_CHECK((reserved_batch_size == 1) && (ggml::get_dim(v, 2) == 1)) << "sequence batch requires batch size 1";
+        batch_size = 1;
+
+        // k: one row per cell
+        {
+            ggml::tensor *k_rows = ggml::is_contiguous(k) ? k : ggml::cont(ctx, k);
+            k_rows = ggml::reshape_2d(ctx, k_rows, k_hidden_size, qlen);
+            ggml::build_forward_expand(ctx, ggml::set_rows(ctx, k_cache, ctx->seq_inputs->get_cells(ctx), k_rows));
+        }
+
+        // v: [v_hidden_size, cache_length], scattered element-wise
+        {
+            ggml::tensor *v_elems = ggml::cont(ctx, ggml::transpose(ctx, v));
+            v_elems = ggml::reshape_2d(ctx, v_elems, 1, qlen * v_hidden_size);
+            ggml::tensor *v_all = ggml::reshape_2d(ctx, v_cache, 1, (int64_t)cache_length * v_hidden_size);
+            ggml::build_forward_expand(ctx, ggml::set_rows(ctx, v_all,
+                ctx->seq_inputs->get_v_cells(ctx, cache_length, v_hidden_size), v_elems));
+        }
+    }
+
     ggml::tensor *KVCacheAttention::get_k_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen)
     {
         ggml::tensor *key_layer = nullptr;
@@ -346,8 +346,15 @@ namespace chatllm
 
         virtual size_t get_cache_size(void) const { return 0; }
         virtual void   set_cache_buffer(BackendBuffer *buf) { }
+        // true if tokens of a `SequenceBatch` can be stored into (and attend to) their own cells
+        virtual bool   supports_sequence_batch(void) const { return false; }
+        virtual void   clear_cache_cells(int first, int count) { }
         virtual size_t read_cache_data(void *buffer, size_t buffer_size) const { return 0; }
         virtual size_t write_cache_data(const void *buffer, size_t buffer_size) { return 0; }
+        // KV of cells [0, n_cells) only, for layers supporting sequence batches
+        virtual size_t get_cache_cells_size(int n_cells) const { return 0; }
+        virtual size_t read_cache_cells(int n_cells, void *buffer, size_t buffer_size) const { return 0; }
+        virtual size_t write_cache_cells(int n_cells, const void *buffer, size_t buffer_size) { return 0; }
 
         virtual void load(const std::string &path, TensorLoader *loader) { }
 
@@ -719,7 +726,6 @@ namespace chatllm
               indices(ggml::new_tensor_1d(ctx, GGML_TYPE_I32, pos_max)),
               ln(ctx, embedding_dim)
         {
-            const int pad_index = 2;
             std::vector<int> v_indices;
             v_indices.resize(pos_max);
             for (int i = 0; i < pos_max; i++)
@@ -743,6 +749,8 @@ namespace chatllm
         void load(const std::string &path, TensorLoader *loader) override;
 
     public:
+        static constexpr int pad_index = 2;
+
         ggml::tensor *word_weight;
         ggml::tensor *position_weight;
         ggml::tensor *indices;
@@ -966,6 +974,16 @@ namespace chatllm
             return attention.get_cache_size();
         }
 
+        bool supports_sequence_batch(void) const override
+        {
+            return attention.supports_sequence_batch();
+        }
+
+        void clear_cache_cells(int first, int count) override
+        {
+            attention.clear_cache_cells(first, count);
+        }
+
         void  set_cache_buffer(BackendBuffer *buffer) override
         {
             return attention.set_cache_buffer(buffer);
@@ -981,6 +999,21 @@ namespace chatllm
             return attention.write_cache_data(buffer, buffer_size);
         }
 
+        size_t get_cache_cells_size(int n_cells) const override
+        {
+            return attention.get_cache_cells_size(n_cells);
+        }
+
+        size_t read_cache_cells(int n_cells, void *buffer, size_t buffer_size) const override
+        {
+            return attention.read_cache_cells(n_cells, buffer, buffer_size);
+        }
+
+        size_t write_cache_cells(int n_cells, const void *buffer, size_t buffer_size) override
+        {
+            return attention.write_cache_cells(n_cells, buffer, buffer_size);
+        }
+
         void load(const std::string &path, TensorLoader *loader) override
         {
             Block::load(path, loader);
@@ -1336,12 +1369,58 @@ namespace chatllm
         PostMLPNormBlock post_mlp_layernorm;
     };
 
+    // graph inputs derived from a `SequenceBatch`. tensors are created on demand while building
+    // the graph, and filled by `write()` once the graph is allocated.
+    class SequenceBatchInputs
+    {
+    public:
+        SequenceBatchInputs(const SequenceBatch &batch) : batch(&batch) {}
+
+        const SequenceBatch &get_batch(void) const { return *batch; }
+
+        // a cached graph is fed with another batch of the same shape
+        void set_batch(const SequenceBatch &batch) { this->batch = &batch; }
+
+        ggml::tensor *get_mask(ComputeContext *ctx);
+        ggml::tensor *get_cells(ComputeContext *ctx);
+        ggml::tensor *get_outputs(ComputeContext *ctx);
+
+        // position of each token, as a graph input
+        ggml::tensor *get_positions(ComputeContext *ctx);
+
+        // cells of V cache stored as [cache_length, v_hidden_size]
+        ggml::tensor *get_v_cells(ComputeContext *ctx, int cache_length, int v_hidden_size);
+
+        // persistent position tensors (of each layer) are refreshed by `write`, too
+        void add_pos(ggml::tensor *pos);
+
+        void write(void);
+
+    protected:
+        struct VCells
+        {
+            int cache_length;
+            int v_hidden_size;
+            ggml::tensor *tensor;
+            std::vector<int> data;
+        };
+
+        const SequenceBatch *batch;
+        ggml::tensor *mask = nullptr;
+        ggml::tensor *cells = nullptr;
+        ggml::tensor *outputs = nullptr;
+        ggml::tensor *positions = nullptr;
+        std::vector<VCells> v_cells;
+        std::vector<ggml::tensor *> pos_tensors;
+    };
+
     class BaseTensorPosHelper
     {
     public:
         BaseTensorPosHelper(int max_length);
         virtual ggml::tensor *allocate_pos_tensor(InitContext *ctx);
         virtual void prepare_pos_tensor(ComputeContext *ctx, ggml::tensor *pos, const int n_past, const int qlen);
+        virtual void prepare_pos_tensor(ComputeContext *ctx, ggml::tensor *pos, const std::vector<int> &positions);
     protected:
         const int max_length;
         std::vector<int> v_pos;
@@ -1525,13 +1604,25 @@ namespace chatllm
         size_t read_cache_data(void *buffer, size_t buffer_size) const override;
         size_t write_cache_data(const void *buffer, size_t buffer_size) override;
 
+        size_t get_cache_cells_size(int n_cells) const override;
+        size_t read_cache_cells(int n_cells, void *buffer, size_t buffer_size) const override;
+        size_t write_cache_cells(int n_cells, const void *buffer, size_t buffer_size) override;
+
+        // opt-in: only attention classes verified against `save_to_cache_cells` enable it
+        bool supports_sequence_batch(void) const override { return false; }
+        void clear_cache_cells(int first, int count) override;
+
     protected:
+        bool sequence_batch_cells_usable(void) const;
         virtual void before_forward(ComputeContext *ctx, const int n_past, const int qlen);
 
         // k: [batch, qlen, heads, head_size]
         // v: [batch, qlen, hidden_size]
         void save_to_cache(ComputeContext *ctx, const int n_past, const int qlen, ggml::tensor *k, ggml::tensor *v) override;
 
+        // store tokens of a `SequenceBatch` into their own cells
+        void save_to_cache_cells(ComputeContext *ctx, const int qlen, ggml::tensor *k, ggml::tensor *v);
+
         // output: [batch, heads, qlen, head_size]
         ggml::tensor *get_k_from_cache(ComputeContext *ctx, const int hidden_size, const int n_past, const int qlen) override;
 
@@ -1724,6 +1815,8 @@ namespace chatllm
             ctx->get_allocator()->alloc(indices);
         }
 
+        bool supports_sequence_batch(void) const override { return false; }
+
     protected:
         void before_forward(ComputeContext *ctx, const int n_past, const int qlen) override
         {
@@ -1852,6 +1945,8 @@ namespace chatllm
         {
         }
 
+        bool supports_sequence_batch(void) const override { return false; }
+
     protected:
 
         // output: [heads, qlen, head_size]
@@ -1919,6 +2014,8 @@ namespace chatllm
         {
         }
 
+        bool supports_sequence_batch(void) const override { return false; }
+
     protected:
 
         void before_forward(ComputeContext *ctx, const int n_past, const int qlen) override
@@ -2197,6 +2294,16 @@ namespace chatllm
             return attention.get_cache_size();
         }
 
+        bool supports_sequence_batch(void) const override
+        {
+            return attention.supports_sequence_batch();
+        }
+
+        void clear_cache_cells(int first, int count) override
+        {
+            attention.clear_cache_cells(first, count);
+        }
+
         void  set_cache_buffer(BackendBuffer *buffer) override
         {
             return attention.set_cache_buffer(buffer);
@@ -2212,6 +2319,21 @@ namespace chatllm
             return attention.write_cache_data(buffer, buffer_size);
         }
 
+        size_t get_cache_cells_size(int n_cells) const override
+        {
+            return attention.get_cache_cells_size(n_cells);
+        }
+
+        size_t read_cache_cells(int n_cells, void *buffer, size_t buffer_size) const override
+        {
+            return attention.read_cache_cells(n_cells, buffer, buffer_size);
+        }
+
+        size_t write_cache_cells(int n_cells, const void *buffer, size_t buffer_size) override
+        {
+            return attention.write_cache_cells(n_cells, buffer, buffer_size);
+        }
+
     public:
         LayerNorm input_layernorm;
         GLMSelfAttention attention;
@@ -2543,6 +2665,8 @@ namespace chatllm
 
         LlamaSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int head_dim, int max_length)
             : RoPESelfAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, head_dim, max_length, false, false) {}
+
+        bool supports_sequence_batch(void) const override { return sequence_batch_cells_usable(); }
     };
 
     class FullBiasedSelfAttention : public RoPESelfAttention<BaseAttention>
@@ -2940,6 +3064,8 @@ namespace chatllm
 
         ALiBiSelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length);
 
+        bool supports_sequence_batch(void) const override { return false; }
+
     protected:
         ggml::tensor *attn_scores_to_probs(ComputeContext *ctx, int hidden_size, const int n_past, const int qlen,
             ggml::tensor *attn_scores) override;
@@ -3003,6 +3129,8 @@ namespace chatllm
         QWen2SelfAttention(InitContext *ctx, int hidden_size, int num_attention_heads, int num_kv_heads, int max_length)
             : QWen2SelfAttention(ctx, hidden_size, num_attention_heads, num_kv_heads, hidden_size / num_attention_heads, max_length)
         {}
+
+        bool supports_sequence_batch(void) const override { return sequence_batch_cells_usable(); }
     };
 
     class QWen2Block : public LMBlock1<RMSNorm, QWen2SelfAttention, RMSNorm, SiLUMLP>
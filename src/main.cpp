@@ -12,11 +12,13 @@
 #include <thread>
 #include <map>
 #include <filesystem>
+#include <chrono>
 
 #include "vectorstore.h"
 #include "vision_process.h"
 #include "audio_process.h"
 #include "models.h"
+#include "unicode.h"
 
 #if defined(_WIN32)
 #include <fcntl.h>
@@ -58,6 +60,7 @@ struct Args
     std::string multimedia_file_tags[2] = {"", ""};
     std::string tts_export;
     std::string re_quantize;
+    std::string save_model_path;
     std::map<std::string, std::string> model_n_gpu_layers;
     int max_length = -1;
     int max_context_length = 512;
@@ -67,6 +70,16 @@ struct Args
     float top_p = 0.7f;
     float temp = 0.7f;
     float tfs_z = 0.95f;
+    float min_p = 0.0f;
+    float typical_p = 1.0f;
+    int mirostat = 0;
+    float mirostat_tau = 5.0f;
+    float mirostat_eta = 0.1f;
+    float dry_multiplier = 0.0f;
+    float dry_base = 1.75f;
+    int dry_allowed_length = 2;
+    int no_repeat_ngram = 0;
+    std::map<int, float> logit_bias;
     float presence_penalty = 0.0f;
     float repeat_penalty = 1.0f;
     float frequency_penalty = 0.0f;
@@ -75,8 +88,15 @@ struct Args
     int seed = -1;
     chatllm::ChatFormat format = chatllm::ChatFormat::CHAT;
     bool tokenize = false;
+    bool check_decode_step = false;
+    std::string bench_pretokenizer;
+    bool bench_pretokenizer_stl = false;
     DistanceStrategy vc = DistanceStrategy::MaxInnerProduct;
     int retrieve_top_n = 2;
+    int retrieve_probes = 0;
+    int vs_index_lists = 0;
+    EmbeddingType vs_emb_type = EmbeddingType::F32;
+    bool vs_rescore = false;
     int rerank_top_n = 1;
     float rerank_score_thres = 0.35f;
     int rag_post_extending = 0;
@@ -89,8 +109,14 @@ struct Args
     bool reversed_role = false;
     int save_session_rounds = -1;
     int beam_size = -1;
+    std::string draft_model_path;
+    int draft_len = 4;
+    int lookup_ngram = 0;
+    int lookup_len = 8;
     int log_level = 4;
     bool moe_on_cpu = false;
+    bool mmap = false;
+    bool model_cache = false;
     int batch_size = 4096;
     bool detect_thoughts = false;
     int penalty_window = 256;
@@ -114,6 +140,38 @@ static chatllm::Pipeline::ExtendingMethod parse_extending_method(const std::stri
         return chatllm::Pipeline::ExtendingMethod::None;
 }
 
+// ID:BIAS[,ID:BIAS...]
+static std::map<int, float> parse_logit_bias(const std::string &s)
+{
+    std::map<int, float> r;
+    size_t start = 0;
+    while (start < s.size())
+    {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(start, end - start);
+        const size_t pos = item.find(':');
+        size_t n_id = 0;
+        size_t n_bias = 0;
+        int id = -1;
+        float bias = 0.0f;
+        if (pos != std::string::npos)
+        {
+            try
+            {
+                id   = std::stoi(item.substr(0, pos), &n_id);
+                bias = std::stof(item.substr(pos + 1), &n_bias);
+            }
+            catch (const std::exception &) {}
+        }
+        if ((id < 0) || (n_id != pos) || (n_bias < 1) || (pos + 1 + n_bias != item.size()))
+            throw std::invalid_argument("--logit_bias: `" + item + "` is not ID:BIAS");
+        r[id] = bias;
+        start = end + 1;
+    }
+    return r;
+}
+
 const std::vector<std::pair<std::string, std::string>> THOUGHT_TAGS = {
     {"<think>",         "</think>"},
     {"◁think▷",         "◁/think▷"},
@@ -181,6 +239,7 @@ void usage(const std::string &prog)
               << "                          `main` and `any` are two special identifiers for the main model and wildcard to any model. \n"
               << "                          N ::= one_spec;..., see `-ngl`\n"
               << "  +moe_on_cpu             alway use CPU for sparse operations (MoE) (default: off)\n"
+              << "  +mmap                   map model file into memory, and use weights on CPU without copying (default: off)\n"
               << "  --rpc_endpoints EP..    RPC endpoints (i.e. servers) for distributed inference (default: empty)\n"
               << "                          EP1;EP2, where EP ::= host:port\n"
               << "  --cache_dtype T         cache data type, T ::= f32 | f16 (default: f16)\n"
@@ -188,13 +247,26 @@ void usage(const std::string &prog)
               << "                          note: trade-off between prompt throughput and memory usage.\n"
               << "  --re_quantize Q         re-quantize model weights during loading (Q ::= q8_0 | q4_0 | q4_1 | q4_k | ...) (default: no re-quantization)\n"
               << "                          note: it does not make sense to re-quantize to a larger size.\n"
+              << "  --save_model PATH       save loaded (e.g. re-quantized) model to PATH, then quit\n"
+              << "  +model_cache            cache model re-quantized by `--re_quantize` (w.r.t. `--layer_spec`) next to model file,\n"
+              << "                          and map the cache into memory on later launches (default: off)\n"
               << "Sampling options:\n"
-              << "  --sampling ALG          sampling algorithm (ALG = greedy | top_p | tfs) (default: top_p) \n"
-              << "                          where, tfs = Tail Free Sampling\n"
+              << "  --sampling ALG          sampling algorithm (ALG = greedy | top_p | tfs | min_p) (default: top_p) \n"
+              << "                          where, tfs = Tail Free Sampling, min_p = top-k & min-p only\n"
               << "  -t, --temp T            temperature (default: " << args.temp << ") (Note: `-t 0` also sets sampling algorithm to greedy)\n"
               << "  --top_k N               top-k sampling (default: " << args.top_k << ")\n"
               << "  --top_p N               top-p sampling (default: " << args.top_p << ")\n"
               << "  --tfs_z Z               Z param for TFS (default: " << args.tfs_z << ")\n"
+              << "  --min_p P               min-p sampling, applied after ALG (default: " << args.min_p << ", 0.0=disabled)\n"
+              << "  --typical_p P           locally typical sampling, applied before ALG (default: " << args.typical_p << ", 1.0=disabled)\n"
+              << "  --mirostat N            mirostat version (default: 0, disabled. supported: 2)\n"
+              << "  --mirostat_tau T        mirostat target entropy (default: " << args.mirostat_tau << ")\n"
+              << "  --mirostat_eta E        mirostat learning rate (default: " << args.mirostat_eta << ")\n"
+              << "  --dry_multiplier M      DRY (Don't Repeat Yourself) penalty multiplier (default: " << args.dry_multiplier << ", 0.0=disabled)\n"
+              << "  --dry_base B            DRY penalty base (default: " << args.dry_base << ")\n"
+              << "  --dry_allowed_length N  DRY: repetitions longer than this are penalized (default: " << args.dry_allowed_length << ")\n"
+              << "  --no_repeat_ngram N     ban repeating any n-gram of size N (default: 0, disabled)\n"
+              << "  --logit_bias ID:B,...   add bias B to logit of token ID (default: none)\n"
               << "  --repeat_penalty N      repetition penalty (default: " << args.repeat_penalty << ", 1.0=no penalty)\n"
               << "  --presence_penalty N    penalty alpha for presence (default: " << args.presence_penalty << ", 0.0=disabled)\n"
               << "  --frequency_penalty N   penalty alpha for probability (default: " << args.frequency_penalty << ", 0.0=disabled)\n"
@@ -202,6 +274,10 @@ void usage(const std::string &prog)
               << "  --seed N                seed for random generator (default: random)\n"
               << "  --beam_size N           beam size for generation (default: -1, disabled)\n"
               << "                          functionality of beam search limited.\n"
+              << "  --draft_model PATH      draft model for speculative decoding, sharing the same vocabulary (default: disabled)\n"
+              << "  --draft_len N           number of tokens proposed by draft model per step (default: " << args.draft_len << ")\n"
+              << "  --lookup_ngram N        prompt lookup decoding: n-gram size for matching prompt and output (default: 0, disabled)\n"
+              << "  --lookup_len N          prompt lookup decoding: max number of tokens proposed per step (default: " << args.lookup_len << ")\n"
               << "RAG options:\n"
               << "  --set_vs_name           set vector store name.\n"
               << "                          all following vector store files are merged into this vector store. (optional. default: `default`)\n"
@@ -211,6 +287,8 @@ void usage(const std::string &prog)
               << "  --distance_strategy DS  distance strategy (model dependent, default: MaxInnerProduct)\n"
               << "                          DS = EuclideanDistance | MaxInnerProduct | InnerProduct | CosineSimilarity\n"
               << "  --retrieve_top_n N      number of retrieved items using embedding model (default: 2)\n"
+              << "  --retrieve_probes N     number of index lists to scan, when vector store is indexed (default: 0, i.e. 1/16 of lists)\n"
+              << "                          more probes, better recall but slower.\n"
               << "  --retrieve_rewrite_template ...\n"
               << "                          prompt template to ask LLM to rewrite a query for retrieving (optional).\n"
               << "                          (default: \"\", i.e. disabled, the original prompt is used for retrieving)\n"
@@ -253,7 +331,16 @@ void usage(const std::string &prog)
               << "Misc:\n"
               << "  --init_vs FILE          init vector store file from input                                                           [*]\n"
               << "  --merge_vs FILE         merge multiple vector store files into a single one                                         [*]\n"
+              << "  --vs_index_lists N      build an IVF index of N lists when saving a vector store by `--init_vs` or `--merge_vs`       [*]\n"
+              << "                          (default: 0, no index. ~sqrt(number of records) is a good start)\n"
+              << "  --vs_emb_type T         embedding type when saving a vector store: f32|f16|int8|binary (default: f32)               [*]\n"
+              << "  +vs_rescore             also save F32 embeddings, which are used to re-score candidates of quantized embeddings     [*]\n"
               << "  --tokenize              (debug) tokenize `prompt` and exit                                                          [*]\n"
+              << "  --check_decode_step     (debug) check that a decoding step after `prompt` matches evaluating it at once, and exit   [*]\n"
+              << "  --bench_pretokenizer EXPR\n"
+              << "                          (debug) split `prompt` by pre-tokenizer regex EXPR, print piece lengths & time, then exit   [*]\n"
+              << "  +bench_pretokenizer_stl\n"
+              << "                          (debug) same as `--bench_pretokenizer`, but always use std::regex (for comparison)          [*]\n"
               << "  --test FILE             test against inputs from a file and exit                                                    [*]\n"
               << "  --hide_banner           hide banner                                                                                 [*]\n"
               << "  --show                  show model info and quit                                                                    [*]\n"
@@ -345,6 +432,8 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
                 args.show_banner = false;
             }
             handle_flag(tokenize)
+            handle_flag(check_decode_step)
+            handle_flag(bench_pretokenizer_stl)
             handle_flag(hide_reference)
             handle_flag(show)
             handle_flag(show_devices)
@@ -352,8 +441,11 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_flag(rag_dump)
             handle_flag(rerank_rewrite)
             handle_flag(moe_on_cpu)
+            handle_flag(mmap)
+            handle_flag(model_cache)
             handle_flag(detect_thoughts)
             handle_flag(single_turn)
+            handle_flag(vs_rescore)
             else if (utils::is_same_command_option(arg, "--format"))
             {
                 c++;
@@ -454,6 +546,16 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_param("--top_k",                 "-k", top_k,                std::stoi)
             handle_param("--top_p",                 "-q", top_p,                std::stof)
             handle_para0("--tfs_z",                       tfs_z,                std::stof)
+            handle_para0("--min_p",                       min_p,                std::stof)
+            handle_para0("--typical_p",                   typical_p,            std::stof)
+            handle_para0("--mirostat",                    mirostat,             std::stoi)
+            handle_para0("--mirostat_tau",                mirostat_tau,         std::stof)
+            handle_para0("--mirostat_eta",                mirostat_eta,         std::stof)
+            handle_para0("--dry_multiplier",              dry_multiplier,       std::stof)
+            handle_para0("--dry_base",                    dry_base,             std::stof)
+            handle_para0("--dry_allowed_length",          dry_allowed_length,   std::stoi)
+            handle_para0("--no_repeat_ngram",             no_repeat_ngram,      std::stoi)
+            handle_para0("--logit_bias",                  logit_bias,           parse_logit_bias)
             handle_param("--temp",                  "-t", temp,                 std::stof)
             handle_para0("--presence_penalty",            presence_penalty,     std::stof)
             handle_para0("--repeat_penalty",              repeat_penalty,       std::stof)
@@ -466,6 +568,9 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--embedding_model",             embedding_model_path, std::string)
             handle_para0("--distance_strategy",           vc,                   ParseDistanceStrategy)
             handle_para0("--retrieve_top_n",              retrieve_top_n,       std::stoi)
+            handle_para0("--retrieve_probes",             retrieve_probes,      std::stoi)
+            handle_para0("--vs_index_lists",              vs_index_lists,       std::stoi)
+            handle_para0("--vs_emb_type",                 vs_emb_type,          ParseEmbeddingType)
             handle_para0("--reranker_model",              reranker_model_path,  std::string)
             handle_para0("--retrieve_rewrite_template",   retrieve_rewrite_template,  std::string)
             handle_para0("--rerank_score_thres",          rerank_score_thres,   std::stof)
@@ -479,7 +584,12 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--layer_spec",                  layer_spec,           std::string)
             handle_para0("--load_session",                load_session,         std::string)
             handle_para0("--dump_dot",                    dump_dot,             std::string)
+            handle_para0("--bench_pretokenizer",          bench_pretokenizer,   std::string)
             handle_para0("--beam_size",                   beam_size,            std::stoi)
+            handle_para0("--draft_model",                 draft_model_path,     std::string)
+            handle_para0("--draft_len",                   draft_len,            std::stoi)
+            handle_para0("--lookup_ngram",                lookup_ngram,         std::stoi)
+            handle_para0("--lookup_len",                  lookup_len,           std::stoi)
             handle_para0("--log_level",                   log_level,            std::stoi)
             handle_para0("--rpc_endpoints",               rpc_endpoints,        std::string)
             handle_para0("--serve_rpc",                   serve_rpc,            std::string)
@@ -488,6 +598,7 @@ static size_t parse_args(Args &args, const std::vector<std::string> &argv)
             handle_para0("--batch_size",                  batch_size,           std::stoi)
             handle_para0("--tts_export",                  tts_export,           std::string)
             handle_para0("--re_quantize",                 re_quantize,          std::string)
+            handle_para0("--save_model",                  save_model_path,      std::string)
             handle_para0("--max_new_tokens",              max_new_tokens,       std::stoi)
             else
                 break;
@@ -848,11 +959,25 @@ static void run_qa_ranker(Args &args, chatllm::Pipeline &pipeline, TextStreamer
                                          gen_config.repeat_penalty = args.repeat_penalty; \
                                          gen_config.frequency_penalty = args.frequency_penalty; \
                                          gen_config.penalty_window = args.penalty_window; \
-                                         gen_config.max_new_tokens = args.max_new_tokens;
+                                         gen_config.max_new_tokens = args.max_new_tokens; \
+                                         gen_config.lookup_ngram = args.lookup_ngram; \
+                                         gen_config.lookup_len = args.lookup_len; \
+                                         gen_config.min_p = args.min_p; \
+                                         gen_config.typical_p = args.typical_p; \
+                                         gen_config.mirostat = args.mirostat; \
+                                         gen_config.mirostat_tau = args.mirostat_tau; \
+                                         gen_config.mirostat_eta = args.mirostat_eta; \
+                                         gen_config.dry_multiplier = args.dry_multiplier; \
+                                         gen_config.dry_base = args.dry_base; \
+                                         gen_config.dry_allowed_length = args.dry_allowed_length; \
+                                         gen_config.no_repeat_ngram = args.no_repeat_ngram; \
+                                         gen_config.logit_bias = args.logit_bias;
 
 #define DEF_ExtraArgs(pipe_args, args)  \
     chatllm::ModelObject::extra_args pipe_args(args.max_length, args.layer_spec, args.moe_on_cpu, args.num_threads, args.batch_size, args.cache_dtype, args.re_quantize);\
     pipe_args.model_n_gpu_layers = args.model_n_gpu_layers; \
+    pipe_args.use_mmap = args.mmap; \
+    pipe_args.model_cache = args.model_cache; \
     pipe_args.additional = args.additional
 
 chatllm::BaseStreamer *get_streamer_for_log(void);
@@ -881,6 +1006,46 @@ static void _ggml_log_callback(enum ggml_log_level level, const char * text, voi
     log_internal(level, text);
 }
 
+// logits of the last token: `prompt[0..n-1]` then a single decoding step (which may go through a sequence batch),
+// vs. `prompt` evaluated at once.
+static void check_decode_step(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
+{
+    DEF_GenerationConfig(gen_config, args);
+    auto ids = pipeline.tokenizer->encode(args.prompt);
+    CHATLLM_CHECK(ids.size() >= 2) << "check_decode_step: `prompt` must have at least 2 tokens";
+
+    auto model = pipeline.model;
+    std::vector<float> stepped;
+    std::vector<float> whole;
+    const std::vector<int> prefix(ids.begin(), ids.end() - 1);
+
+    model->set_n_past(0);
+    CHATLLM_CHECK(model->generate_next_token(prefix, gen_config, stepped)) << "check_decode_step: failed";
+    model->set_n_past((int)prefix.size());
+    CHATLLM_CHECK(model->generate_next_token({ids.back()}, gen_config, stepped)) << "check_decode_step: failed";
+
+    model->set_n_past(0);
+    CHATLLM_CHECK(model->generate_next_token(ids, gen_config, whole)) << "check_decode_step: failed";
+    model->set_n_past(0);
+
+    CHATLLM_CHECK(stepped.size() == whole.size()) << "check_decode_step: logits size mismatch";
+
+    float max_diff = 0.0f;
+    float max_abs  = 0.0f;
+    for (size_t i = 0; i < whole.size(); i++)
+    {
+        max_diff = std::max(max_diff, fabsf(stepped[i] - whole[i]));
+        max_abs  = std::max(max_abs, fabsf(whole[i]));
+    }
+    const auto argmax = [](const std::vector<float> &v) { return std::max_element(v.begin(), v.end()) - v.begin(); };
+    const bool ok = (argmax(stepped) == argmax(whole)) && (max_diff <= 1e-2f * std::max(1.0f, max_abs));
+
+    streamer.cout << "sequence batch decoding: " << (model->supports_sequence_batch() ? "yes" : "no")
+                  << ", max |diff| of logits: " << max_diff << " (max |logit|: " << max_abs << "): "
+                  << (ok ? "OK" : "MISMATCH") << std::endl;
+    CHATLLM_CHECK(ok) << "check_decode_step: logits mismatch";
+}
+
 void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
 {
     streamer.set_tokenizer(pipeline.tokenizer);
@@ -908,6 +1073,12 @@ void chat(Args &args, chatllm::Pipeline &pipeline, TextStreamer &streamer)
         return;
     }
 
+    if (args.check_decode_step)
+    {
+        check_decode_step(args, pipeline, streamer);
+        return;
+    }
+
     pipeline.set_additional_args(args.additional);
     streamer.set_interceptor(&thought_interceptor);
 
@@ -1172,14 +1343,20 @@ static int init_vector_store(Args &args)
     std::vector<float> r;
 
     CVectorStore vs(args.vc, pipeline.get_text_embedding_dim(),
-        [&pipeline, &gen_config, &r](const std::string &s, float *emb)
+        [&pipeline, &gen_config, &r](const std::vector<std::string> &texts, float *emb)
         {
-            pipeline.text_embedding(s, gen_config, r);
-            CHATLLM_CHECK((int)r.size() == pipeline.get_text_embedding_dim()) << "embedding dim mismatch";
+            r.clear();
+            pipeline.text_embedding(texts, gen_config, r);
+            CHATLLM_CHECK(r.size() == texts.size() * pipeline.get_text_embedding_dim()) << "embedding dim mismatch";
             memcpy(emb, r.data(), r.size() * sizeof(float));
         },
         args.vector_store_in.c_str());
-    vs.ExportDB((args.vector_store_in + ".vsdb").c_str());
+
+    auto &perf = pipeline.performance.timings[chatllm::ModelPerfInfo::Type::Prompt];
+    printf("%zu tokens embedded in %.1f s, %.1f tokens/s\n", perf.tok_count, perf.duration_ms / 1000,
+           perf.tok_count / (perf.duration_ms / 1000 + 1e-9));
+    vs.BuildIndex(args.vs_index_lists);
+    vs.ExportDB((args.vector_store_in + ".vsdb").c_str(), args.vs_emb_type, args.vs_rescore);
     printf("Vector store saved to: %s\n", (args.vector_store_in + ".vsdb").c_str());
     return 0;
 }
@@ -1192,11 +1369,35 @@ static int merge_vector_store(Args &args)
         files.insert(files.end(), x.second.begin(), x.second.end());
     }
     CVectorStore vs(args.vc, files);
-    vs.ExportDB(args.merge_vs.c_str());
+    vs.BuildIndex(args.vs_index_lists);
+    vs.ExportDB(args.merge_vs.c_str(), args.vs_emb_type, args.vs_rescore);
     printf("Vector store saved to: %s\n", args.merge_vs.c_str());
     return 0;
 }
 
+// lengths are in bytes, so that pieces can be checked against other regex engines (see scripts/check_pretokenizer.py)
+static int bench_pretokenizer(Args &args)
+{
+    const int ROUNDS = 10;
+    std::vector<std::string> pieces;
+    double best_ms = INFINITY;
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        pieces = unicode_regex_split(args.prompt, {args.bench_pretokenizer}, !args.bench_pretokenizer_stl);
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        best_ms = std::min(best_ms, ms);
+    }
+
+    // pieces are byte-level encoded: a codepoint for each byte
+    for (auto &p : pieces)
+        printf("%zu ", unicode_cpts_from_utf8(p).size());
+    printf("\n");
+    fprintf(stderr, "%zu bytes, %zu pieces, %.3f ms (best of %d%s)\n", args.prompt.size(), pieces.size(), best_ms, ROUNDS,
+            args.bench_pretokenizer_stl ? ", std::regex" : "");
+    return 0;
+}
+
 static void show_devices(void)
 {
     std::vector<chatllm::ComputeManager::DeviceInfo> devs;
@@ -1270,6 +1471,9 @@ int main(int argc, const char **argv)
         return 0;
     }
 
+    if (args.bench_pretokenizer.size() > 0)
+        return bench_pretokenizer(args);
+
     chatllm::ComputeManager::init(args.ggml_dir);
     prepare_rpc_devices(args);
 
@@ -1295,9 +1499,22 @@ int main(int argc, const char **argv)
     {
         DEF_ExtraArgs(pipe_args, args);
 
+        if (args.save_model_path.size() > 0)
+        {
+            chatllm::ModelObject obj(args.model_path, pipe_args);
+            obj.loader->save_as(args.save_model_path, pipe_args.re_quantize);
+            return 0;
+        }
+
         if (args.embedding_model_path.size() < 1)
         {
-            if (args.beam_size < 1)
+            if (args.draft_model_path.size() > 0)
+            {
+                CHATLLM_CHECK(args.beam_size < 1) << "beam search is not supported for speculative decoding";
+                chatllm::SpeculativePipeline pipeline(args.model_path, pipe_args, args.draft_model_path, args.draft_len);
+                chat(args, pipeline, streamer);
+            }
+            else if (args.beam_size < 1)
             {
                 chatllm::Pipeline pipeline(args.model_path, pipe_args);
                 chat(args, pipeline, streamer);
@@ -1317,6 +1534,7 @@ int main(int argc, const char **argv)
                 args.embedding_model_path, args.reranker_model_path);
             pipeline.hide_reference = args.hide_reference;
             pipeline.retrieve_top_n = args.retrieve_top_n;
+            pipeline.retrieve_probes = args.retrieve_probes;
             pipeline.rerank_top_n   = args.rerank_top_n;
             pipeline.dump           = args.rag_dump;
             pipeline.rerank_score_threshold = args.rerank_score_thres;
@@ -1672,7 +1890,14 @@ int chatllm_start(struct chatllm_obj *obj, f_chatllm_print f_print, f_chatllm_en
             if (args.model_path.size() < 1)
                 return -1;
 
-            if (args.beam_size < 1)
+            if (args.draft_model_path.size() > 0)
+            {
+                CHATLLM_CHECK(args.beam_size < 1) << "beam search is not supported for speculative decoding";
+                auto pipeline = new chatllm::SpeculativePipeline(args.model_path, pipe_args, args.draft_model_path, args.draft_len);
+                chat->streamer->tokenizer = pipeline->tokenizer;
+                return start_chat(chat, args, *pipeline);
+            }
+            else if (args.beam_size < 1)
             {
                 auto pipeline = new chatllm::Pipeline(args.model_path, pipe_args);
                 chat->streamer->tokenizer = pipeline->tokenizer;
@@ -1694,6 +1919,7 @@ int chatllm_start(struct chatllm_obj *obj, f_chatllm_print f_print, f_chatllm_en
                 args.embedding_model_path, args.reranker_model_path);
             pipeline->hide_reference = args.hide_reference;
             pipeline->retrieve_top_n = args.retrieve_top_n;
+            pipeline->retrieve_probes = args.retrieve_probes;
             pipeline->rerank_top_n   = args.rerank_top_n;
             pipeline->dump           = args.rag_dump;
             pipeline->rerank_score_threshold = args.rerank_score_thres;
@@ -1985,6 +2211,31 @@ int chatllm_async_qa_rank(struct chatllm_obj *obj, const char *utf8_str_q, const
     ASYNC_FUN_BODY(chatllm_qa_rank(obj, utf8_str_q, utf8_str_a));
 }
 
+int chatllm_batch_user_input(struct chatllm_obj *obj, int num, const char **utf8_strs)
+{
+    DEF_CHAT_STREAMER();
+
+    if (!chat->pipeline->is_loaded() || !streamer->is_prompt || (num < 1))
+        return -1;
+
+    std::vector<std::string> prompts;
+    for (int i = 0; i < num; i++)
+        prompts.push_back(utf8_strs[i]);
+
+    std::vector<std::string> replies;
+    if (!chat->pipeline->chat_batch(prompts, chat->gen_config, replies))
+        return -1;
+
+    for (size_t i = 0; i < replies.size(); i++)
+    {
+        std::ostringstream oss;
+        oss << i << "," << replies[i];
+        streamer->putln(oss.str(), chatllm::BaseStreamer::TextType::BATCH_REPLY);
+    }
+
+    return 0;
+}
+
 void chatllm_restart(struct chatllm_obj *obj, const char *utf8_sys_prompt)
 {
     DEF_CHAT_STREAMER();
@@ -16,6 +16,7 @@
 #include <type_traits>
 #include <utility>
 #include <numbers>
+#include <numeric>
 #include <unordered_map>
 
 #include "layers.h"
@@ -607,40 +608,72 @@ namespace chatllm
         for (size_t i = 0; i < token_history.size(); i++)
             token_history[i] = -1;
         hist_write = 0;
-        memset(token_count.data(), 0, token_count.size() * sizeof(token_count[0]));
+        for (auto id : active_tokens)
+        {
+            token_count[id] = 0;
+            active_index[id] = -1;
+        }
+        active_tokens.clear();
+    }
+
+    void LogitsPenalty::count(int token_id, int delta)
+    {
+        if (token_id < 0) return;
+        if (token_id >= (int)token_count.size())
+        {
+            token_count.resize(token_id + 1, 0);
+            active_index.resize(token_id + 1, -1);
+        }
+
+        const int old = token_count[token_id];
+        token_count[token_id] += delta;
+
+        if ((old == 0) && (token_count[token_id] > 0))
+        {
+            active_index[token_id] = (int)active_tokens.size();
+            active_tokens.push_back(token_id);
+        }
+        else if ((old > 0) && (token_count[token_id] == 0))
+        {
+            // swap with the last one, then remove
+            const int idx = active_index[token_id];
+            const int last = active_tokens.back();
+            active_tokens[idx] = last;
+            active_index[last] = idx;
+            active_tokens.pop_back();
+            active_index[token_id] = -1;
+        }
     }
 
     void LogitsPenalty::accept_choice(int token_id)
     {
         if (token_history.size() < 1) return;
-        int id = token_history[hist_write];
-        if ((0 <= id) && (id < (int)token_count.size()))
-            token_count[id]--;
+        count(token_history[hist_write], -1);
         token_history[hist_write++] = token_id;
         if (hist_write >= token_history.size()) hist_write = 0;
-        if ((0 <= token_id) && (token_id < (int)token_count.size()))
-            token_count[token_id]++;
+        count(token_id, 1);
     }
 
-    void LogitsPenalty::process(float *logits, const int vocab_size)
+    void LogitsPenalty::accept_history(const std::vector<int> &ids)
     {
-        if (token_history.size() < 1) return;
+        const size_t n = token_history.size();
+        for (size_t i = ids.size() > n ? ids.size() - n : 0; i < ids.size(); i++)
+            accept_choice(ids[i]);
+    }
 
-        if (vocab_size != (int)token_count.size())
+    void LogitsPenalty::process(float *logits, const int vocab_size)
+    {
+        // only tokens in the window are penalized
+        for (auto id : active_tokens)
         {
-            token_count.resize(vocab_size);
-        }
+            if (id >= vocab_size) continue;
 
-        for (int i = 0; i < vocab_size; i++)
-        {
+            const int n = token_count[id];
             if (repeat_penalty_en)
-            {
-                if (token_count[i] > 0)
-                    logits[i] *= logits[i] > 0 ? inv_repeat_penalty : repeat_penalty;
-            }
+                logits[id] *= logits[id] > 0 ? inv_repeat_penalty : repeat_penalty;
 
             if (freq_penalty_en)
-                logits[i] -= float(token_count[i]) * freq_penalty + float(token_count[i] > 0) * presence_penalty;
+                logits[id] -= float(n) * freq_penalty + presence_penalty;
         }
     }
 
@@ -654,156 +687,407 @@ namespace chatllm
         }
     };
 
-    class NonGreedySampler: public Sampler
+    // candidates shared by all stages of a sampler chain, so that stages do not
+    // add full-vocab passes. `sorted` (descending) and `normalized` (probabilities)
+    // are kept track of, and only done when needed.
+    class SamplerCandidates
     {
     public:
-        NonGreedySampler(const GenerationConfig &gen_config, float temperature, int top_k)
-            : Sampler(gen_config),
-              inv_temp(0.0f), top_k(top_k)
+        struct TokenIdScore
         {
-            temp_en = (fabs(temperature - 1.0f) > 1e-5f) && (fabs(temperature) > 1e-5f);
-            if (temp_en) inv_temp = 1.f / temperature;
-        }
+            int id;
+            float score;
 
+            bool operator<(const TokenIdScore &other) const { return score < other.score; }
+            bool operator>(const TokenIdScore &other) const { return score > other.score; }
+        };
 
-        int sampling(float *logits, const int vocab_size) override
+        // candidates (unordered) are the `top_k` ones, or the full vocab
+        void init(const float *logits, const int vocab_size, const int top_k)
         {
-            if (temp_en)
+            sorted = false;
+            normalized = false;
+
+            if ((top_k <= 0) || (top_k >= vocab_size))
             {
+                data.resize(vocab_size);
                 for (int i = 0; i < vocab_size; i++)
-                    logits[i] *= inv_temp;
+                    data[i] = {.id = i, .score = logits[i]};
+                return;
             }
 
-            penalty.process(logits, vocab_size);
+            // a min-heap of size `top_k`: most tokens are rejected by a single comparison
+            data.clear();
+            for (int i = 0; i < top_k; i++)
+                data.push_back({.id = i, .score = logits[i]});
+            std::make_heap(data.begin(), data.end(), std::greater<TokenIdScore>());
 
-            token_scores.resize(vocab_size);
+            float threshold = data.front().score;
+            for (int i = top_k; i < vocab_size; i++)
+            {
+                if (logits[i] <= threshold) continue;
+
+                std::pop_heap(data.begin(), data.end(), std::greater<TokenIdScore>());
+                data.back() = {.id = i, .score = logits[i]};
+                std::push_heap(data.begin(), data.end(), std::greater<TokenIdScore>());
+                threshold = data.front().score;
+            }
+        }
 
-            for (int i = 0; i < vocab_size; i++)
+        // softmax, or re-normalization if already normalized
+        void normalize(void)
+        {
+            if (data.size() < 1) return;
+
+            float sum = 0.f;
+            if (!normalized)
+            {
+                float max_score = sorted ? data[0].score : std::max_element(data.begin(), data.end())->score;
+                for (auto &t : data)
+                {
+                    t.score = std::exp(t.score - max_score);
+                    sum += t.score;
+                }
+                normalized = true;
+            }
+            else
             {
-                token_scores[i] = {.id = i, .score = logits[i]};
+                for (auto &t : data)
+                    sum += t.score;
             }
 
-            // top_k sampling
-            if (0 < top_k && top_k < (int)token_scores.size())
+            float inv_sum = 1.f / sum;
+            for (auto &t : data)
+                t.score *= inv_sum;
+        }
+
+        void sort(void)
+        {
+            if (sorted) return;
+            std::sort(data.begin(), data.end(), std::greater<TokenIdScore>());
+            sorted = true;
+        }
+
+        // number of leading tokens whose cumulative probability reaches `p`.
+        // the nucleus is usually small: only growing chunks of the head are sorted.
+        size_t sort_head(float p)
+        {
+            normalize();
+
+            const size_t n = data.size();
+            size_t i = 0;
+            size_t chunk = sorted ? n : 64;
+            float cumsum = 0.f;
+            while (i < n)
             {
-                std::nth_element(token_scores.begin(), token_scores.begin() + top_k, token_scores.end(),
-                                std::greater<TokenIdScore>());
-                token_scores.resize(top_k);
+                const size_t m = std::min(n, i + chunk);
+                if (!sorted)
+                {
+                    if (m < n)
+                        std::nth_element(data.begin() + i, data.begin() + m, data.end(), std::greater<TokenIdScore>());
+                    std::sort(data.begin() + i, data.begin() + m, std::greater<TokenIdScore>());
+                }
+
+                for (; i < m; i++)
+                {
+                    cumsum += data[i].score;
+                    if (cumsum >= p) return i + 1;
+                }
+                chunk *= 4;
             }
+            sorted = true;
+            return n;
+        }
 
-            do_sampling(logits, vocab_size);
+        void truncate(size_t n)
+        {
+            if (n < 1) n = 1;
+            if (n < data.size())
+                data.resize(n);
+        }
+
+        int draw(std::mt19937 &gen) const
+        {
+            // scores are (unnormalized) probabilities
+            float sum = 0.0f;
+            for (const auto &t : data)
+                sum += t.score;
+
+            std::uniform_real_distribution<float> dist(0.0f, sum);
+            float r = dist(gen);
+            for (const auto &t : data)
+            {
+                r -= t.score;
+                if (r < 0.0f)
+                    return t.id;
+            }
+            return data.back().id;
+        }
+
+    public:
+        std::vector<TokenIdScore> data;
+        bool sorted = false;
+        bool normalized = false;
+    };
+
+    class SamplerStage
+    {
+    public:
+        virtual ~SamplerStage() = default;
+
+        // sparse edits on logits of the full vocab, before candidates are selected
+        virtual void process_logits(float *logits, const int vocab_size) {}
+        virtual void process(SamplerCandidates &cands) {}
+
+        // final stage may pick the token itself. -1: not a picker
+        virtual int  pick(SamplerCandidates &cands, std::mt19937 &gen) { return -1; }
+
+        virtual void accept(int token_id) {}
+        // tokens in the context (prompt, ...), which are not sampled
+        virtual void accept_history(const std::vector<int> &ids) {}
+        virtual void reset(void) {}
+    };
 
-            if (token_scores.size() < 1)
-                return ABORT;
+    class LogitBiasStage : public SamplerStage
+    {
+    public:
+        LogitBiasStage(const std::map<int, float> &bias) : bias(bias) {}
 
-            // sample next token
-            std::vector<float> logits_candidates;
-            logits_candidates.resize(token_scores.size());
-            for (size_t i = 0; i < token_scores.size(); i++)
+        void process_logits(float *logits, const int vocab_size) override
+        {
+            for (const auto &kv : bias)
             {
-                logits_candidates[i] = token_scores[i].score;
+                if ((0 <= kv.first) && (kv.first < vocab_size))
+                    logits[kv.first] += kv.second;
             }
+        }
 
-            std::discrete_distribution<> dist(logits_candidates.data(), logits_candidates.data() + token_scores.size());
-            int next_token_id = token_scores[dist(gen)].id;
+    protected:
+        const std::map<int, float> bias;
+    };
 
-            penalty.accept_choice(next_token_id);
+    // stages that look at recent tokens, including those of the prompt
+    class HistoryStage : public SamplerStage
+    {
+    public:
+        HistoryStage(int window) : window(window > 0 ? window : 256) {}
 
-            return next_token_id;
+        void accept(int token_id) override
+        {
+            history.push_back(token_id);
+            if ((int)history.size() >= 2 * window)
+                history.erase(history.begin(), history.end() - window);
+        }
+
+        void accept_history(const std::vector<int> &ids) override
+        {
+            history.insert(history.end(), (int)ids.size() > window ? ids.end() - window : ids.begin(), ids.end());
+            if ((int)history.size() > window)
+                history.erase(history.begin(), history.end() - window);
+        }
+
+        void reset(void) override
+        {
+            history.clear();
         }
 
     protected:
-        struct TokenIdScore
+        // length of the common suffix of history[0..end) and the whole history
+        int match_suffix(int end, int max_len) const
         {
-            int id;
-            float score;
+            const int n = (int)history.size();
+            const int lower = std::max(0, n - window);
+            int len = 0;
+            while ((len < max_len) && (end - 1 - len >= lower) && (history[end - 1 - len] == history[n - 1 - len]))
+                len++;
+            return len;
+        }
 
-            bool operator<(const TokenIdScore &other) const { return score < other.score; }
-            bool operator>(const TokenIdScore &other) const { return score > other.score; }
-        };
+        const int window;
+        std::vector<int> history;
+    };
 
-        void sampling_softmax_inplace(TokenIdScore *first, TokenIdScore *last)
+    // No-repeat n-gram: tokens completing an n-gram that has already been generated are banned.
+    class NoRepeatNGramStage : public HistoryStage
+    {
+    public:
+        NoRepeatNGramStage(int ngram, int window) : HistoryStage(window), ngram(ngram) {}
+
+        void process_logits(float *logits, const int vocab_size) override
         {
-            float max_score = std::max_element(first, last)->score;
-            float sum = 0.f;
-            for (TokenIdScore *p = first; p != last; p++)
-            {
-                float s = std::exp(p->score - max_score);
-                p->score = s;
-                sum += s;
-            }
-            float inv_sum = 1.f / sum;
-            for (TokenIdScore *p = first; p != last; p++)
+            const int n = (int)history.size();
+            if (n < ngram - 1) return;
+
+            const int lower = std::max(0, n - window);
+            for (int end = lower + ngram - 1; end < n; end++)
             {
-                p->score *= inv_sum;
+                if (match_suffix(end, ngram - 1) < ngram - 1) continue;
+                const int id = history[end];
+                if (id < vocab_size)
+                    logits[id] = -INFINITY;
             }
         }
 
-        virtual void do_sampling(float *logits, const int vocab_size) = 0;
-        bool temp_en;
-        float inv_temp;
-        int top_k;
-        std::vector<TokenIdScore> token_scores;
+    protected:
+        const int ngram;
     };
 
-    class TopPSampler : public NonGreedySampler
+    // DRY ("Don't Repeat Yourself"): the token that would extend a repetition of length L
+    // (>= allowed_length) is penalized by `multiplier * base ^ (L - allowed_length)`.
+    // Reference: https://github.com/oobabooga/text-generation-webui/pull/5677
+    class DRYStage : public HistoryStage
     {
     public:
-        TopPSampler(const GenerationConfig &gen_config, float temperature, int top_k, float top_p)
-            : NonGreedySampler(gen_config, temperature, top_k), top_p(top_p)
+        DRYStage(float multiplier, float base, int allowed_length, int window)
+            : HistoryStage(window), multiplier(multiplier), base(base), allowed_length(allowed_length > 0 ? allowed_length : 1),
+              max_exponent(base > 1.000001f ? (int)(88.7228391f / std::log(base)) : 0)  // keep the penalty finite
         {}
 
-    protected:
-        void do_sampling(float *next_token_logits, const int vocab_size) override
+        void process_logits(float *logits, const int vocab_size) override
         {
-            // top_p sampling
-            if (0.f < top_p && top_p < 1.f)
+            const int n = (int)history.size();
+            const int lower = std::max(0, n - window);
+            const int m = n - lower;
+            if (m < 2) return;
+
+            // Z-function of the reversed window (like llama.cpp), so that this is O(window):
+            // z[k] is the length of the common suffix of history[lower, n - k) and history[lower, n).
+            auto rev = [this, n](int i) { return history[n - 1 - i]; };
+            z.assign(m, 0);
+            for (int k = 1, l = 0, r = 0; k < m; k++)
             {
-                std::sort(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>()); // hot code!
-                sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
-
-                float cumsum = 0.f;
-                for (size_t i = 0; i < token_scores.size(); i++)
+                if (k < r) z[k] = std::min(r - k, z[k - l]);
+                while ((k + z[k] < m) && (rev(z[k]) == rev(k + z[k]))) z[k]++;
+                if (k + z[k] > r)
                 {
-                    cumsum += token_scores[i].score;
-                    if (cumsum >= top_p)
-                    {
-                        token_scores.resize(i + 1);
-                        break;
-                    }
+                    l = k;
+                    r = k + z[k];
                 }
             }
 
-            sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
+            max_len.clear();
+            for (int k = 1; k < m; k++)
+            {
+                const int len = z[k];
+                if (len < allowed_length) continue;
+                const int id = history[n - k];
+                auto it = max_len.find(id);
+                if (it == max_len.end())
+                    max_len.emplace(id, len);
+                else if (it->second < len)
+                    it->second = len;
+            }
+
+            for (const auto &kv : max_len)
+            {
+                if (kv.first >= vocab_size) continue;
+                int e = kv.second - allowed_length;
+                if ((max_exponent > 0) && (e > max_exponent)) e = max_exponent;
+                logits[kv.first] -= multiplier * std::pow(base, (float)e);
+            }
+        }
+
+    protected:
+        const float multiplier;
+        const float base;
+        const int allowed_length;
+        const int max_exponent;
+        std::vector<int> z;
+        std::unordered_map<int, int> max_len;
+    };
+
+    class TopPStage : public SamplerStage
+    {
+    public:
+        TopPStage(float p) : p(p) {}
+
+        void process(SamplerCandidates &cands) override
+        {
+            cands.truncate(cands.sort_head(p));
+        }
+
+    protected:
+        const float p;
+    };
+
+    // Reference: https://github.com/huggingface/transformers/issues/27670
+    class MinPStage : public SamplerStage
+    {
+    public:
+        MinPStage(float p) : p(p) {}
+
+        void process(SamplerCandidates &cands) override
+        {
+            cands.normalize();
+            const float max_prob = cands.sorted ? cands.data[0].score
+                                                : std::max_element(cands.data.begin(), cands.data.end())->score;
+            const float threshold = p * max_prob;
+
+            // order is kept
+            cands.data.erase(std::remove_if(cands.data.begin(), cands.data.end(),
+                                            [threshold](const auto &t) { return t.score < threshold; }),
+                             cands.data.end());
+        }
+
+    protected:
+        const float p;
+    };
+
+    // Locally typical sampling. Reference: https://arxiv.org/abs/2202.00666
+    class TypicalStage : public SamplerStage
+    {
+    public:
+        TypicalStage(float p) : p(p) {}
+
+        void process(SamplerCandidates &cands) override
+        {
+            cands.normalize();
+
+            float entropy = 0.0f;
+            for (const auto &t : cands.data)
+                entropy += t.score > 0.0f ? -t.score * std::log(t.score) : 0.0f;
+
+            shifted.resize(cands.data.size());
+            for (size_t i = 0; i < cands.data.size(); i++)
+            {
+                const float score = cands.data[i].score;
+                shifted[i] = {score > 0.0f ? std::fabs(-std::log(score) - entropy) : INFINITY, (int)i};
+            }
+            std::sort(shifted.begin(), shifted.end());
 
-            // write back final scores
-            for (size_t i = 0; i < token_scores.size(); i++)
+            picked.clear();
+            float cumsum = 0.0f;
+            for (const auto &s : shifted)
             {
-                next_token_logits[token_scores[i].id] = token_scores[i].score;
+                picked.push_back(cands.data[s.second]);
+                cumsum += cands.data[s.second].score;
+                if (cumsum >= p) break;
             }
+
+            cands.data.swap(picked);
+            cands.sorted = false;
         }
 
     protected:
-        const float top_p;
+        const float p;
+        std::vector<std::pair<float, int>> shifted;
+        std::vector<SamplerCandidates::TokenIdScore> picked;
     };
 
     // Reference:
     // https://www.trentonbricken.com/Tail-Free-Sampling/#tail-free-sampling-algorithm
-    class FreeTailSampler : public NonGreedySampler
+    class TailFreeStage : public SamplerStage
     {
     public:
-        FreeTailSampler(const GenerationConfig &gen_config, float temperature, int top_k, float z)
-            : NonGreedySampler(gen_config, temperature, top_k), z(z)
-        {}
-
-    protected:
+        TailFreeStage(float z) : z(z) {}
 
-        void do_sampling(float *next_token_logits, const int vocab_size) override
+        void process(SamplerCandidates &cands) override
         {
-            if (token_scores.size() < 3) return;
+            cands.normalize();
+            if (cands.data.size() < 3) return;
 
-            sampling_softmax_inplace(token_scores.data(), token_scores.data() + token_scores.size());
-            std::sort(token_scores.begin(), token_scores.end(), std::greater<TokenIdScore>()); // hot code!
+            cands.sort();
+            auto &token_scores = cands.data;
 
             snd_d.resize(token_scores.size() - 2);
             for (size_t i = 0; i < snd_d.size(); i++)
@@ -840,21 +1124,182 @@ namespace chatllm
         std::vector<float> snd_d;
     };
 
+    // Mirostat 2.0. Reference: https://arxiv.org/abs/2007.14966
+    class MirostatV2Stage : public SamplerStage
+    {
+    public:
+        MirostatV2Stage(float tau, float eta) : tau(tau), eta(eta), mu(2 * tau) {}
+
+        int pick(SamplerCandidates &cands, std::mt19937 &gen) override
+        {
+            cands.normalize();
+
+            // tokens with surprise (-log2(p)) larger than `mu` are dropped, but keep the most likely one
+            const auto top = *std::max_element(cands.data.begin(), cands.data.end());
+            cands.data.erase(std::remove_if(cands.data.begin(), cands.data.end(),
+                                            [this](const auto &t) { return -std::log2(t.score) > mu; }),
+                             cands.data.end());
+            if (cands.data.size() < 1)
+                cands.data.push_back(top);
+            cands.normalize();
+
+            const int id = cands.draw(gen);
+            for (const auto &t : cands.data)
+            {
+                if (t.id != id) continue;
+                mu -= eta * (-std::log2(t.score) - tau);
+                break;
+            }
+            return id;
+        }
+
+        void reset(void) override
+        {
+            mu = 2 * tau;
+        }
+
+    protected:
+        const float tau;
+        const float eta;
+        float mu;
+    };
+
+    class SamplerChain : public Sampler
+    {
+    public:
+        SamplerChain(const GenerationConfig &gen_config, bool greedy)
+            : Sampler(gen_config),
+              greedy(greedy), inv_temp(0.0f), top_k(gen_config.top_k)
+        {
+            const float temperature = gen_config.temperature;
+            temp_en = !greedy && (fabs(temperature - 1.0f) > 1e-5f) && (fabs(temperature) > 1e-5f);
+            if (temp_en) inv_temp = 1.f / temperature;
+        }
+
+        void add(SamplerStage *stage)
+        {
+            stages.emplace_back(stage);
+        }
+
+        bool is_empty(void) const { return stages.size() < 1; }
+
+        void reset() override
+        {
+            Sampler::reset();
+            for (auto &s : stages)
+                s->reset();
+        }
+
+        void accept_history(const std::vector<int> &ids) override
+        {
+            Sampler::accept_history(ids);
+            for (auto &s : stages)
+                s->accept_history(ids);
+        }
+
+        int sampling(float *logits, const int vocab_size) override
+        {
+            if (temp_en)
+            {
+                const float s = inv_temp;
+                for (int i = 0; i < vocab_size; i++)
+                    logits[i] *= s;
+            }
+
+            // greedy: only requested stages edit logits
+            if (!greedy)
+                penalty.process(logits, vocab_size);
+
+            for (auto &s : stages)
+                s->process_logits(logits, vocab_size);
+
+            int next_token_id = ABORT;
+            if (greedy)
+            {
+                next_token_id = (int)(std::max_element(logits, logits + vocab_size) - logits);
+            }
+            else
+            {
+                cands.init(logits, vocab_size, top_k);
+
+                for (auto &s : stages)
+                {
+                    if (cands.data.size() < 1) break;
+                    s->process(cands);
+                }
+
+                if (cands.data.size() < 1)
+                    return ABORT;
+
+                if (stages.size() > 0)
+                    next_token_id = stages.back()->pick(cands, gen);
+
+                if (next_token_id < 0)
+                {
+                    cands.normalize();
+                    next_token_id = cands.draw(gen);
+                }
+            }
+
+            penalty.accept_choice(next_token_id);
+            for (auto &s : stages)
+                s->accept(next_token_id);
+
+            return next_token_id;
+        }
+
+    protected:
+        const bool greedy;
+        bool temp_en;
+        float inv_temp;
+        const int top_k;
+        std::vector<std::unique_ptr<SamplerStage>> stages;
+        SamplerCandidates cands;
+    };
+
     Sampler *SamplerFactory::Create(const GenerationConfig &gen_config, int seed)
     {
-        Sampler *r = nullptr;
-        if (gen_config.do_sample)
+        const bool greedy = !gen_config.do_sample || (gen_config.sampling == "greedy");
+        SamplerChain *chain = new SamplerChain(gen_config, greedy);
+
+        // logits processors
+        if (gen_config.logit_bias.size() > 0)
+            chain->add(new LogitBiasStage(gen_config.logit_bias));
+        if (gen_config.no_repeat_ngram > 0)
+            chain->add(new NoRepeatNGramStage(gen_config.no_repeat_ngram, gen_config.penalty_window));
+        if (gen_config.dry_multiplier > 0.0f)
+            chain->add(new DRYStage(gen_config.dry_multiplier, gen_config.dry_base, gen_config.dry_allowed_length, gen_config.penalty_window));
+
+        if (!greedy)
         {
+            if ((0.f < gen_config.typical_p) && (gen_config.typical_p < 1.f))
+                chain->add(new TypicalStage(gen_config.typical_p));
+
             if (gen_config.sampling == "top_p")
-                r = new TopPSampler(gen_config, gen_config.temperature, gen_config.top_k, gen_config.top_p);
+            {
+                if ((0.f < gen_config.top_p) && (gen_config.top_p < 1.f))
+                    chain->add(new TopPStage(gen_config.top_p));
+            }
             else if (gen_config.sampling == "tfs")
-                r = new FreeTailSampler(gen_config, gen_config.temperature, gen_config.top_k, gen_config.tfs_z);
-            else if (gen_config.sampling != "greedy")
+                chain->add(new TailFreeStage(gen_config.tfs_z));
+            else if (gen_config.sampling != "min_p")
                 CHATLLM_CHECK(false) << "unknown sampling algorithm: " << gen_config.sampling;
+
+            if (gen_config.min_p > 0.0f)
+                chain->add(new MinPStage(gen_config.min_p));
+
+            if (gen_config.mirostat == 2)
+                chain->add(new MirostatV2Stage(gen_config.mirostat_tau, gen_config.mirostat_eta));
+            else if (gen_config.mirostat != 0)
+                CHATLLM_CHECK(false) << "unsupported mirostat version: " << gen_config.mirostat;
         }
 
-        if (nullptr == r)
+        Sampler *r = chain;
+        if (greedy && chain->is_empty())
+        {
+            delete chain;
             r = new GreedySampler();
+        }
 
         r->seed(seed);
         return r;
@@ -893,6 +1338,10 @@ namespace chatllm
 
         transformer->shift_cache(n_past - keep, n_past);
         BaseModel::shift_memory(keep);
+
+        // shifting is done by ops of the next graph, which must not be reused
+        graph_cache.clear();
+        cache_shift_pending = true;
     }
 
     int64_t BaseModelForConditionalGeneration::get_param_num(bool effective_only) const
@@ -915,6 +1364,10 @@ namespace chatllm
         //printf("\nn_past = %d, %d\n\n", n_past, continuous);
 
         std::unique_ptr<Sampler> sampler = std::unique_ptr<Sampler>(SamplerFactory::Create(gen_config, get_seed()));
+        if (continuous)
+            sampler->accept_history(sampling_prefix);
+        sampler->accept_history(input_ids);
+        sampling_prefix.clear();
 
         aborted = false;
 
@@ -927,6 +1380,27 @@ namespace chatllm
         {
             n_past = 0;
             n_past_offset = 0;
+            seq_cache_cleared_cells = 0;
+        }
+
+        if (draft && (!continuous || (n_past != draft_synced_n_past)))
+        {
+            // KV cache is restored/rewound elsewhere, draft starts over
+            draft->set_n_past(0);
+            draft_pending.clear();
+        }
+
+        std::unique_ptr<NGramLookup> lookup;
+        if (gen_config.lookup_ngram > 0)
+        {
+            // same requirements as speculative decoding
+            if ((nullptr == dynamic_cast<LMFinalSteps *>(transformer->get_final_steps())) || !supports_sequence_batch())
+                ggml::log(GGML_LOG_LEVEL_WARN, "n-gram lookup is not supported by %s, fallback to normal decoding", type_name().c_str());
+            else
+            {
+                lookup.reset(new NGramLookup(gen_config.lookup_ngram));
+                lookup->append(input_ids);
+            }
         }
 
         completed = false;
@@ -955,7 +1429,36 @@ namespace chatllm
         {
             std::vector<float> lm_logits;
             const int last_n_past = n_past;
-            if (!generate_next_token(curr_input_ids, gen_config, lm_logits))
+
+            std::vector<int> draft_ids;
+            bool by_draft = false;
+            if (curr_input_ids.size() == 1)
+            {
+                int n = gen_config.max_length - n_past - 2;
+                if (gen_max_tokens > 0)
+                    n = std::min(n, gen_max_tokens - n_past - 2);
+
+                if (draft && (n > 0))
+                {
+                    propose_draft(curr_input_ids, gen_config, std::min(draft_len, n), draft_ids);
+                    by_draft = draft_ids.size() > 0;
+                }
+
+                if (!by_draft && lookup && (n > 0))
+                    lookup->propose(std::min(std::min(gen_config.lookup_len, n), batch_input - 1), draft_ids);
+            }
+
+            bool r = false;
+            if (draft_ids.size() > 0)
+            {
+                std::vector<int> ids(curr_input_ids);
+                ids.insert(ids.end(), draft_ids.begin(), draft_ids.end());
+                r = generate_all_logits(ids, gen_config, lm_logits);
+            }
+            else
+                r = generate_next_token(curr_input_ids, gen_config, lm_logits);
+
+            if (!r)
             {
                 ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
                 aborted = true;
@@ -979,6 +1482,8 @@ namespace chatllm
 
 //#define DISABLE_CACHE
 #ifndef DISABLE_CACHE
+            if (draft && !by_draft)
+                draft_pending.insert(draft_pending.end(), curr_input_ids.begin(), curr_input_ids.end());
             n_past += (int)curr_input_ids.size();
             curr_input_ids.clear();
 #endif
@@ -1004,6 +1509,8 @@ namespace chatllm
                 int pop_output = 0;
                 int keep_idx = 0;
                 output_ids.push_back(next_token_id);
+                if (lookup)
+                    lookup->append(next_token_id);
 
                 if (is_output_terminated(output_ids, keep_idx, pop_output))
                 {
@@ -1026,9 +1533,32 @@ namespace chatllm
                     aborted = true;
                     break;
                 }
+
+                if (draft_ids.size() > 0)
+                {
+                    if (completed || (tok_idx >= draft_ids.size()) || (next_token_id != draft_ids[tok_idx]))
+                        break;
+
+                    // accepted: KV of this token is already there
+                    n_past++;
+                    curr_input_ids.clear();
+                }
+            }
+
+            if (by_draft)
+            {
+                // rejected ones are simply dropped by `n_past`; so are those in draft
+                const int accepted = n_past - last_n_past - 1;
+                const int draft_past = draft->get_n_past();
+                if (accepted >= (int)draft_ids.size())
+                    draft_pending.push_back(draft_ids.back());
+                else
+                    draft->set_n_past(draft_past - ((int)draft_ids.size() - 1 - accepted));
             }
         }
 
+        draft_synced_n_past = n_past;
+
         if (aborted && !completed)
             completed = true;
 
@@ -1044,6 +1574,113 @@ namespace chatllm
         return output_ids;
     }
 
+    NGramLookup::NGramLookup(int ngram) : ngram(ngram), indexed(0)
+    {
+    }
+
+    void NGramLookup::append(int id)
+    {
+        tokens.push_back(id);
+    }
+
+    void NGramLookup::append(const std::vector<int> &ids)
+    {
+        tokens.insert(tokens.end(), ids.begin(), ids.end());
+    }
+
+    uint64_t NGramLookup::hash(const int *ids) const
+    {
+        // FNV-1a
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < ngram; i++)
+        {
+            h ^= (uint32_t)ids[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    void NGramLookup::propose(int max_len, std::vector<int> &ids)
+    {
+        const int n = (int)tokens.size();
+        if ((max_len < 1) || (n <= ngram)) return;
+
+        // index n-grams that have a continuation, the tail one is the query
+        for (; indexed + ngram < n; indexed++)
+            index[hash(tokens.data() + indexed)] = indexed;
+
+        const int *tail = tokens.data() + n - ngram;
+        auto it = index.find(hash(tail));
+        if (it == index.end()) return;
+
+        const int start = it->second;
+        if (!std::equal(tail, tail + ngram, tokens.data() + start)) return;
+
+        for (int i = start + ngram; (i < n) && ((int)ids.size() < max_len); i++)
+            ids.push_back(tokens[i]);
+    }
+
+    void BaseModelForConditionalGeneration::set_draft_model(AbstractModel *draft, int draft_len)
+    {
+        this->draft = nullptr;
+        this->draft_len = 0;
+        draft_pending.clear();
+        if ((nullptr == draft) || (draft_len < 1)) return;
+
+        // proposals are verified in a single run, and rejected ones are dropped by rewinding `n_past`
+        // (of both models), which is only valid for a plain KV cache.
+        if ((nullptr == dynamic_cast<LMFinalSteps *>(transformer->get_final_steps()))
+            || !supports_sequence_batch() || !draft->supports_sequence_batch())
+        {
+            ggml::log(GGML_LOG_LEVEL_WARN, "speculative decoding is not supported by %s", type_name().c_str());
+            return;
+        }
+
+        this->draft = draft;
+        this->draft_len = std::min(draft_len, batch_input - 1);
+        draft_synced_n_past = -1;
+    }
+
+    void BaseModelForConditionalGeneration::propose_draft(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int n, std::vector<int> &draft_ids)
+    {
+        std::vector<int> ids(draft_pending);
+        ids.insert(ids.end(), input_ids.begin(), input_ids.end());
+        draft_pending.clear();
+
+        // draft has its own context: `ids`, then each proposal but the last one, are fed into it
+        n = std::min(n, draft->get_max_length() - draft->get_n_past() - (int)ids.size() + 1);
+
+        std::vector<float> logits;
+        for (int i = 0; i < n; i++)
+        {
+            const int past = draft->get_n_past();
+            if (!draft->generate_next_token(ids, gen_config, logits) || (logits.size() < (size_t)config_.vocab_size))
+                break;
+            draft->set_n_past(past + (int)ids.size());
+
+            const float *last = logits.data() + logits.size() - config_.vocab_size;
+            const int id = (int)(std::max_element(last, last + config_.vocab_size) - last);
+            draft_ids.push_back(id);
+            ids = {id};
+        }
+
+        // last proposal is not fed into draft
+        if (draft_ids.size() < 1)
+            draft_pending.assign(ids.begin(), ids.end() - input_ids.size());
+    }
+
+    bool BaseModelForConditionalGeneration::generate_all_logits(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits)
+    {
+        LMFinalSteps *final_steps = dynamic_cast<LMFinalSteps *>(transformer->get_final_steps());
+        CHATLLM_CHECK(final_steps != nullptr) << "LMFinalSteps is required";
+
+        const int last_n = final_steps->get_read_last_n();
+        final_steps->set_read_last_n((int)input_ids.size());
+        bool r = run_model(input_ids.data(), (int)input_ids.size(), gen_config, n_past + n_past_offset, lm_logits, 1);
+        final_steps->set_read_last_n(last_n);
+        return r;
+    }
+
     void BaseModelForConditionalGeneration::text_embedding(const GenerationConfig &gen_config, const std::vector<int> &input_ids,
                                 std::vector<float> &embedding)
     {
@@ -1051,6 +1688,89 @@ namespace chatllm
         if (!r) ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
     }
 
+    bool BaseModelForConditionalGeneration::run_packed(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs, int dim,
+                                std::vector<float> &outputs)
+    {
+        // cost of attention grows quadratically with the packed length
+        const int max_tokens = std::min(config_.max_length, 1024);
+
+        // longest first, so that packs are filled by inputs of similar lengths
+        std::vector<size_t> order(inputs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&inputs](size_t a, size_t b) { return inputs[a].size() > inputs[b].size(); });
+
+        const size_t offset = outputs.size();
+        outputs.resize(offset + inputs.size() * dim);
+
+        SequenceBatch batch;
+        std::vector<int> starts;
+        std::vector<float> output;
+        size_t i = 0;
+        while ((i < order.size()) && !aborted)
+        {
+            size_t j = i;
+            int n_tokens = 0;
+            for (; j < order.size(); j++)
+            {
+                const int len = (int)inputs[order[j]].size();
+                if ((j > i) && (n_tokens + len > max_tokens)) break;
+                n_tokens += len;
+            }
+
+            bool r = false;
+            if (j - i == 1)
+            {
+                r = run_model(inputs[order[i]], gen_config, 0, output);
+            }
+            else
+            {
+                batch.clear();
+                starts.clear();
+                for (size_t k = i; k < j; k++)
+                {
+                    const auto &ids = inputs[order[k]];
+                    starts.push_back(batch.get_n_tokens());
+                    for (int p = 0; p < (int)ids.size(); p++)
+                        batch.add(ids[p], p, batch.get_n_tokens(), p == 0);
+                }
+                starts.push_back(n_tokens);
+
+                // block diagonal
+                batch.mask.assign((size_t)n_tokens * batch.n_cells, -INFINITY);
+                for (size_t k = 0; k + 1 < starts.size(); k++)
+                {
+                    for (int t = starts[k]; t < starts[k + 1]; t++)
+                        std::fill(batch.mask.begin() + (size_t)t * batch.n_cells + starts[k],
+                                  batch.mask.begin() + (size_t)t * batch.n_cells + starts[k + 1], 0.0f);
+                }
+
+                seq_batch = &batch;
+                r = run_model(batch.ids.data(), n_tokens, gen_config, 0, output);
+                seq_batch = nullptr;
+            }
+
+            if (!r)
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "Out of memory");
+                break;
+            }
+            CHATLLM_CHECK(output.size() == (j - i) * dim) << "run_packed: unexpected output size " << output.size();
+
+            for (size_t k = i; k < j; k++)
+                memcpy(outputs.data() + offset + order[k] * dim, output.data() + (k - i) * dim, dim * sizeof(float));
+
+            i = j;
+        }
+
+        // out of memory, or aborted
+        if (i < order.size())
+        {
+            outputs.resize(offset);
+            return false;
+        }
+        return true;
+    }
+
     float BaseModelForConditionalGeneration::qa_rank(const GenerationConfig &gen_config, const std::vector<int> &input_ids)
     {
         std::vector<float> output;
@@ -1064,10 +1784,23 @@ namespace chatllm
     bool BaseModelForConditionalGeneration::generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits)
     {
         int batch = batch_input > 1 ? batch_input : 1;
+        int past = n_past + n_past_offset;
+
+        if ((input_ids.size() == 1) && (past < config_.max_length) && supports_sequence_batch())
+        {
+            // a decoding step goes through a sequence batch, so that its graph is reused
+            // while `past` stays in the same bucket of cells.
+            const int pad = 256;
+            SequenceBatch step;
+            step.add(input_ids[0], past, past, true);
+            step.n_cells = std::min((past + pad) / pad * pad, config_.max_length);
+            step.mask.assign(step.n_cells, -INFINITY);
+            std::fill(step.mask.begin(), step.mask.begin() + past + 1, 0.0f);
+            return decode_batch(gen_config, step, lm_logits);
+        }
 
         const int *p = input_ids.data();
         int remain = (int)input_ids.size();
-        int past = n_past + n_past_offset;
 
         for (; (remain > batch) && !aborted; p += batch, remain -= batch, past += batch)
         {
@@ -1078,6 +1811,87 @@ namespace chatllm
         return run_model(p, remain, gen_config,past, lm_logits, 1);
     }
 
+    bool BaseModelForConditionalGeneration::supports_sequence_batch(void)
+    {
+        if ((batch_input <= 1) || (transformer->get_reserved_batch_size() != 1))
+            return false;
+
+        for (int i = 0; i < transformer->get_layer_num(); i++)
+        {
+            if (!transformer->get_layer(i)->supports_sequence_batch())
+                return false;
+        }
+        return true;
+    }
+
+    void BaseModelForConditionalGeneration::set_n_past(int n_past)
+    {
+        BaseModel::set_n_past(n_past);
+        // cache is reset or rewound
+        seq_cache_cleared_cells = std::min(seq_cache_cleared_cells, n_past);
+    }
+
+    bool BaseModelForConditionalGeneration::decode_batch(const GenerationConfig &gen_config, const SequenceBatch &batch, std::vector<float> &lm_logits)
+    {
+        const int n_tokens = batch.get_n_tokens();
+        if ((n_tokens < 1) || (batch.outputs.size() < 1)) return false;
+        if (!supports_sequence_batch()) return false;
+
+        CHATLLM_CHECK((batch.n_cells >= n_tokens) && (batch.n_cells <= config_.max_length)) << "decode_batch: bad n_cells " << batch.n_cells;
+        CHATLLM_CHECK(batch.mask.size() == (size_t)batch.n_cells * n_tokens) << "decode_batch: mask size mismatch";
+
+        // cells in a partially filled block are visible to attention (though masked),
+        // so they must never hold garbage like NaN. only newly visible ones are cleared,
+        // and cells written by `run_model` (below `n_past`) are never touched.
+        const int first_to_clear = std::max(seq_cache_cleared_cells, n_past + n_past_offset);
+        if (batch.n_cells > first_to_clear)
+        {
+            for (int i = 0; i < transformer->get_layer_num(); i++)
+                transformer->get_layer(i)->clear_cache_cells(first_to_clear, batch.n_cells - first_to_clear);
+        }
+        seq_cache_cleared_cells = std::max(seq_cache_cleared_cells, batch.n_cells);
+
+        if (n_tokens > batch_input)
+        {
+            // tokens are evaluated `batch_input` at a time. a token never attends to
+            // cells of later tokens, so these are not needed to be written yet.
+            SequenceBatch part;
+            std::vector<float> logits;
+            lm_logits.clear();
+            size_t next_output = 0;
+            for (int i = 0; i < n_tokens; i += batch_input)
+            {
+                const int n = std::min(batch_input, n_tokens - i);
+                const size_t first_output = next_output;
+                part.clear();
+                part.n_cells = batch.n_cells;
+                for (int j = i; j < i + n; j++)
+                {
+                    const bool output = (next_output < batch.outputs.size()) && (batch.outputs[next_output] == j);
+                    if (output) next_output++;
+                    part.add(batch.ids[j], batch.pos[j], batch.cells[j], output);
+                }
+                if (part.outputs.size() < 1)
+                    part.outputs.push_back(n - 1);
+                part.mask.assign(batch.mask.begin() + (size_t)i * batch.n_cells, batch.mask.begin() + (size_t)(i + n) * batch.n_cells);
+
+                if (!decode_batch(gen_config, part, logits))
+                    return false;
+                if (next_output > first_output)
+                    lm_logits.insert(lm_logits.end(), logits.begin(), logits.end());
+            }
+            return true;
+        }
+
+        seq_batch = &batch;
+
+        // with `past = n_cells - n_tokens`, attention sees exactly `n_cells` cells
+        bool r = run_model(batch.ids.data(), n_tokens, gen_config, batch.n_cells - n_tokens, lm_logits);
+
+        seq_batch = nullptr;
+        return r;
+    }
+
     int BaseModelForConditionalGeneration::save_session(FILE *f) const
     {
         int r = BaseModel::save_session(f);
@@ -1090,6 +1904,7 @@ namespace chatllm
     {
         int r = BaseModel::load_session(f);
         if (r != 0) return r;
+        seq_cache_cleared_cells = 0;
         return transformer->load_session(f);
     }
 
@@ -1105,6 +1920,8 @@ namespace chatllm
     {
         int r = BaseModel::load_session(session);
         if (r != 0) return r;
+        // cells above `n_past` come from the session, and may not be cleared
+        seq_cache_cleared_cells = 0;
         return transformer->load_session(session);
     }
 
@@ -1190,14 +2007,34 @@ namespace chatllm
                 return false;
         }
 
-        ForwardContext ctx(&backend_context);
+        // graph of a sequence batch depends on nothing but its shape: positions, cells and masks are all inputs
+        const bool cacheable = seq_batch && (nullptr == func_epilog) && (gen_config.dump_dot.size() < 1) && !cache_shift_pending;
+        cache_shift_pending = false;
+        const GraphCache::Key key = {ids_count, batch_size, seq_batch ? seq_batch->n_cells : 0, seq_batch ? (int)seq_batch->outputs.size() : 0};
+
+        // once the scheduler has been used by others in between, tensors of the cached graph may point into
+        // a compute buffer that has been reallocated, so the graph is built again.
+        if (cacheable && graph_cache.ctx && (graph_cache.key == key) && (graph_cache.alloc_serial == backend_context.get_alloc_serial()))
+            return run_cached_graph(input_ids, *seq_batch, output);
+
+        graph_cache.clear();
+
+        std::unique_ptr<SequenceBatchInputs> inputs(seq_batch ? new SequenceBatchInputs(*seq_batch) : nullptr);
+        std::unique_ptr<ForwardContext> owned_ctx(new ForwardContext(&backend_context));
+        ForwardContext &ctx = *owned_ctx;
         ctx.user_options = w_ctx_.user_options;
 
-        ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = backend_context.buf_compute_meta.data(), .no_alloc = true});
+        // a cached graph keeps its own meta data
+        std::vector<uint8_t> meta;
+        if (cacheable)
+            meta.resize(backend_context.buf_compute_meta.size());
+        uint8_t *meta_buf = cacheable ? meta.data() : backend_context.buf_compute_meta.data();
+
+        ctx.gctx = GGMLContext({.mem_size = backend_context.buf_compute_meta.size(), .mem_buffer = meta_buf, .no_alloc = true});
         ctx.gf = ggml::new_graph_custom(&ctx, GRAPH_SIZE, false);
 
         dbg_ctx = &ctx;
-
+        ctx.seq_inputs = inputs.get();
         ctx.move_to_layer(LayerAllocatorManager::MiscLayer::Prolog);
         ggml::tensor *input_ids_tensor = ggml::new_tensor_2d(&ctx, GGML_TYPE_I32, ids_count, batch_size);
 
@@ -1224,6 +2061,8 @@ namespace chatllm
         if (!ctx.allocate()) return false;
 
         Backend::write_tensor_data(input_ids_tensor, input_ids);
+        if (ctx.seq_inputs)
+            ctx.seq_inputs->write();
 
         if (gen_config.dump_dot.size() > 0)
         {
@@ -1235,11 +2074,51 @@ namespace chatllm
 
         Backend::read_tensor_data(r, output.data());
 
-        ctx.reset();
+        if (cacheable)
+        {
+            graph_cache.key         = key;
+            graph_cache.meta        = std::move(meta);
+            graph_cache.ctx         = std::move(owned_ctx);
+            graph_cache.seq_inputs  = std::move(inputs);
+            graph_cache.input_ids   = input_ids_tensor;
+            graph_cache.output      = r;
+            graph_cache.alloc_serial = backend_context.get_alloc_serial();
+        }
+        else
+            ctx.reset();
+
+        return true;
+    }
+
+    bool BaseModelForConditionalGeneration::run_cached_graph(const int *input_ids, const SequenceBatch &batch, std::vector<float> &output)
+    {
+        ForwardContext &ctx = *graph_cache.ctx;
+
+        dbg_ctx = &ctx;
+        graph_cache.seq_inputs->set_batch(batch);
+        ctx.seq_inputs = graph_cache.seq_inputs.get();
+
+        Backend::write_tensor_data(graph_cache.input_ids, input_ids);
+        ctx.seq_inputs->write();
 
+        ctx.compute();
+
+        output.resize(ggml::nbytes(graph_cache.output) / sizeof(output[0]));
+        Backend::read_tensor_data(graph_cache.output, output.data());
         return true;
     }
 
+    void BaseModelForConditionalGeneration::GraphCache::clear(void)
+    {
+        if (ctx)
+            ctx->reset();
+        ctx.reset();
+        seq_inputs.reset();
+        meta.clear();
+        input_ids = nullptr;
+        output = nullptr;
+    }
+
     bool BaseModelForConditionalGeneration::is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output)
     {
         if (output_ids.size() < 1)
@@ -1421,9 +2300,20 @@ namespace chatllm
 
     int HeterogeneousModel::save_session(ModelSessionMemory &session) const
     {
+        const int n_cells = session.get_n_cells();
         for (int layer_id = 0; layer_id < num_hidden_layers; layer_id++)
         {
             auto layer = layers[layer_id];
+            if (n_cells > 0)
+            {
+                const size_t size = layer->get_cache_cells_size(n_cells);
+                if ((size < 1) && (layer->get_cache_size() > 0)) return -2;
+                void *buf = session.prepare_buffer(layer_id, size);
+                if (layer->read_cache_cells(n_cells, buf, size) != size)
+                    return -1;
+                continue;
+            }
+
             const size_t size = layer->get_cache_size();
             void *buf = session.prepare_buffer(layer_id, size);
             if (layer->read_cache_data(buf, size) != size)
@@ -1435,11 +2325,20 @@ namespace chatllm
 
     int HeterogeneousModel::load_session(ModelSessionMemory &session)
     {
+        const int n_cells = session.get_n_cells();
         for (int layer_id = 0; layer_id < num_hidden_layers; layer_id++)
         {
             auto layer = layers[layer_id];
             size_t size = 0;
             void *buf = session.get_buffer(layer_id, &size);
+            if (n_cells > 0)
+            {
+                if (size != layer->get_cache_cells_size(n_cells)) return -1;
+                if (layer->write_cache_cells(n_cells, buf, size) != size)
+                    return -3;
+                continue;
+            }
+
             if (size != layer->get_cache_size()) return -1;
             if (layer->write_cache_data(buf, size) != size)
                 return -3;
@@ -1479,13 +2378,17 @@ namespace chatllm
 
     ggml::tensor *LMFinalSteps::forward(HeterogeneousModel *model, ComputeContext *ctx, ggml::tensor *input_ids, ggml::tensor *hidden_states)
     {
-        const int qlen  = ggml::get_dim(hidden_states, 1);
-        const int batch = ggml::get_dim(hidden_states, 2);
-        const int last_n = qlen >= this->last_n ? this->last_n : qlen;
         order = nullptr;
 
         if (disable_head) return hidden_states;
 
+        if (ctx->seq_inputs)
+            hidden_states = ggml::get_rows(ctx, hidden_states, ctx->seq_inputs->get_outputs(ctx));
+
+        const int qlen  = ggml::get_dim(hidden_states, 1);
+        const int batch = ggml::get_dim(hidden_states, 2);
+        const int last_n = ctx->seq_inputs ? qlen : (qlen >= this->last_n ? this->last_n : qlen);
+
         hidden_states = ggml::view_3d(ctx, hidden_states, model->hidden_size, last_n, batch,
             ggml::row_size(hidden_states),
             ggml::row_size(hidden_states) * qlen,
@@ -1541,6 +2444,10 @@ namespace chatllm
 
     ggml::tensor *EmbeddingPoolingFinalSteps::forward(HeterogeneousModel *model, ComputeContext *ctx, ggml::tensor *input_ids, ggml::tensor *hidden_states)
     {
+        // a packed batch: each sequence is pooled from its token in `outputs`
+        if (ctx->seq_inputs)
+            hidden_states = ggml::get_rows(ctx, hidden_states, ctx->seq_inputs->get_outputs(ctx));
+
         ggml::tensor *transformer_outputs = model->final_layernorm->forward(ctx, hidden_states);
 
         return transformer_outputs;
@@ -1703,7 +2610,7 @@ namespace chatllm
         return true;
     }
 
-    static void load_file_header(ModelLoader &loader)
+    void ModelFactory::load_file_header(ModelLoader &loader)
     {
         // load magic
         loader.seek(0, SEEK_SET);
@@ -1863,3 +2770,171 @@ namespace chatllm
     }
 
 } // namespace chatllm
+
+namespace chatllm
+{
+    ContinuousBatchScheduler::ContinuousBatchScheduler(AbstractModel *model, BaseTokenizer *tokenizer, const GenerationConfig &gen_config,
+                                                       int max_tokens_per_step, int block_size)
+        : model(model), tokenizer(tokenizer), gen_config(gen_config),
+          max_tokens_per_step(max_tokens_per_step > 0 ? max_tokens_per_step : 1),
+          next_id(0),
+          pool(model->get_max_length(), block_size)
+    {
+        CHATLLM_CHECK(model->supports_sequence_batch()) << "continuous batching is not supported by this model";
+    }
+
+    ContinuousBatchScheduler::~ContinuousBatchScheduler()
+    {
+    }
+
+    int ContinuousBatchScheduler::add_request(const std::vector<int> &input_ids, int max_new_tokens)
+    {
+        CHATLLM_CHECK(input_ids.size() > 0) << "add_request: empty input";
+
+        auto req = std::make_unique<Request>();
+        req->id = next_id++;
+        req->max_new_tokens = max_new_tokens >= 0 ? max_new_tokens : gen_config.max_new_tokens;
+        req->sampler = std::unique_ptr<Sampler>(SamplerFactory::Create(gen_config, model->get_seed()));
+        req->sampler->accept_history(input_ids);
+        req->completed = false;
+
+        // reuse KV of shared prefix, but always leave at least one token to produce logits
+        const int matched = pool.match(input_ids, (int)input_ids.size() - 1, req->blocks);
+        req->tokens.assign(input_ids.begin(), input_ids.begin() + matched);
+        req->pending.assign(input_ids.begin() + matched, input_ids.end());
+
+        const int id = req->id;
+        requests.push_back(std::move(req));
+        return id;
+    }
+
+    void ContinuousBatchScheduler::cancel(int id)
+    {
+        for (auto it = requests.begin(); it != requests.end(); ++it)
+        {
+            if ((*it)->id != id) continue;
+            pool.release((*it)->blocks);
+            requests.erase(it);
+            return;
+        }
+    }
+
+    void ContinuousBatchScheduler::complete(Request *req)
+    {
+        if (req->completed) return;
+        req->completed = true;
+        pool.release(req->blocks);
+        if (on_completed)
+            on_completed(req->id, req->output);
+    }
+
+    bool ContinuousBatchScheduler::step(void)
+    {
+        if (requests.empty()) return false;
+
+        std::vector<Request *> out_reqs;
+        std::vector<const std::vector<int> *> token_tables;
+        std::vector<Request *> exhausted;
+        std::vector<Request *> waiting;
+        int budget = max_tokens_per_step;
+
+        batch.clear();
+
+        // requests that are decoding go first, then prompts get the remaining budget
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (auto &r : requests)
+            {
+                Request *req = r.get();
+                if ((pass == 0) != (req->pending.size() == 1)) continue;
+                if (budget <= 0) break;
+
+                const int n_past = (int)req->tokens.size();
+                int n = std::min((int)req->pending.size(), budget);
+                if (n_past + n > gen_config.max_length)
+                    n = gen_config.max_length - n_past;
+
+                if ((n < (int)req->pending.size()) && (n < budget))
+                    exhausted.push_back(req);
+
+                // out of blocks: take what fits, and wait for others to finish
+                while ((n > 0) && !pool.reserve(req->blocks, n_past + n))
+                    n--;
+                if (n < 1)
+                    waiting.push_back(req);
+
+                for (int i = 0; i < n; i++)
+                {
+                    const int pos = n_past + i;
+                    batch.add(req->pending[i], pos, pool.cell_of(req->blocks, pos), i == (int)req->pending.size() - 1);
+                    token_tables.push_back(&req->blocks);
+                }
+
+                if ((n > 0) && (n == (int)req->pending.size()))
+                    out_reqs.push_back(req);
+                req->tokens.insert(req->tokens.end(), req->pending.begin(), req->pending.begin() + n);
+                req->pending.erase(req->pending.begin(), req->pending.begin() + n);
+                budget -= n;
+            }
+        }
+
+        if (batch.get_n_tokens() > 0)
+        {
+            pool.build_mask(batch, token_tables);
+
+            // only parts of prompts are evaluated: still need one output
+            if (out_reqs.size() < 1)
+                batch.outputs.push_back(batch.get_n_tokens() - 1);
+
+            std::vector<float> lm_logits;
+            if (!model->decode_batch(gen_config, batch, lm_logits))
+            {
+                ggml::log(GGML_LOG_LEVEL_ERROR, "decode_batch failed");
+                return false;
+            }
+
+            for (auto &r : requests)
+                pool.publish(r->blocks, r->tokens);
+
+            const int vocab_size = (int)(lm_logits.size() / batch.outputs.size());
+            float *logits = lm_logits.data();
+            for (size_t i = 0; i < out_reqs.size(); i++, logits += vocab_size)
+            {
+                Request *req = out_reqs[i];
+                const int next_token_id = req->sampler->sampling(logits, vocab_size);
+                if (next_token_id == Sampler::ABORT)
+                {
+                    complete(req);
+                    continue;
+                }
+
+                if (tokenizer->is_terminate_token_id(next_token_id))
+                {
+                    complete(req);
+                    continue;
+                }
+
+                req->output.push_back(next_token_id);
+                req->pending.push_back(next_token_id);
+                if (on_token)
+                    on_token(req->id, next_token_id);
+
+                if ((req->max_new_tokens > 0) && ((int)req->output.size() >= req->max_new_tokens))
+                    complete(req);
+            }
+        }
+
+        // no progress at all: give up those requests to avoid a dead lock
+        if (batch.get_n_tokens() < 1)
+            exhausted.insert(exhausted.end(), waiting.begin(), waiting.end());
+
+        for (auto req : exhausted)
+            complete(req);
+
+        requests.erase(std::remove_if(requests.begin(), requests.end(),
+                                      [](const std::unique_ptr<Request> &r) { return r->completed; }),
+                       requests.end());
+
+        return true;
+    }
+}
@@ -106,6 +106,7 @@ namespace chatllm
         friend LMFinalStepsDisabler;
         ggml::tensor *forward(HeterogeneousModel *model, ComputeContext *ctx, ggml::tensor *input_ids, ggml::tensor *hidden_states) override;
         void set_read_last_n(int n);
+        int  get_read_last_n(void) const { return last_n; }
         void set_do_orderring(bool flag);   // descending
         ggml::tensor *get_orderring_result(void);
     protected:
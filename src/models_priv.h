@@ -372,6 +372,27 @@ namespace chatllm
     void set_dbg_ctx(ForwardContext *c);
     void unset_dbg_ctx(ForwardContext *c);
 
+    // prompt lookup decoding: continuation of the latest earlier occurrence of the last n-gram
+    // (in prompt and output so far) is proposed as draft.
+    class NGramLookup
+    {
+    public:
+        NGramLookup(int ngram);
+
+        void append(int id);
+        void append(const std::vector<int> &ids);
+        void propose(int max_len, std::vector<int> &ids);
+
+    protected:
+        uint64_t hash(const int *ids) const;
+
+    protected:
+        const int ngram;
+        int indexed;
+        std::vector<int> tokens;
+        std::unordered_map<uint64_t, int> index;
+    };
+
     class BaseModelForConditionalGeneration : public BaseModel
     {
     public:
@@ -392,6 +413,11 @@ namespace chatllm
                                     std::vector<float> &embedding) override;
         float qa_rank(const GenerationConfig &gen_config, const std::vector<int> &input_ids) override;
         bool generate_next_token(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits) override;
+        bool supports_sequence_batch(void) override;
+        bool decode_batch(const GenerationConfig &gen_config, const SequenceBatch &batch, std::vector<float> &lm_logits) override;
+        void set_n_past(int n_past) override;
+        void set_draft_model(AbstractModel *draft, int draft_len) override;
+        void set_sampling_prefix(const std::vector<int> &ids) override { sampling_prefix = ids; }
         int save_session(FILE *f) const override;
         int load_session(FILE *f) override;
         int save_session(ModelSessionMemory &session) const override;
@@ -423,6 +449,19 @@ namespace chatllm
                                const int batch_size = 1,
                                std::function<ggml::tensor *(ComputeContext *, ggml::tensor *)> func_epilog = nullptr);
 
+        // logits of all `input_ids` are returned one after another
+        bool generate_all_logits(const std::vector<int> &input_ids, const GenerationConfig &gen_config, std::vector<float> &lm_logits);
+
+        void propose_draft(const std::vector<int> &input_ids, const GenerationConfig &gen_config, int n, std::vector<int> &draft_ids);
+
+        bool run_cached_graph(const int *input_ids, const SequenceBatch &batch, std::vector<float> &output);
+
+        // inputs of similar lengths are packed into a single sequence batch, where each attends to itself only.
+        // `dim` values are appended for each input, or none if it fails (out of memory, or aborted).
+        // requires: tokens in `outputs` are pooled (see `EmbeddingPoolingFinalSteps`), and attention is masked by the batch.
+        bool run_packed(const GenerationConfig &gen_config, const std::vector<std::vector<int>> &inputs, int dim,
+                        std::vector<float> &outputs);
+
         virtual bool is_output_terminated(const std::vector<int> &output_ids, int &keep_idx, int &pop_output);
 
         bool match_output_sequence(const std::vector<int> &output_ids, const std::vector<int> &pattern);
@@ -442,6 +481,38 @@ namespace chatllm
         InitContext w_ctx_; // weight context
         BaseConfig config_;
         bool initial_run = false;
+        const SequenceBatch *seq_batch = nullptr;
+        int seq_cache_cleared_cells = 0;   // cells below it (or below `n_past`) hold written or cleared data
+        bool cache_shift_pending = false;
+
+        // the last graph of a sequence batch, reused while the shape is unchanged
+        struct GraphCache
+        {
+            struct Key
+            {
+                int ids_count;
+                int batch_size;
+                int n_cells;
+                int n_outputs;
+                bool operator==(const Key &other) const = default;
+            };
+
+            void clear(void);
+
+            Key key = {};
+            std::vector<uint8_t> meta;
+            std::unique_ptr<ForwardContext> ctx;
+            std::unique_ptr<SequenceBatchInputs> seq_inputs;
+            ggml::tensor *input_ids = nullptr;
+            ggml::tensor *output = nullptr;
+            int alloc_serial = 0;
+        };
+        GraphCache graph_cache;
+        AbstractModel *draft = nullptr;
+        int draft_len = 0;
+        std::vector<int> draft_pending;     // tokens in KV cache, but not in draft's
+        int draft_synced_n_past = -1;
+        std::vector<int> sampling_prefix;
     };
 
     template <class Config, class Embedding, class FinalNorm, class LayerBlock, typename... _Types> class Model :
@@ -596,8 +667,14 @@ namespace chatllm
 
         virtual void accept_choice(int token_id);
 
+        // tokens already in the context; only the last ones (of the window) matter
+        void accept_history(const std::vector<int> &ids);
+
         virtual void process(float *logits, const int vocab_size);
 
+    protected:
+        void count(int token_id, int delta);
+
     protected:
         const bool repeat_penalty_en;
         const bool freq_penalty_en;
@@ -607,6 +684,8 @@ namespace chatllm
         const float presence_penalty;
         std::vector<int> token_history;
         std::vector<int> token_count;
+        std::vector<int> active_tokens;     // tokens in the window (count > 0)
+        std::vector<int> active_index;      // index in `active_tokens`, -1 if absent
         size_t hist_write;
         std::set<int> skip_tokens;
     };
@@ -632,6 +711,12 @@ namespace chatllm
             penalty.reset();
         }
 
+        // tokens in the context (prompt, ...), which are not sampled
+        virtual void accept_history(const std::vector<int> &ids)
+        {
+            penalty.accept_history(ids);
+        }
+
         virtual int sampling(float *logits, const int vocab_size) = 0;
     public:
         LogitsPenalty penalty;
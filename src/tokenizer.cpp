@@ -1,11 +1,13 @@
 #include "tokenizer.h"
 
 #include <queue>
+#include <algorithm>
 #include <memory>
 #include <cstring>
 #include <limits>
 #include <regex>
 #include <iostream>
+#include <mutex>
 
 #include "unicode.h"
 #include "chat.h"
@@ -232,34 +234,21 @@ int Processor::Encode(const std::string &input, std::vector<int> *ids) const
     for (auto & p : pp)
         s = p->transform(s);
 
-    while (true)
+    std::string part;
+    size_t offset = 0;
+    size_t pos = 0;
+    size_t len = 0;
+    int special_id = -1;
+    while (added_token_searcher.search(s, offset, pos, len, special_id))
     {
-        size_t special_pos = std::string::npos;
-        int special_id = -1;
-        size_t special_tok_len = 0;
-
-        for (auto & tok : added_tokens)
-        {
-            size_t pos = s.find(tok.token);
-
-            if (pos < special_pos)
-            {
-                special_pos = pos;
-                special_id = tok.id;
-                special_tok_len = tok.token.size();
-            }
-        }
-
-        if (std::string::npos == special_pos)
-            break;
-
-        std::string part = s.substr(0, special_pos);
+        part.assign(s, offset, pos - offset);
         DoEncode(part, ids);
-
-        s = s.substr(special_pos + special_tok_len);
         ids->push_back(special_id);
+        offset = pos + len;
     }
 
+    if (offset > 0)
+        s.erase(0, offset);
     DoEncode(s, ids);
 
     return 0;
@@ -290,6 +279,8 @@ void Processor::AddAddedToken(const std::string &tok, int id)
 {
     OverrideTokenDecoding(id, tok);
     added_tokens.emplace_back(TokenId{tok, id});
+    added_token_searcher.add(tok, id);
+    added_token_searcher.build();
 }
 
 int Processor::Decode(const std::vector<int> &ids, std::string *detokenized) const
@@ -379,10 +370,61 @@ static int load_vocab_list(_vocab &vocab, Reader &reader, bool has_score, bool h
     return count;
 }
 
+void _bpe_merge_table::clear(void)
+{
+    slots.clear();
+    count = 0;
+    shift = 64;
+}
+
+void _bpe_merge_table::reserve(size_t n)
+{
+    // load factor <= 1/2
+    size_t size = 16;
+    int bits = 4;
+    while (size < n * 2)
+    {
+        size <<= 1;
+        bits++;
+    }
+    if (size <= slots.size()) return;
+
+    std::vector<entry> old;
+    old.swap(slots);
+    slots.assign(size, entry{EMPTY, -1, -1});
+    shift = 64 - bits;
+
+    for (auto &e : old)
+    {
+        if (e.key == EMPTY) continue;
+        size_t i = slot_of(e.key);
+        while (slots[i].key != EMPTY)
+            i = (i + 1) & (slots.size() - 1);
+        slots[i] = e;
+    }
+}
+
+void _bpe_merge_table::insert(int32_t left, int32_t right, int32_t rank, int32_t merged)
+{
+    reserve(count + 1);
+
+    const uint64_t key = make_key(left, right);
+    size_t i = slot_of(key);
+    for (; slots[i].key != EMPTY; i = (i + 1) & (slots.size() - 1))
+    {
+        if (slots[i].key == key) return;
+    }
+
+    slots[i] = entry{key, rank, merged};
+    count++;
+}
+
 static int load_vocab_merges(_vocab &vocab, Reader &reader)
 {
     int count = 0;
 
+    vocab.bpe_merges.clear();
+
     while (true)
     {
         int len = reader.read_i32();
@@ -392,18 +434,17 @@ static int load_vocab_merges(_vocab &vocab, Reader &reader)
 
         std::string word = reader.read_string(len);
 
-        std::string first;
-        std::string second;
-
         const size_t pos = word.find(' ', 1);
 
-        if (pos != std::string::npos) {
-            first  = word.substr(0, pos);
-            second = word.substr(pos + 1);
+        // merges of tokens not in vocab can never be applied
+        if (pos != std::string::npos)
+        {
+            const int left  = vocab.find_token(word.substr(0, pos));
+            const int right = vocab.find_token(word.substr(pos + 1));
+            if ((left >= 0) && (right >= 0))
+                vocab.bpe_merges.insert(left, right, count, vocab.find_token(word.substr(0, pos) + word.substr(pos + 1)));
         }
 
-        vocab.bpe_ranks.emplace(std::make_pair(first, second), count);
-
         count++;
     }
 
@@ -487,6 +528,7 @@ struct llm_symbol {
     index next;
     const char * text;
     size_t n;
+    _vocab::id id;      // -1 if the piece is not in vocab
 };
 
 struct llm_bigram_bpe {
@@ -496,25 +538,21 @@ struct llm_bigram_bpe {
         }
     };
 
-    using queue_storage = std::vector<llm_bigram_bpe>;
-    using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    _vocab::id left_id;
+    _vocab::id right_id;
+    _vocab::id merged;
     int rank;
-    size_t size;
 };
 
+// symbols are kept as (id, text span), merges are looked up by id pairs.
+// buffers are reused across calls, so instances are taken from a pool (see `pooled_bpe_tokenizer`).
 struct llm_bpe_tokenizer {
-    llm_bpe_tokenizer(const _vocab & vocab): vocab(vocab) {}
-
-    void tokenize(std::vector<_vocab::id> & output, const std::vector<std::string> &word_collection) {
-        int final_prev_index = -1;
-
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
+    void tokenize(const _vocab & vocab, std::vector<_vocab::id> & output, const std::string *first, const std::string *last) {
+        for (; first != last; first++) {
+            auto & word = *first;
+            work_queue.clear();
             symbols.clear();
 
             int index = 0;
@@ -525,6 +563,8 @@ struct llm_bpe_tokenizer {
                 size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
                 sym.text = word.c_str() + offset;
                 sym.n = char_len;
+                piece.assign(sym.text, sym.n);
+                sym.id = vocab.find_token(piece);
                 offset += sym.n;
                 sym.prev = index - 1;
                 sym.next = offset == word.size() ? -1 : index + 1;
@@ -532,28 +572,29 @@ struct llm_bpe_tokenizer {
                 symbols.emplace_back(sym);
             }
             for (int i = 1; i < (int)symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+                add_new_bigram(vocab, i - 1, i);
             }
 
             // build token(s)
             while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+                std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+                auto bigram = work_queue.back();
+                work_queue.pop_back();
 
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
 
+                // skip this bigram if it's outdated
                 if (left_symbol.n == 0 || right_symbol.n == 0) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
+                if ((left_symbol.next != bigram.right) || (left_symbol.id != bigram.left_id) || (right_symbol.id != bigram.right_id)) {
+                    continue;
                 }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
+                left_symbol.id = bigram.merged;
                 right_symbol.n = 0;
 
                 // remove the right sym from the chain
@@ -562,88 +603,88 @@ struct llm_bpe_tokenizer {
                     symbols[right_symbol.next].prev = bigram.left;
                 }
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
-            }
-
-            // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = (llm_symbol::index)symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = (int)symbols_final.size() - 1;
-                }
+                add_new_bigram(vocab, left_symbol.prev, bigram.left);  // left side of current symbol
+                add_new_bigram(vocab, bigram.left, left_symbol.next);  // right side of current symbol
             }
-        }
-
-        symbols = symbols_final;
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
+            for (int i = symbols.empty() ? -1 : 0; i != -1; i = symbols[i].next) {
                 auto & symbol = symbols[i];
-                if (symbol.n == 0) {
+
+                if (symbol.id >= 0) {
+                    output.push_back(symbol.id);
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
-                            throw std::runtime_error("ERROR: byte not found in vocab");
-                        }
-                        output.push_back((*token_multibyte).second);
+                for (size_t j = 0; j < symbol.n; j++) {
+                    piece.assign(1, symbol.text[j]);
+                    auto id = vocab.find_token(piece);
+                    if (id < 0) {
+                        throw std::runtime_error("ERROR: byte not found in vocab");
                     }
-                } else {
-                    output.push_back((*token).second);
+                    output.push_back(id);
                 }
             }
         }
     }
 
 private:
-    void add_new_bigram(int left, int right) {
+    void add_new_bigram(const _vocab & vocab, int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        const auto l = symbols[left].id;
+        const auto r = symbols[right].id;
+        if (l < 0 || r < 0) {
+            return;
+        }
 
-        if (rank_found < 0) {
+        auto merge = vocab.bpe_merges.find(l, r);
+        if (nullptr == merge) {
             return;
         }
 
-        llm_bigram_bpe bigram;
+        work_queue.push_back(llm_bigram_bpe{left, right, l, r, merge->merged, merge->rank});
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+    }
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+    std::vector<llm_symbol> symbols;
+    std::vector<llm_bigram_bpe> work_queue;
+    std::string piece;
+};
 
-        work_queue.push(bigram);
+// threads of `utils::parallel_for` are short-lived, so buffers are pooled instead of being thread_local.
+struct pooled_bpe_tokenizer {
+    pooled_bpe_tokenizer() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pool.size() > 0) {
+            tokenizer = std::move(pool.back());
+            pool.pop_back();
+        } else {
+            tokenizer.reset(new llm_bpe_tokenizer());
+        }
     }
 
-    const _vocab & vocab;
+    ~pooled_bpe_tokenizer() {
+        std::lock_guard<std::mutex> lock(mutex);
+        pool.push_back(std::move(tokenizer));
+    }
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    llm_bpe_tokenizer *operator->() { return tokenizer.get(); }
+
+private:
+    std::unique_ptr<llm_bpe_tokenizer> tokenizer;
 
-    llm_bigram_bpe::queue work_queue;
+    static std::mutex mutex;
+    static std::vector<std::unique_ptr<llm_bpe_tokenizer>> pool;
 };
 
+std::mutex pooled_bpe_tokenizer::mutex;
+std::vector<std::unique_ptr<llm_bpe_tokenizer>> pooled_bpe_tokenizer::pool;
+
+#define BPE_PARALLEL_MIN_WORDS      8192
+#define BPE_PARALLEL_CHUNK_WORDS    2048
+
 int BPEProcessor2::DoEncode2(const std::string &input,
         std::vector<int> *ids) const
 {
@@ -651,8 +692,33 @@ int BPEProcessor2::DoEncode2(const std::string &input,
 
     std::vector<std::string> bpe_encoded_words = unicode_regex_split(input, regex_exprs);
 
-    llm_bpe_tokenizer tokenizer(vocab_);
-    tokenizer.tokenize(*ids, bpe_encoded_words);
+    const std::string *words = bpe_encoded_words.data();
+    const int64_t n_words = (int64_t)bpe_encoded_words.size();
+
+    // on a worker of `utils::parallel_for` (such as `encode_batch`), threads are already busy
+    if ((n_words < BPE_PARALLEL_MIN_WORDS) || utils::is_parallel_worker())
+    {
+        pooled_bpe_tokenizer tokenizer;
+        tokenizer->tokenize(vocab_, *ids, words, words + n_words);
+        return 0;
+    }
+
+    // pre-tokens are independent, so chunks are merged in parallel and concatenated in order
+    const int64_t n_chunks = (n_words + BPE_PARALLEL_CHUNK_WORDS - 1) / BPE_PARALLEL_CHUNK_WORDS;
+    std::vector<std::vector<int>> chunk_ids(n_chunks);
+    utils::parallel_for(0, n_chunks, [&](int64_t i) {
+        pooled_bpe_tokenizer tokenizer;
+        const int64_t first = i * BPE_PARALLEL_CHUNK_WORDS;
+        const int64_t last  = std::min(first + BPE_PARALLEL_CHUNK_WORDS, n_words);
+        tokenizer->tokenize(vocab_, chunk_ids[i], words + first, words + last);
+    });
+
+    size_t total = ids->size();
+    for (auto &c : chunk_ids)
+        total += c.size();
+    ids->reserve(total);
+    for (auto &c : chunk_ids)
+        ids->insert(ids->end(), c.begin(), c.end());
 
     return 0;
 }
@@ -697,131 +763,163 @@ const std::string BPEProcessor3::IdToPiece(int id) const
     }
 }
 
-NearestKeywordSearcher::Node *NearestKeywordSearcher::make_tree(std::vector<Item> &items, char ch, int value)
+NearestKeywordSearcher::NearestKeywordSearcher()
 {
-    Node * r = new Node();
-    r->ch = ch;
-    r->value = items.size() < 1 ? value : -1;
+    nodes.push_back(Node{{}, 0, -1, -1});
+    build();
+}
 
-    while (true)
-    {
-        bool flag = false;
-        char tag = 0;
-        int  v   = -1;
+void NearestKeywordSearcher::add(const std::string &keyword, int kw_id)
+{
+    if (keyword.size() < 1) return;
 
-        std::vector<Item> sub;
-        for (int i = (int)items.size() - 1; i >= 0; i--)
+    int node = 0;
+    for (const unsigned char ch : keyword)
+    {
+        int next = child_of(node, ch);
+        if (next < 0)
         {
-            if (items[i].s.size() < 1) continue;
+            next = (int)nodes.size();
+            auto &child = nodes[node].child;
+            auto it = std::lower_bound(child.begin(), child.end(), ch, [](auto &p, unsigned char c) { return p.first < c; });
+            child.insert(it, std::make_pair(ch, next));
+            nodes.push_back(Node{{}, 0, -1, -1});
+        }
+        node = next;
+    }
 
-            if (!flag)
-            {
-                flag = true;
-                tag = items[i].s[0];
-                v   = items[i].value;
-            }
-            else
-            {
-                if (items[i].s[0] != tag) continue;
-            }
+    // the first one wins for duplicated keywords
+    if (nodes[node].keyword >= 0) return;
+
+    nodes[node].keyword = (int)keywords.size();
+    keywords.push_back(Keyword{kw_id, (int)keyword.size()});
+}
 
-            if (items[i].s.size() > 1)
-                sub.emplace_back(items[i].s.substr(1), (int)items[i].value);
+void NearestKeywordSearcher::build(void)
+{
+    max_len = 0;
+    for (auto &k : keywords)
+        max_len = std::max(max_len, k.len);
+
+    for (int i = 0; i < 256; i++)
+        root_next[i] = 0;
+    for (auto &c : nodes[0].child)
+        root_next[c.first] = c.second;
+
+    // BFS, so that fail links always point to nodes already done
+    std::vector<int> queue;
+    for (auto &c : nodes[0].child)
+    {
+        nodes[c.second].fail = 0;
+        nodes[c.second].dict = -1;
+        queue.push_back(c.second);
+    }
 
-            // mark as visited
-            items[i].s = "";
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        const int u = queue[i];
+        for (auto &c : nodes[u].child)
+        {
+            const int v = c.second;
+            const int f = step(nodes[u].fail, c.first);
+            nodes[v].fail = f;
+            nodes[v].dict = nodes[f].keyword >= 0 ? f : nodes[f].dict;
+            queue.push_back(v);
         }
+    }
+}
 
-        if (!flag) break;
+void NearestKeywordSearcher::rebuild(const std::unordered_map<_vocab::id, std::string> &keywords)
+{
+    nodes.clear();
+    nodes.push_back(Node{{}, 0, -1, -1});
+    this->keywords.clear();
 
-        Node *child = make_tree(sub, tag, v);
-        r->child.emplace_back(std::unique_ptr<Node>(child));
-    }
+    std::vector<std::pair<std::string, int>> sorted;
+    for (auto & st: keywords)
+        sorted.emplace_back(st.second, (int)st.first);
 
-    std::sort(r->child.begin(), r->child.end(), [](auto &p1, auto &p2) { return p1->ch <= p2->ch; });
+    std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) {
+        return a.first.size() != b.first.size() ? a.first.size() > b.first.size() : a.second < b.second;
+    });
 
-    return r;
+    for (auto &k : sorted)
+        add(k.first, k.second);
+    build();
 }
 
-void NearestKeywordSearcher::rebuild(const std::unordered_map<_vocab::id, std::string> keywords)
+int NearestKeywordSearcher::child_of(int node, unsigned char ch) const
 {
-    root.reset(nullptr);
-
-    std::vector<Item> sub;
+    auto &child = nodes[node].child;
+    auto it = std::lower_bound(child.begin(), child.end(), ch, [](auto &p, unsigned char c) { return p.first < c; });
+    return (it != child.end()) && (it->first == ch) ? it->second : -1;
+}
 
-    for (auto & st: keywords)
+int NearestKeywordSearcher::step(int node, unsigned char ch) const
+{
+    while (node > 0)
     {
-        sub.emplace_back(st.second, (int)st.first);
+        const int next = child_of(node, ch);
+        if (next >= 0) return next;
+        node = nodes[node].fail;
     }
-    root.reset(make_tree(sub, 0, -1));
+    return root_next[ch];
 }
 
-int NearestKeywordSearcher::match(const std::string &input, int index, Node *node, int &level) const
+bool NearestKeywordSearcher::search(std::string_view input, size_t offset, size_t &pos, size_t &len, int &kw_id) const
 {
-    if (node->child.size() < 1) return node->value;
-    if (index >= (int)input.size()) return -1;
-    const char ch = input[index];
+    size_t best_pos = std::string_view::npos;
+    int best = -1;
 
-    int low  = 0;
-    int high = (int)node->child.size() - 1;
-    while (high >= low)
+    int node = 0;
+    for (size_t i = offset; i < input.size(); i++)
     {
-        // assuming no overflow
-        int middle = (high + low) / 2;
-        Node *n = node->child[middle].get();
-        if (n->ch < ch)
-        {
-            low = middle + 1;
-        }
-        else if (ch < n->ch)
-        {
-            high = middle - 1;
-        }
-        else
-        {
-            level++;
-            return match(input, index + 1, n, level);
-        }
-    }
+        // no match found later could start earlier than `best_pos`
+        if ((best >= 0) && (i >= best_pos + max_len)) break;
 
-    return -1;
-}
+        node = step(node, (unsigned char)input[i]);
 
-std::string NearestKeywordSearcher::search(std::string &input, int &kw_id) const
-{
-    int index = 0;
-    while (index < (int)input.size())
-    {
-        int len = 0;
-        kw_id = match(input, index, root.get(), len);
-        if (kw_id >= 0)
+        for (int n = nodes[node].keyword >= 0 ? node : nodes[node].dict; n >= 0; n = nodes[n].dict)
         {
-            std::string r = input.substr(0, index);
-            input = input.substr(index + len);
-            return r;
+            const int k = nodes[n].keyword;
+            const size_t start = i + 1 - keywords[k].len;
+            if ((start < best_pos) || ((start == best_pos) && (k < best)))
+            {
+                best_pos = start;
+                best = k;
+            }
         }
-        index++;
     }
 
-    std::string r(input);
-    input = "";
-    return r;
+    if (best < 0) return false;
+
+    pos   = best_pos;
+    len   = keywords[best].len;
+    kw_id = keywords[best].id;
+    return true;
 }
 
 int BPEProcessor2::DoEncode(const std::string &input,
         std::vector<int> *ids) const
 {
-    std::string text(input);
+    std::string part;
+    size_t offset = 0;
+    size_t pos = 0;
+    size_t len = 0;
     int sp_tok_id = -1;
-    while (text.size() > 0)
+    while (searcher.search(input, offset, pos, len, sp_tok_id))
     {
-        auto leading = searcher.search(text, sp_tok_id);
-        DoEncode2(leading, ids);
-        if (sp_tok_id < 0) break;
+        part.assign(input, offset, pos - offset);
+        DoEncode2(part, ids);
         ids->push_back(sp_tok_id);
+        offset = pos + len;
     }
 
-    return 0;
+    if (offset == 0)
+        return DoEncode2(input, ids);
+
+    part.assign(input, offset);
+    return DoEncode2(part, ids);
 }
 
 static std::string _decode_text(const std::string & text) {
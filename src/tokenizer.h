@@ -5,6 +5,8 @@
 #include <unordered_map>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <cstdint>
 
 namespace tokenizer
 {
@@ -20,6 +22,50 @@ enum token_type
     BYTE         = 6,
 };
 
+// BPE merges keyed on (left id, right id), in a flat open addressing hash table
+struct _bpe_merge_table
+{
+    struct entry
+    {
+        uint64_t key;
+        int32_t  rank;
+        int32_t  merged;    // id of the merged token, -1 if not in vocab
+    };
+
+    static constexpr uint64_t EMPTY = ~(uint64_t)0;
+
+    std::vector<entry> slots;
+    size_t count = 0;
+    int shift = 64;
+
+    static uint64_t make_key(int32_t left, int32_t right)
+    {
+        return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+    }
+
+    size_t slot_of(uint64_t key) const
+    {
+        return (size_t)((key * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+
+    void clear(void);
+    void reserve(size_t n);
+
+    // the first one is kept for duplicated pairs
+    void insert(int32_t left, int32_t right, int32_t rank, int32_t merged);
+
+    const entry *find(int32_t left, int32_t right) const
+    {
+        if (count < 1) return nullptr;
+        const uint64_t key = make_key(left, right);
+        for (size_t i = slot_of(key); ; i = (i + 1) & (slots.size() - 1))
+        {
+            if (slots[i].key == key) return &slots[i];
+            if (slots[i].key == EMPTY) return nullptr;
+        }
+    }
+};
+
 struct _vocab
 {
     using id    = int32_t;
@@ -35,18 +81,14 @@ struct _vocab
     std::vector<token_score> id_to_token;
 
     std::unordered_map<id, token> special_tokens_cache;
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    _bpe_merge_table bpe_merges;
     int byte_fallback_tok_ids[256];
     bool byte_fallback_ready;
 
-    int find_bpe_rank(std::string token_left, std::string token_right) const
+    id find_token(const std::string &s) const
     {
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
-            return -1;
-        }
-
-        return it->second;
+        auto it = token_to_id.find(s);
+        return it != token_to_id.end() ? it->second : -1;
     }
 
     bool is_token_of_type(id id, token_type t) const
@@ -112,6 +154,21 @@ public:
 
     virtual size_t read_buffer(void *output, size_t len) = 0;
 
+    // address of data at `offset` if the whole file is mapped into memory, otherwise nullptr
+    virtual const void *get_mapped(int64_t offset) { return nullptr; }
+
+    // positional read, safe to be called from several threads.
+    // the default one is serialized; implementations are encouraged to override it.
+    virtual size_t read_at(int64_t offset, void *output, size_t len)
+    {
+        std::lock_guard<std::mutex> lock(read_at_mutex);
+        seek(offset, SEEK_SET);
+        return read_buffer(output, len);
+    }
+
+    // hint: data will be read soon
+    virtual void will_need(int64_t offset, size_t len) {}
+
     template <typename T> T read_basic()
     {
         T obj;
@@ -120,6 +177,51 @@ public:
     }
 protected:
     int64_t _size;
+    std::mutex read_at_mutex;
+};
+
+// Aho-Corasick automaton for finding keywords (special/added tokens) in a single pass
+class NearestKeywordSearcher
+{
+public:
+    NearestKeywordSearcher();
+
+    // keywords are prioritized by the order of addition. call `build` after adding.
+    void add(const std::string &keyword, int kw_id);
+
+    void build(void);
+
+    // all keywords, longest first
+    void rebuild(const std::unordered_map<_vocab::id, std::string> &keywords);
+
+    bool empty(void) const { return keywords.size() < 1; }
+
+    // find the leftmost keyword in `input[offset:]`.
+    // when several ones start at the same position, the one with highest priority wins.
+    bool search(std::string_view input, size_t offset, size_t &pos, size_t &len, int &kw_id) const;
+
+protected:
+    struct Keyword
+    {
+        int id;
+        int len;
+    };
+
+    struct Node
+    {
+        std::vector<std::pair<unsigned char, int>> child;   // sorted by char
+        int fail;
+        int keyword;    // index into `keywords`, or -1
+        int dict;       // nearest node on the fail chain having a keyword, or -1
+    };
+
+    int child_of(int node, unsigned char ch) const;
+    int step(int node, unsigned char ch) const;
+
+    std::vector<Node> nodes;
+    std::vector<Keyword> keywords;
+    int root_next[256];
+    int max_len;
 };
 
 class Processor
@@ -179,6 +281,7 @@ protected:
     std::vector<std::unique_ptr<TextPreprocessor>> pp;
     std::map<int, std::string> token_override;
     std::vector<TokenId> added_tokens;
+    NearestKeywordSearcher added_token_searcher;
 };
 
 class BPEProcessor1: public Processor
@@ -193,36 +296,6 @@ protected:
             std::vector<int> *ids) const override;
 };
 
-class NearestKeywordSearcher
-{
-public:
-    void rebuild(const std::unordered_map<_vocab::id, std::string> keywords);
-
-    std::string search(std::string &input, int &kw_id) const;
-
-protected:
-
-    struct Item
-    {
-        std::string s;
-        int value;
-
-        Item(const std::string &s, const int value) : s(s), value(value) {}
-    };
-    struct Node
-    {
-        char ch;
-        int value;
-        std::vector<std::unique_ptr<Node>> child;
-    };
-
-    Node *make_tree(std::vector<Item> &items, char ch, int value);
-
-    int match(const std::string &input, int index, Node *node, int &level) const;
-
-    std::unique_ptr<Node> root;
-};
-
 class BPEProcessor2: public Processor
 {
 public:
@@ -153,31 +153,37 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+// byte-level BPE: each byte of the utf8 encoding of a word is mapped to a printable codepoint
+static std::vector<std::string> unicode_byte_encoding_process(const std::vector<uint32_t> & cpts, const std::vector<size_t> & bpe_offsets) {
+    static const auto byte_to_utf8 = [] {
+        std::vector<std::string> table(256);
+        for (int i = 0; i < 256; i++) {
+            table[i] = unicode_byte_to_utf8((uint8_t)i);
         }
+        return table;
+    } ();
+
+    std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(bpe_offsets.size());
 
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+    size_t start = 0;
+    for (const size_t offset : bpe_offsets) {
+        auto & encoded_token = bpe_encoded_words.emplace_back();
+        for (size_t i = start; i < start + offset; ++i) {
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                encoded_token += byte_to_utf8[(uint8_t)c];
+            }
         }
-        bpe_encoded_words.emplace_back(encoded_token);
+        start += offset;
     }
     return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -291,12 +297,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// QWEN2 is the same except \p{N}, i.e. `max_digits` = 1
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t max_digits) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -369,7 +374,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -432,6 +437,232 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
+// \p{Lt}, which is not covered by the case tables
+static bool unicode_cpt_is_titlecase(const uint32_t cpt) {
+    switch (cpt) {
+    case 0x01C5: case 0x01C8: case 0x01CB: case 0x01F2:
+    case 0x1FBC: case 0x1FCC: case 0x1FFC:
+        return true;
+    default:
+        return ((0x1F88 <= cpt) && (cpt <= 0x1F8F)) || ((0x1F98 <= cpt) && (cpt <= 0x1F9F)) || ((0x1FA8 <= cpt) && (cpt <= 0x1FAF));
+    }
+}
+
+// GPT4O system regex:
+//   [^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]*[\p{Ll}\p{Lm}\p{Lo}\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|
+//   [^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]+[\p{Ll}\p{Lm}\p{Lo}\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|
+//   \p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n/]*|\s*[\r\n]+|\s+(?!\S)|\s+
+// `contractions`: whether the optional contraction suffixes are present; `max_digits`: 1 for \p{N}, 3 for \p{N}{1,3}.
+// Lu vs. Ll are told apart by the lower/upper case tables, letters in neither table (Lm, Lo) belong to both classes.
+static std::vector<size_t> unicode_regex_split_custom_gpt4o(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const bool contractions, const size_t max_digits) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        static const uint32_t OUT_OF_RANGE = 0xFFFFFFFF;
+        auto _get_cpt = [&] (const size_t pos) -> uint32_t {
+            return (offset_ini <= pos && pos < offset_end) ? cpts[pos] : OUT_OF_RANGE;
+        };
+
+        auto _get_flags = [&] (const size_t pos) -> codepoint_flags {
+            static const codepoint_flags undef(codepoint_flags::UNDEFINED);
+            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags(cpts[pos]) : undef;
+        };
+
+        // [\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]
+        auto _is_upper = [&] (const size_t pos) -> bool {
+            const auto flags = _get_flags(pos);
+            return (flags.is_letter && !flags.is_lowercase) || flags.is_accent_mark;
+        };
+
+        // [\p{Ll}\p{Lm}\p{Lo}\p{M}]
+        auto _is_lower = [&] (const size_t pos) -> bool {
+            const auto flags = _get_flags(pos);
+            return (flags.is_letter && !flags.is_uppercase && !unicode_cpt_is_titlecase(cpts[pos])) || flags.is_accent_mark;
+        };
+
+        // (?i:'s|'t|'re|'ve|'m|'ll|'d)?
+        auto _contraction = [&] (const size_t pos) -> size_t {
+            if (!contractions || _get_cpt(pos) != '\'') return pos;
+            const uint32_t cpt_next = unicode_tolower(_get_cpt(pos+1));
+            if (cpt_next == 's' || cpt_next == 't' || cpt_next == 'm' || cpt_next == 'd') {
+                return pos + 2;
+            }
+            const uint32_t cpt_next_next = unicode_tolower(_get_cpt(pos+2));
+            if ((cpt_next == 'r' && cpt_next_next == 'e') ||
+                (cpt_next == 'v' && cpt_next_next == 'e') ||
+                (cpt_next == 'l' && cpt_next_next == 'l')) {
+                return pos + 3;
+            }
+            return pos;
+        };
+
+        // [U]*[L]+, with backtracking of the greedy [U]*. returns `from` if not matched.
+        auto _match_upper_star_lower_plus = [&] (const size_t from) -> size_t {
+            size_t end = from;
+            while (_is_upper(end)) end++;
+            if (_is_lower(end)) {
+                while (_is_lower(end)) end++;
+                return end;
+            }
+            for (size_t k = end; k > from; k--) {
+                if (_is_lower(k - 1)) return k;
+            }
+            return from;
+        };
+
+        // [U]+[L]*. returns `from` if not matched.
+        auto _match_upper_plus_lower_star = [&] (const size_t from) -> size_t {
+            size_t end = from;
+            while (_is_upper(end)) end++;
+            if (end == from) return from;
+            while (_is_lower(end)) end++;
+            return end;
+        };
+
+        size_t _prev_end = offset_ini;
+        auto _add_token = [&] (const size_t end) -> size_t {
+            assert(_prev_end <= end && end <= offset_end);
+            size_t len = end - _prev_end;
+            if (len > 0) {
+                bpe_offsets.push_back(len);
+            }
+            _prev_end = end;
+            return len;
+        };
+
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            const uint32_t cpt = _get_cpt(pos);
+            const auto flags = _get_flags(pos);
+
+            // regex: [^\r\n\p{L}\p{N}]?(upper* lower+ | upper+ lower*)
+            {
+                const bool has_prefix = !(cpt == '\r' || cpt == '\n' || flags.is_letter || flags.is_number);
+                size_t end = pos;
+                size_t e;
+                if (has_prefix && ((e = _match_upper_star_lower_plus(pos + 1)) > pos + 1)) end = e;
+                if ((end == pos) && ((e = _match_upper_star_lower_plus(pos)) > pos)) end = e;
+                if ((end == pos) && has_prefix && ((e = _match_upper_plus_lower_star(pos + 1)) > pos + 1)) end = e;
+                if ((end == pos) && ((e = _match_upper_plus_lower_star(pos)) > pos)) end = e;
+                if (end > pos) {
+                    pos = _contraction(end);
+                    _add_token(pos);
+                    continue;
+                }
+            }
+
+            // regex: \p{N}{1,3}
+            if (flags.is_number) {
+                size_t ini = pos;
+                while (_get_flags(pos).is_number) {
+                    if (++pos - ini >= max_digits) {
+                        _add_token(pos);
+                        ini = pos;
+                    }
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: <space>?[^\s\p{L}\p{N}]+[\r\n/]*
+            auto flags2 = (cpt == ' ' ? _get_flags(pos+1) : flags);
+            if (!(flags2.is_whitespace || flags2.is_letter || flags2.is_number || flags2.is_undefined)) {
+                pos += (cpt == ' ');
+                while (!(flags2.is_whitespace || flags2.is_letter || flags2.is_number || flags2.is_undefined)) {
+                    flags2 = _get_flags(++pos);
+                }
+                uint32_t cpt2 = _get_cpt(pos);
+                while (cpt2 == '\r' || cpt2 == '\n' || cpt2 == '/') {
+                    cpt2 = _get_cpt(++pos);
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            size_t num_whitespaces = 0;
+            size_t last_end_r_or_n = 0;
+            while (_get_flags(pos+num_whitespaces).is_whitespace) {
+                uint32_t cpt2 = _get_cpt(pos+num_whitespaces);
+                if (cpt2 == '\r' || cpt2 == '\n') {
+                    last_end_r_or_n = pos + num_whitespaces + 1;
+                }
+                num_whitespaces++;
+            }
+
+            // regex: \s*[\r\n]+
+            if (last_end_r_or_n > 0) {
+                pos = last_end_r_or_n;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+(?!\S)
+            if (num_whitespaces > 1 && _get_cpt(pos+num_whitespaces) != OUT_OF_RANGE) {
+                pos += num_whitespaces - 1;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+
+            if (num_whitespaces > 0) {
+                pos += num_whitespaces;
+                _add_token(pos);
+                continue;
+            }
+
+            // no matches
+            _add_token(++pos);
+        }
+    }
+
+    return bpe_offsets;
+}
+
+// regex: \p{N}+ (`max_digits` = 0), \p{N}{1,3} or \p{N}
+static std::vector<size_t> unicode_regex_split_custom_numbers(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t max_digits) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+
+        size_t prev_end = start;
+        size_t pos = start;
+        while (pos < offset_end) {
+            if (!unicode_cpt_flags(cpts[pos]).is_number) {
+                pos++;
+                continue;
+            }
+
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+
+            size_t ini = pos;
+            while ((pos < offset_end) && unicode_cpt_flags(cpts[pos]).is_number && ((max_digits == 0) || (pos - ini < max_digits))) {
+                pos++;
+            }
+            bpe_offsets.push_back(pos - ini);
+            prev_end = pos;
+        }
+
+        if (offset_end > prev_end) {
+            bpe_offsets.push_back(offset_end - prev_end);
+        }
+        start = offset_end;
+    }
+
+    return bpe_offsets;
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -492,16 +723,44 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+    static const std::string contractions_i   = "(?i:'s|'t|'re|'ve|'m|'ll|'d)";
+    static const std::string contractions_cls = "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])";
+    static const std::string llama3_tail      = "|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+    static const std::string qwen2_tail       = "|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+    static const std::string gpt4o_upper      = "[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]";
+    static const std::string gpt4o_lower      = "[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]";
+    static const std::string gpt4o_prefix     = "[^\\r\\n\\p{L}\\p{N}]?";
+    static const std::string gpt4o_tail       = "| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+
+    auto gpt4o = [](const std::string & contractions, const std::string & digits) {
+        return gpt4o_prefix + gpt4o_upper + "*" + gpt4o_lower + "+" + contractions + "|" +
+               gpt4o_prefix + gpt4o_upper + "+" + gpt4o_lower + "*" + contractions + "|" +
+               digits + gpt4o_tail;
+    };
+
+    static const std::string gpt4o_c3 = gpt4o(contractions_cls + "?", "\\p{N}{1,3}");
+    static const std::string gpt4o_i3 = gpt4o(contractions_i   + "?", "\\p{N}{1,3}");
+    static const std::string gpt4o_1  = gpt4o("", "\\p{N}");
+
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    } else if (
-            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
-            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
-
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
+    } else if ((regex_expr == contractions_i + llama3_tail) || (regex_expr == contractions_cls + llama3_tail)) {
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 3);
+    } else if ((regex_expr == contractions_i + qwen2_tail) || (regex_expr == contractions_cls + qwen2_tail)) {
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else if ((regex_expr == gpt4o_c3) || (regex_expr == gpt4o_i3)) {
+        bpe_offsets = unicode_regex_split_custom_gpt4o(cpts, offsets, true, 3);
+    } else if (regex_expr == gpt4o_1) {
+        bpe_offsets = unicode_regex_split_custom_gpt4o(cpts, offsets, false, 1);
+    } else if (regex_expr == "\\p{N}+") {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, 0);
+    } else if (regex_expr == "\\p{N}{1,3}") {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, 3);
+    } else if ((regex_expr == "\\p{N}") || (regex_expr == "\\p{N}{1}")) {
+        bpe_offsets = unicode_regex_split_custom_numbers(cpts, offsets, 1);
     }
 
     return bpe_offsets;
@@ -593,7 +852,7 @@ uint32_t unicode_tolower(uint32_t cp) {
     return it == unicode_map_lowercase.end() ? cp : it->second;
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", codepoint_flags::NUMBER },
@@ -661,7 +920,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = use_custom ? unicode_regex_split_custom(cpts, regex_expr, bpe_offsets) : std::vector<size_t>();
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
@@ -755,17 +1014,5 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
-
-    size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
-        start += offset;
-    }
-
-    return unicode_byte_encoding_process(bpe_words);
+    return unicode_byte_encoding_process(cpts, bpe_offsets);
 }
@@ -13,8 +13,31 @@
 #include <regex>
 #include <random>
 #include <chrono>
+#include <bit>
+#include <mutex>
 
 #include "basics.h"
+#include "chat.h"
+
+#ifdef GGML_USE_CPU
+#include "ggml-cpu.h"
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#if defined(_MSC_VER)
+#define ftello64    _ftelli64
+#define fseeko64    _fseeki64
+#elif defined(__APPLE__)
+#define ftello64    ftello
+#define fseeko64    fseeko
+#endif
 
 static const char VS_FILE_HEADER[] = "CHATLLMVS";
 
@@ -25,55 +48,375 @@ struct file_header
     size_t size;
 };
 
-static float vector_euclidean_distance(const float *a, const float *b, int len)
+// embeddings stored in `EmbeddingType`, and optionally followed by F32 embeddings for re-scoring
+static const char VS_Q_FILE_HEADER[] = "CHATLLMVQ";
+
+struct file_header_q
 {
-    float sum = 0.0;
-    for (int i = 0; i < len; i++)
+    char magic[9];
+    size_t emb_len;
+    size_t size;
+    uint32_t emb_type;
+    uint32_t flags;
+};
+
+#define VS_FLAG_WITH_F32        1
+
+// v2: blocks are aligned, so that the file can be mapped and text is fetched on demand
+static const char VS_V2_FILE_HEADER[] = "CHATLLMV2";
+
+struct file_header_v2
+{
+    char magic[9];
+    size_t emb_len;
+    size_t size;
+    uint32_t emb_type;
+    uint32_t flags;
+    uint64_t rows_offset;           // size * row_size
+    uint64_t norms_offset;          // size * float, inverse norms of rows
+    uint64_t exact_offset;          // size * emb_len * float, if VS_FLAG_WITH_F32
+    uint64_t text_offset;
+    uint64_t text_offsets_offset;   // (2 * size + 1) * uint64_t, relative to `text_offset`
+};
+
+#define VS_V2_ALIGNMENT         64
+
+// IVF index is saved next to the DB file, as `<db>.ivf`
+static const char VS_INDEX_FILE_HEADER[] = "CHATLLMIVF";
+
+struct index_file_header
+{
+    char magic[10];
+    size_t emb_len;
+    size_t size;
+    size_t n_lists;
+};
+
+// number of candidates re-scored with F32 embeddings, w.r.t. `top_n`
+#define RESCORE_FACTOR  4
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0)
     {
-        float t = a[i] - b[i];
-        sum += t * t;
+        if (mant == 0)
+            bits = sign;
+        else
+        {
+            uint32_t e = 127 - 15 + 1;
+            while ((mant & 0x400) == 0)
+            {
+                mant <<= 1;
+                e--;
+            }
+            bits = sign | (e << 23) | ((mant & 0x3ff) << 13);
+        }
     }
-    return sqrtf(sum);
+    else if (exp == 31)
+        bits = sign | 0x7f800000 | (mant << 13);
+    else
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+
+    float r;
+    memcpy(&r, &bits, sizeof(r));
+    return r;
 }
 
-static float vector_inner_product(const float *a, const float *b, int len)
+// round to nearest even
+static uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int32_t  exp  = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if ((x & 0x7fffffff) > 0x7f800000) return (uint16_t)(sign | 0x7e00);
+    if (exp >= 31) return (uint16_t)(sign | 0x7c00);
+    if (exp <= 0)
+    {
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000;
+        const int shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        const uint32_t rem  = mant & ((1u << shift) - 1);
+        const uint32_t half = 1u << (shift - 1);
+        if ((rem > half) || ((rem == half) && (h & 1))) h++;
+        return (uint16_t)(sign | h);
+    }
+
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    if ((rem > 0x1000) || ((rem == 0x1000) && (h & 1))) h++;
+    return (uint16_t)(sign | h);
+}
+
+static const float *half_table(void)
+{
+    static std::vector<float> table;
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+        table.resize(65536);
+        for (int i = 0; i < 65536; i++)
+            table[i] = half_to_float((uint16_t)i);
+    });
+    return table.data();
+}
+
+size_t CVectorStore::RowSize(EmbeddingType type, int emb_len)
+{
+    switch (type)
+    {
+    case EmbeddingType::F32:
+        return sizeof(float) * emb_len;
+    case EmbeddingType::F16:
+        return sizeof(uint16_t) * emb_len;
+    case EmbeddingType::Int8:
+        return sizeof(float) + emb_len;
+    case EmbeddingType::Binary:
+        return sizeof(uint64_t) * ((emb_len + 63) / 64);
+    default:
+        CHATLLM_CHECK(false) << "unknown embedding type: " << (int)type;
+        return 0;
+    }
+}
+
+static void encode_row(EmbeddingType type, const float *v, int len, uint8_t *row)
+{
+    switch (type)
+    {
+    case EmbeddingType::F32:
+        memcpy(row, v, sizeof(float) * len);
+        break;
+    case EmbeddingType::F16:
+        for (int i = 0; i < len; i++)
+        {
+            uint16_t h = float_to_half(v[i]);
+            memcpy(row + i * sizeof(h), &h, sizeof(h));
+        }
+        break;
+    case EmbeddingType::Int8:
+        {
+            float amax = 0.0f;
+            for (int i = 0; i < len; i++)
+                amax = std::max(amax, fabsf(v[i]));
+            const float scale = amax / 127.0f;
+            const float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+            memcpy(row, &scale, sizeof(scale));
+            int8_t *q = (int8_t *)(row + sizeof(scale));
+            for (int i = 0; i < len; i++)
+                q[i] = (int8_t)lrintf(v[i] * inv_scale);
+        }
+        break;
+    case EmbeddingType::Binary:
+        {
+            const int n_words = (len + 63) / 64;
+            for (int w = 0; w < n_words; w++)
+            {
+                uint64_t bits = 0;
+                for (int i = w * 64; i < std::min(len, w * 64 + 64); i++)
+                    if (v[i] > 0.0f) bits |= (uint64_t)1 << (i - w * 64);
+                memcpy(row + w * sizeof(bits), &bits, sizeof(bits));
+            }
+        }
+        break;
+    default:
+        CHATLLM_CHECK(false) << "unknown embedding type: " << (int)type;
+    }
+}
+
+static void decode_row(EmbeddingType type, const uint8_t *row, int len, float *v)
+{
+    switch (type)
+    {
+    case EmbeddingType::F32:
+        memcpy(v, row, sizeof(float) * len);
+        break;
+    case EmbeddingType::F16:
+        {
+            const float *table = half_table();
+            const uint16_t *h = (const uint16_t *)row;
+            for (int i = 0; i < len; i++)
+                v[i] = table[h[i]];
+        }
+        break;
+    case EmbeddingType::Int8:
+        {
+            float scale;
+            memcpy(&scale, row, sizeof(scale));
+            const int8_t *q = (const int8_t *)(row + sizeof(scale));
+            for (int i = 0; i < len; i++)
+                v[i] = q[i] * scale;
+        }
+        break;
+    case EmbeddingType::Binary:
+        {
+            const uint64_t *bits = (const uint64_t *)row;
+            for (int i = 0; i < len; i++)
+                v[i] = (bits[i / 64] >> (i % 64)) & 1 ? 1.0f : -1.0f;
+        }
+        break;
+    default:
+        CHATLLM_CHECK(false) << "unknown embedding type: " << (int)type;
+    }
+}
+
+// inner products of F32/F16 rows use vec_dot kernels of ggml CPU backend when it is linked (not GGML_BACKEND_DL).
+// other kernels use independent accumulators for lanes, so that compilers can vectorize them (SSE/AVX/NEON).
+#define VEC_LANES   16
+
+// `decode(i)`: i-th element of `b`
+template <class Decode> static float vector_squared_distance(const float *a, int len, Decode decode)
 {
+    float acc[VEC_LANES] = {0.0f};
+    int i = 0;
+    for (; i + VEC_LANES <= len; i += VEC_LANES)
+    {
+        for (int j = 0; j < VEC_LANES; j++)
+        {
+            float t = a[i + j] - decode(i + j);
+            acc[j] += t * t;
+        }
+    }
+
     float sum = 0.0;
-    for (int i = 0; i < len; i++)
+    for (int j = 0; j < VEC_LANES; j++)
+        sum += acc[j];
+    for (; i < len; i++)
     {
-        sum += a[i] * b[i];
+        float t = a[i] - decode(i);
+        sum += t * t;
     }
     return sum;
 }
 
-static float vector_cos_similarity(const float *a, const float *b, int len)
+template <class Decode> static float vector_inner_product(const float *a, int len, Decode decode)
 {
-    float inner_sum = 0.0;
-    float norm_a = 0.0;
-    float norm_b = 0.0;
-    for (int i = 0; i < len; i++)
+    float acc[VEC_LANES] = {0.0f};
+    int i = 0;
+    for (; i + VEC_LANES <= len; i += VEC_LANES)
     {
-        inner_sum += a[i] * b[i];
-        norm_a    += a[i] * a[i];
-        norm_b    += b[i] * b[i];
+        for (int j = 0; j < VEC_LANES; j++)
+            acc[j] += a[i + j] * decode(i + j);
     }
-    norm_a = sqrtf(norm_a);
-    norm_b = sqrtf(norm_b);
 
-    return inner_sum / (norm_a * norm_b + 1e-6f);
+    float sum = 0.0;
+    for (int j = 0; j < VEC_LANES; j++)
+        sum += acc[j];
+    for (; i < len; i++)
+        sum += a[i] * decode(i);
+    return sum;
+}
+
+static float vector_squared_distance(const float *a, const float *b, int len)
+{
+    return vector_squared_distance(a, len, [b](int i) { return b[i]; });
+}
+
+static float vector_inner_product(const float *a, const float *b, int len)
+{
+    return vector_inner_product(a, len, [b](int i) { return b[i]; });
+}
+
+static float vector_inv_norm(const float *a, int len)
+{
+    return 1.0f / (sqrtf(vector_inner_product(a, a, len)) + 1e-6f);
+}
+
+static int vector_hamming_distance(const uint64_t *a, const uint64_t *b, int n_words)
+{
+    int r = 0;
+    for (int i = 0; i < n_words; i++)
+        r += std::popcount(a[i] ^ b[i]);
+    return r;
+}
+
+#ifdef GGML_USE_CPU
+static float ggml_inner_product(ggml_type type, const void *a, const void *b, int len)
+{
+    float r = 0.0f;
+    ggml_get_type_traits_cpu(type)->vec_dot(len, &r, 0, a, 0, b, 0, 1);
+    return r;
 }
+#endif
 
-static float vector_measure(DistanceStrategy ds, const float *a, const float *b, int len)
+// `query_row`: `query` encoded as `type`, only used by Binary and F16
+// `inv_norm`: only used by CosineSimilarity, where `query` is normalized
+static float vector_measure(DistanceStrategy ds, EmbeddingType type, const float *query, const uint8_t *query_row,
+                            const uint8_t *row, int len, float inv_norm)
 {
+    if (type == EmbeddingType::Binary)
+    {
+        // Hamming distance, mapped to the direction of `ds`
+        const int d = vector_hamming_distance((const uint64_t *)query_row, (const uint64_t *)row, (len + 63) / 64);
+        return ds == EuclideanDistance ? (float)d : (float)(len - 2 * d);
+    }
+
+    float scale = 1.0f;
+    float r = 0.0f;
+    const bool euclidean = ds == EuclideanDistance;
+    switch (type)
+    {
+    case EmbeddingType::F32:
+        {
+            const float *b = (const float *)row;
+#ifdef GGML_USE_CPU
+            if (!euclidean)
+            {
+                r = ggml_inner_product(GGML_TYPE_F32, query, b, len);
+                break;
+            }
+#endif
+            r = euclidean ? vector_squared_distance(query, b, len) : vector_inner_product(query, b, len);
+        }
+        break;
+    case EmbeddingType::F16:
+        {
+#ifdef GGML_USE_CPU
+            if (!euclidean)
+            {
+                r = ggml_inner_product(GGML_TYPE_F16, query_row, row, len);
+                break;
+            }
+#endif
+            const float *table = half_table();
+            const uint16_t *b = (const uint16_t *)row;
+            auto decode = [table, b](int i) { return table[b[i]]; };
+            r = euclidean ? vector_squared_distance(query, len, decode) : vector_inner_product(query, len, decode);
+        }
+        break;
+    case EmbeddingType::Int8:
+        {
+            memcpy(&scale, row, sizeof(scale));
+            const int8_t *b = (const int8_t *)(row + sizeof(scale));
+            if (euclidean)
+            {
+                const float s = scale;
+                r = vector_squared_distance(query, len, [b, s](int i) { return b[i] * s; });
+                scale = 1.0f;
+            }
+            else
+                r = vector_inner_product(query, len, [b](int i) { return (float)b[i]; });
+        }
+        break;
+    default:
+        CHATLLM_CHECK(false) << "unknown embedding type: " << (int)type;
+    }
+
     switch (ds)
     {
     case EuclideanDistance:
-        return vector_euclidean_distance(a, b, len);
+        return sqrtf(r);
     case MaxInnerProduct:
     case InnerProduct:
-        return vector_inner_product(a, b, len);
+        return r * scale;
     case CosineSimilarity:
-        return vector_cos_similarity(a, b, len);
+        return r * scale * inv_norm;
     default:
         CHATLLM_CHECK(false) << "not implemented: " << ds << std::endl;
         return 0.0;
@@ -92,32 +435,46 @@ bool is_dist_strategy_max_best(DistanceStrategy ds)
 }
 
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, int emb_len,
-    std::function<void (const std::string &, float *)> text_emb, const char *fn)
-    : vec_cmp(vec_cmp), emb_len(emb_len)
+    std::function<void (const std::vector<std::string> &, float *)> text_emb, const char *fn)
+    : vec_cmp(vec_cmp), emb_len(emb_len), emb_type(EmbeddingType::F32), row_size(RowSize(EmbeddingType::F32, emb_len))
 {
-    FromPlainData(text_emb, fn);
-    embeddings.resize(GetSize() * emb_len);
+    segments.emplace_back();
+    FromPlainData(fn);
+
+    // records are embedded in batches
+    const size_t BATCH = 256;
+    Segment &s = segments.back();
+    s.rows.resize(GetSize() * row_size);
     printf("ingesting...\n");
-    for (size_t i = 0; i < GetSize(); i++)
+    const auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < GetSize(); i += BATCH)
     {
-        text_emb(contents[i], embeddings.data() + i * emb_len);
-        printf("%8zu / %8zu\r", i, GetSize());
+        const size_t n = std::min(BATCH, GetSize() - i);
+        std::vector<std::string> texts(s.contents.begin() + i, s.contents.begin() + i + n);
+        text_emb(texts, (float *)(s.rows.data() + i * row_size));
+
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        printf("%8zu / %8zu, %8.1f records/s\r", i + n, GetSize(), (i + n) / (elapsed + 1e-9));
         fflush(stdout);
     }
     printf("\ndone\n");
+
+    PrepareNorms();
 }
 
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, const char *fn)
-    : vec_cmp(vec_cmp), emb_len(0)
+    : vec_cmp(vec_cmp), emb_len(0), emb_type(EmbeddingType::F32), row_size(0)
 {
     LoadDB(fn);
+    PrepareNorms();
 }
 
 CVectorStore::CVectorStore(DistanceStrategy vec_cmp, const std::vector<std::string> &files)
-    : vec_cmp(vec_cmp), emb_len(0)
+    : vec_cmp(vec_cmp), emb_len(0), emb_type(EmbeddingType::F32), row_size(0)
 {
     for (auto fn : files)
         LoadDB(fn.c_str());
+    PrepareNorms();
 }
 
 namespace base64
@@ -215,8 +572,9 @@ namespace base64
     }
 }
 
-void CVectorStore::FromPlainData(std::function<void (const std::string &, float *)> text_emb, const char *fn)
+void CVectorStore::FromPlainData(const char *fn)
 {
+    Segment &s = segments.back();
     std::ifstream f(fn);
     std::string lines[2];
     int counter = 0;
@@ -233,21 +591,15 @@ void CVectorStore::FromPlainData(std::function<void (const std::string &, float
                 base64::decode_to_utf8(lines[0].c_str(), c);
                 base64::decode_to_utf8(lines[1].c_str(), i);
 
-                contents.push_back(c);
-                metadata.push_back(i);
+                s.contents.push_back(c);
+                s.metadata.push_back(i);
 
                 counter = 0;
             }
         }
     }
     f.close();
-}
-
-static void write_string(FILE *f, const std::string s)
-{
-    uint32_t len = (uint32_t)s.size();
-    fwrite(&len, sizeof(len), 1, f);
-    fwrite(s.data(), 1, len, f);
+    s.count = (int64_t)s.contents.size();
 }
 
 static bool read_string(FILE *f, std::string &s)
@@ -258,43 +610,140 @@ static bool read_string(FILE *f, std::string &s)
     return fread(s.data(), 1, len, f) == len;
 }
 
+void CVectorStore::CheckEmbeddingType(const char *fn, int len, EmbeddingType type)
+{
+    if (emb_len == 0)
+    {
+        emb_len  = len;
+        emb_type = type;
+        row_size = RowSize(emb_type, emb_len);
+    }
+
+    CHATLLM_CHECK(emb_len == len) << "LoadDB: embedding length mismatch: " << fn;
+    CHATLLM_CHECK(emb_type == type) << "LoadDB: embedding type mismatch: " << fn;
+}
+
 void CVectorStore::LoadDB(const char *fn)
+{
+    const size_t old_size = GetSize();
+
+    if (!LoadMappedDB(fn))
+        LoadDBToMemory(fn);
+
+    // an index only covers records of its own DB file
+    if ((old_size > 0) || !LoadIndex(std::string(fn) + ".ivf"))
+        ClearIndex();
+}
+
+// returns false if `fn` is not a v2 file
+bool CVectorStore::LoadMappedDB(const char *fn)
+{
+    file_header_v2 header;
+    FILE *f = fopen(fn, "rb");
+    CHATLLM_CHECK(f != nullptr) << "can not open db file: " << fn;
+    const bool ok = fread(&header, sizeof(header), 1, f) == 1;
+    fclose(f);
+
+    if (!ok || memcmp(header.magic, VS_V2_FILE_HEADER, sizeof(header.magic)))
+        return false;
+
+    CheckEmbeddingType(fn, (int)header.emb_len, (EmbeddingType)header.emb_type);
+
+    Segment s;
+    s.first = (int64_t)GetSize();
+    s.count = (int64_t)header.size;
+    s.fn    = fn;
+    s.file  = std::make_shared<chatllm::MappedFile>(fn);
+
+    const uint64_t n = header.size;
+    const uint64_t file_size = (uint64_t)s.file->size();
+    auto check_block = [fn, file_size](uint64_t offset, uint64_t len)
+    {
+        CHATLLM_CHECK((offset % VS_V2_ALIGNMENT == 0) && (offset + len <= file_size)) << "LoadDB: corrupted db file: " << fn;
+    };
+
+    check_block(header.rows_offset,         n * row_size);
+    check_block(header.norms_offset,        n * sizeof(float));
+    check_block(header.text_offsets_offset, (2 * n + 1) * sizeof(uint64_t));
+
+    s.mapped_rows  = (const uint8_t *)s.file->get_mapped(header.rows_offset);
+    s.mapped_inv_norms = (const float *)s.file->get_mapped(header.norms_offset);
+    s.text_offsets = (const uint64_t *)s.file->get_mapped(header.text_offsets_offset);
+
+    check_block(header.text_offset, s.text_offsets[2 * n]);
+    s.text = (const char *)s.file->get_mapped(header.text_offset);
+
+    // `GetRecord` trusts these: all of them must be within `text_offsets[2 * n]`
+    for (uint64_t i = 0; i < 2 * n; i++)
+        CHATLLM_CHECK(s.text_offsets[i] <= s.text_offsets[i + 1]) << "LoadDB: corrupted db file: " << fn;
+
+    if (header.flags & VS_FLAG_WITH_F32)
+    {
+        check_block(header.exact_offset, n * emb_len * sizeof(float));
+        s.exact_offset = (int64_t)header.exact_offset;
+        s.exact = (const float *)s.file->get_mapped(header.exact_offset);
+    }
+
+    segments.push_back(std::move(s));
+    return true;
+}
+
+// legacy layouts
+void CVectorStore::LoadDBToMemory(const char *fn)
 {
     bool flag = false;
-    size_t old_size = contents.size();
     FILE *f = fopen(fn, "rb");
-    file_header header;
+    file_header_q header;
+    file_header header_f32;
+    Segment s;
 
     CHATLLM_CHECK(f != nullptr) << "can not open db file: " << fn;
 
-    if (fread(&header, sizeof(header), 1, f) < 1)
+    if (fread(&header_f32, sizeof(header_f32), 1, f) < 1)
         goto cleanup;
 
-    if (memcmp(header.magic, VS_FILE_HEADER, sizeof(header.magic)))
+    if (memcmp(header_f32.magic, VS_FILE_HEADER, sizeof(header_f32.magic)) == 0)
+    {
+        memcpy(header.magic, header_f32.magic, sizeof(header.magic));
+        header.emb_len  = header_f32.emb_len;
+        header.size     = header_f32.size;
+        header.emb_type = (uint32_t)EmbeddingType::F32;
+        header.flags    = 0;
+    }
+    else if (memcmp(header_f32.magic, VS_Q_FILE_HEADER, sizeof(header_f32.magic)) == 0)
+    {
+        fseeko64(f, 0, SEEK_SET);
+        if (fread(&header, sizeof(header), 1, f) < 1)
+            goto cleanup;
+    }
+    else
         goto cleanup;
 
-    if (emb_len == 0)
-        emb_len = (int)header.emb_len;
-
-    if (emb_len != (int)header.emb_len)
-        goto cleanup;
+    CheckEmbeddingType(fn, (int)header.emb_len, (EmbeddingType)header.emb_type);
 
-    contents.reserve(old_size + header.size);
-    metadata.reserve(old_size + header.size);
+    s.first = (int64_t)GetSize();
+    s.count = (int64_t)header.size;
+    s.fn    = fn;
+    s.contents.reserve(header.size);
+    s.metadata.reserve(header.size);
     for (size_t i = 0; i < header.size; i++)
     {
         std::string c;
         std::string m;
         if (!read_string(f, c)) goto cleanup;
         if (!read_string(f, m)) goto cleanup;
-        contents.push_back(c);
-        metadata.push_back(m);
+        s.contents.push_back(c);
+        s.metadata.push_back(m);
     }
 
-    embeddings.resize((old_size + header.size) * emb_len);
-    if (fread(embeddings.data() + old_size * emb_len, emb_len * sizeof(float), header.size, f) != header.size)
+    s.rows.resize(header.size * row_size);
+    if (fread(s.rows.data(), row_size, header.size, f) != header.size)
         goto cleanup;
 
+    if (header.flags & VS_FLAG_WITH_F32)
+        s.exact_offset = (int64_t)ftello64(f);
+
+    segments.push_back(std::move(s));
     flag = true;
 
 cleanup:
@@ -303,60 +752,563 @@ cleanup:
     CHATLLM_CHECK(flag) << "LoadDB failed";
 }
 
-void CVectorStore::ExportDB(const char *fn)
+bool CVectorStore::LoadIndex(const std::string &fn)
+{
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (f == nullptr) return false;
+
+    bool flag = false;
+    index_file_header header;
+    if (fread(&header, sizeof(header), 1, f) < 1)
+        goto cleanup;
+
+    if (memcmp(header.magic, VS_INDEX_FILE_HEADER, sizeof(header.magic)))
+        goto cleanup;
+
+    if ((header.emb_len != (size_t)emb_len) || (header.size != GetSize())
+        || (header.n_lists < 1) || (header.n_lists > header.size))
+        goto cleanup;
+
+    centroids.resize(header.n_lists * emb_len);
+    list_offsets.resize(header.n_lists + 1);
+    list_items.resize(header.size);
+    if (fread(centroids.data(), sizeof(float), centroids.size(), f) != centroids.size())
+        goto cleanup;
+    if (fread(list_offsets.data(), sizeof(int64_t), list_offsets.size(), f) != list_offsets.size())
+        goto cleanup;
+    if (fread(list_items.data(), sizeof(int64_t), list_items.size(), f) != list_items.size())
+        goto cleanup;
+
+    // offsets and items are used to index records & lists without further checks
+    flag = (list_offsets.front() == 0) && (list_offsets.back() == (int64_t)header.size);
+    for (size_t j = 1; flag && (j < list_offsets.size()); j++)
+        flag = list_offsets[j - 1] <= list_offsets[j];
+    for (size_t i = 0; flag && (i < list_items.size()); i++)
+        flag = (list_items[i] >= 0) && (list_items[i] < (int64_t)header.size);
+
+cleanup:
+    fclose(f);
+    if (!flag)
+        ClearIndex();
+    return flag;
+}
+
+void CVectorStore::ExportIndex(const std::string &fn)
 {
-    FILE *f = fopen(fn, "wb");
+    if (!HasIndex())
+    {
+        // do not leave a stale index
+        remove(fn.c_str());
+        return;
+    }
+
+    FILE *f = fopen(fn.c_str(), "wb");
+    CHATLLM_CHECK(f != nullptr) << "can not open index file: " << fn;
 
-    file_header header =
+    index_file_header header =
     {
-        .magic = 0,
+        .magic = {0},
         .emb_len = (size_t)emb_len,
         .size = GetSize(),
+        .n_lists = list_offsets.size() - 1,
+    };
+    memcpy(header.magic, VS_INDEX_FILE_HEADER, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(centroids.data(), sizeof(float), centroids.size(), f);
+    fwrite(list_offsets.data(), sizeof(int64_t), list_offsets.size(), f);
+    fwrite(list_items.data(), sizeof(int64_t), list_items.size(), f);
+
+    fclose(f);
+}
+
+void CVectorStore::ClearIndex(void)
+{
+    centroids.clear();
+    list_offsets.clear();
+    list_items.clear();
+}
+
+bool CVectorStore::HasIndex(void) const
+{
+    return (list_offsets.size() > 1) && (list_items.size() == GetSize());
+}
+
+const CVectorStore::Segment &CVectorStore::SegmentOf(int64_t index) const
+{
+    if (segments.size() == 1) return segments[0];
+
+    auto it = std::upper_bound(segments.begin(), segments.end(), index,
+                               [](int64_t i, const Segment &s) { return i < s.first; });
+    return *(it - 1);
+}
+
+const uint8_t *CVectorStore::Row(int64_t index) const
+{
+    const Segment &s = SegmentOf(index);
+    return s.row_data() + (index - s.first) * row_size;
+}
+
+// records are clustered as normalized vectors for CosineSimilarity
+void CVectorStore::NormalizedRecord(int64_t index, float *out)
+{
+    decode_row(emb_type, Row(index), emb_len, out);
+    if (vec_cmp != CosineSimilarity) return;
+
+    const Segment &seg = SegmentOf(index);
+    const float s = seg.inv_norm_data()[index - seg.first];
+    for (int i = 0; i < emb_len; i++)
+        out[i] *= s;
+}
+
+bool CVectorStore::HasExactEmbeddings(void) const
+{
+    if (emb_type == EmbeddingType::F32) return true;
+
+    for (auto &s : segments)
+        if (s.exact_offset < 0) return false;
+    return true;
+}
+
+// F32 embeddings of records [first, first + count)
+void CVectorStore::ReadExactEmbeddings(int64_t first, int64_t count, float *out)
+{
+    OpenedFiles files;
+    ReadExactEmbeddings(first, count, out, files);
+}
+
+void CVectorStore::ReadExactEmbeddings(int64_t first, int64_t count, float *out, OpenedFiles &files)
+{
+    files.resize(segments.size());
+    for (size_t k = 0; k < segments.size(); k++)
+    {
+        auto &s = segments[k];
+        const int64_t start = std::max(first, s.first);
+        const int64_t end   = std::min(first + count, s.first + s.count);
+        if (start >= end) continue;
+
+        float *dst = out + (start - first) * emb_len;
+        const size_t n = (size_t)(end - start);
+        if (emb_type == EmbeddingType::F32)
+        {
+            memcpy(dst, s.row_data() + (start - s.first) * row_size, n * row_size);
+            continue;
+        }
+        if (s.exact)
+        {
+            memcpy(dst, s.exact + (start - s.first) * emb_len, n * emb_len * sizeof(float));
+            continue;
+        }
+
+        if (!files[k])
+            files[k].reset(fopen(s.fn.c_str(), "rb"));
+        FILE *f = files[k].get();
+        CHATLLM_CHECK(f != nullptr) << "can not open db file: " << s.fn;
+        bool ok = fseeko64(f, s.exact_offset + (int64_t)((start - s.first) * emb_len * sizeof(float)), SEEK_SET) == 0;
+        ok = ok && (fread(dst, emb_len * sizeof(float), n, f) == n);
+        CHATLLM_CHECK(ok) << "failed to read F32 embeddings from: " << s.fn;
+    }
+}
+
+static int nearest_centroid(const float *centroids, int n_lists, const float *v, int len)
+{
+    int best = 0;
+    float best_dist = INFINITY;
+    for (int j = 0; j < n_lists; j++)
+    {
+        const float d = vector_squared_distance(centroids + (size_t)j * len, v, len);
+        if (d < best_dist)
+        {
+            best_dist = d;
+            best = j;
+        }
+    }
+    return best;
+}
+
+// k-means on a sample of records, then all records are assigned to their nearest centroids
+void CVectorStore::BuildIndex(int n_lists, int iterations)
+{
+    ClearIndex();
+
+    const int64_t n = (int64_t)GetSize();
+    if ((n_lists < 1) || (n < n_lists)) return;
+
+    const int64_t MAX_SAMPLES_PER_LIST = 256;
+    std::mt19937 gen(0x5eed);
+    std::vector<int64_t> samples(n);
+    std::iota(samples.begin(), samples.end(), 0);
+    std::shuffle(samples.begin(), samples.end(), gen);
+    samples.resize((size_t)std::min(n, n_lists * MAX_SAMPLES_PER_LIST));
+
+    const int64_t n_samples = (int64_t)samples.size();
+    std::vector<float> train(n_samples * emb_len);
+    utils::parallel_for(0, n_samples, [&](int64_t i) {
+        NormalizedRecord(samples[i], train.data() + i * emb_len);
+    });
+
+    centroids.assign(train.begin(), train.begin() + (size_t)n_lists * emb_len);
+
+    std::vector<int> assignment(n_samples);
+    std::vector<int64_t> counts(n_lists);
+    for (int iter = 0; iter < iterations; iter++)
+    {
+        utils::parallel_for(0, n_samples, [&](int64_t i) {
+            assignment[i] = nearest_centroid(centroids.data(), n_lists, train.data() + i * emb_len, emb_len);
+        });
+
+        std::fill(centroids.begin(), centroids.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int64_t i = 0; i < n_samples; i++)
+        {
+            float *c = centroids.data() + (size_t)assignment[i] * emb_len;
+            const float *v = train.data() + i * emb_len;
+            for (int k = 0; k < emb_len; k++)
+                c[k] += v[k];
+            counts[assignment[i]]++;
+        }
+
+        std::uniform_int_distribution<int64_t> pick(0, n_samples - 1);
+        for (int j = 0; j < n_lists; j++)
+        {
+            float *c = centroids.data() + (size_t)j * emb_len;
+            if (counts[j] > 0)
+            {
+                for (int k = 0; k < emb_len; k++)
+                    c[k] /= (float)counts[j];
+            }
+            else
+            {
+                // re-seed an empty list
+                const float *v = train.data() + pick(gen) * emb_len;
+                memcpy(c, v, emb_len * sizeof(float));
+            }
+        }
+    }
+
+    std::vector<int> lists(n);
+    utils::parallel_for(0, n, [&](int64_t i) {
+        std::vector<float> v(emb_len);
+        NormalizedRecord(i, v.data());
+        lists[i] = nearest_centroid(centroids.data(), n_lists, v.data(), emb_len);
+    });
+
+    list_offsets.assign(n_lists + 1, 0);
+    for (int64_t i = 0; i < n; i++)
+        list_offsets[lists[i] + 1]++;
+    for (int j = 0; j < n_lists; j++)
+        list_offsets[j + 1] += list_offsets[j];
+
+    list_items.resize(n);
+    std::vector<int64_t> pos(list_offsets.begin(), list_offsets.end() - 1);
+    for (int64_t i = 0; i < n; i++)
+        list_items[pos[lists[i]]++] = i;
+}
+
+static void write_padding(FILE *f)
+{
+    static const char zeros[VS_V2_ALIGNMENT] = {0};
+    const int64_t pad = (VS_V2_ALIGNMENT - ftello64(f) % VS_V2_ALIGNMENT) % VS_V2_ALIGNMENT;
+    fwrite(zeros, 1, pad, f);
+}
+
+void CVectorStore::ExportDB(const char *fn, EmbeddingType type, bool with_f32)
+{
+    CHATLLM_CHECK(!with_f32 || HasExactEmbeddings()) << "ExportDB: F32 embeddings are not available";
+
+    // `fn` may be one of the mapped files
+    const std::string tmp_fn = std::string(fn) + ".tmp";
+    FILE *f = fopen(tmp_fn.c_str(), "wb");
+    CHATLLM_CHECK(f != nullptr) << "can not open db file: " << tmp_fn;
+
+    const int64_t size = (int64_t)GetSize();
+    file_header_v2 header =
+    {
+        .magic = {0},
+        .emb_len = (size_t)emb_len,
+        .size = (size_t)size,
+        .emb_type = (uint32_t)type,
+        .flags = with_f32 ? VS_FLAG_WITH_F32 : 0u,
     };
-    memcpy(header.magic, VS_FILE_HEADER, sizeof(header.magic));
+    memcpy(header.magic, VS_V2_FILE_HEADER, sizeof(header.magic));
     fwrite(&header, sizeof(header), 1, f);
-    for (size_t i = 0; i < GetSize(); i++)
+
+    // rows are converted from F32 embeddings if possible, and written in blocks
+    const int64_t BLOCK = 4096;
+    const bool exact = HasExactEmbeddings();
+    const size_t out_row_size = RowSize(type, emb_len);
+    std::vector<float> buf;
+    std::vector<uint8_t> out;
+    std::vector<float> norms(size);
+    std::vector<float> v(emb_len);
+
+    write_padding(f);
+    header.rows_offset = (uint64_t)ftello64(f);
+    for (int64_t i = 0; i < size; i += BLOCK)
+    {
+        const int64_t n = std::min(BLOCK, size - i);
+        out.resize(n * out_row_size);
+        if (type == emb_type)
+        {
+            for (int64_t j = 0; j < n; j++)
+                memcpy(out.data() + j * out_row_size, Row(i + j), row_size);
+        }
+        else
+        {
+            buf.resize(n * emb_len);
+            if (exact)
+                ReadExactEmbeddings(i, n, buf.data());
+            else
+            {
+                for (int64_t j = 0; j < n; j++)
+                    decode_row(emb_type, Row(i + j), emb_len, buf.data() + j * emb_len);
+            }
+
+            for (int64_t j = 0; j < n; j++)
+                encode_row(type, buf.data() + j * emb_len, emb_len, out.data() + j * out_row_size);
+        }
+
+        for (int64_t j = 0; j < n; j++)
+        {
+            decode_row(type, out.data() + j * out_row_size, emb_len, v.data());
+            norms[i + j] = vector_inv_norm(v.data(), emb_len);
+        }
+        fwrite(out.data(), out_row_size, n, f);
+    }
+
+    write_padding(f);
+    header.norms_offset = (uint64_t)ftello64(f);
+    fwrite(norms.data(), sizeof(float), norms.size(), f);
+
+    if (with_f32)
     {
-        write_string(f, contents[i]);
-        write_string(f, metadata[i]);
+        write_padding(f);
+        header.exact_offset = (uint64_t)ftello64(f);
+        for (int64_t i = 0; i < size; i += BLOCK)
+        {
+            const int64_t n = std::min(BLOCK, size - i);
+            buf.resize(n * emb_len);
+            ReadExactEmbeddings(i, n, buf.data());
+            fwrite(buf.data(), sizeof(float) * emb_len, n, f);
+        }
     }
 
-    fwrite(embeddings.data(), sizeof(float), GetSize() * emb_len, f);
+    // text, then its offset table
+    std::vector<uint64_t> text_offsets;
+    text_offsets.reserve(2 * size + 1);
+    uint64_t pos = 0;
+    std::string c;
+    std::string m;
+
+    write_padding(f);
+    header.text_offset = (uint64_t)ftello64(f);
+    for (int64_t i = 0; i < size; i++)
+    {
+        GetRecord(i, c, m);
+        text_offsets.push_back(pos);
+        fwrite(c.data(), 1, c.size(), f);
+        pos += c.size();
+        text_offsets.push_back(pos);
+        fwrite(m.data(), 1, m.size(), f);
+        pos += m.size();
+    }
+    text_offsets.push_back(pos);
 
+    write_padding(f);
+    header.text_offsets_offset = (uint64_t)ftello64(f);
+    fwrite(text_offsets.data(), sizeof(uint64_t), text_offsets.size(), f);
+
+    fseeko64(f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, f);
     fclose(f);
+
+    ExportIndex(std::string(fn) + ".ivf");
+
+    // `fn` can not be replaced while it is mapped (Windows), and offsets into it become stale anyway,
+    // so records are released and then reloaded from the new file, which contains all of them.
+    const bool reload = std::any_of(segments.begin(), segments.end(), [fn](const Segment &s) { return s.fn == fn; });
+    if (reload)
+    {
+        segments.clear();
+        ClearIndex();
+        emb_len  = 0;
+        row_size = 0;
+    }
+
+    CHATLLM_CHECK(utils::replace_file(tmp_fn.c_str(), fn)) << "can not save db file: " << fn << ": " << strerror(errno);
+
+    if (reload)
+    {
+        LoadDB(fn);
+        PrepareNorms();
+    }
+}
+
+// norms of records are computed once records are loaded, so that queries only read them
+void CVectorStore::PrepareNorms(void)
+{
+    if (vec_cmp != CosineSimilarity) return;
+
+    for (auto &s : segments)
+    {
+        // mapped files come with norms
+        if (s.mapped_inv_norms || ((int64_t)s.inv_norms.size() == s.count)) continue;
+
+        s.inv_norms.resize(s.count);
+        utils::parallel_for(0, s.count, [this, &s](int64_t i) {
+            std::vector<float> v(emb_len);
+            decode_row(emb_type, s.row_data() + i * row_size, emb_len, v.data());
+            s.inv_norms[i] = vector_inv_norm(v.data(), emb_len);
+        });
+    }
 }
 
-// TODO: use GGML to accelerate.
-void CVectorStore::Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n)
+struct ScoredIndex
 {
-    std::vector<float> scores;
-    const float *emb = embeddings.data();
+    float score;
+    int64_t index;
+};
 
+// rows (all, or those in probed lists) are split among threads, each of which keeps a bounded heap of its best `top_n`.
+void CVectorStore::Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n, int probes)
+{
     CHATLLM_CHECK(vec.size() == (size_t)emb_len) << "embedding length must match: " << vec.size() << " vs " << emb_len;
 
-    for (size_t i = 0; i < GetSize(); i++, emb += emb_len)
-        scores.push_back(vector_measure(vec_cmp, vec.data(), emb, emb_len));
+    const int64_t n = (int64_t)GetSize();
+    if (top_n > n) top_n = (int)n;
+    if (top_n <= 0) return;
+
+    text_vector query(vec);
+    if (vec_cmp == CosineSimilarity)
+    {
+        const float s = vector_inv_norm(query.data(), emb_len);
+        for (auto &x : query) x *= s;
+    }
+
+#ifdef GGML_USE_CPU
+    ggml_cpu_init();
+#endif
+
+    std::vector<uint8_t> query_row(row_size);
+    if ((emb_type == EmbeddingType::Binary) || (emb_type == EmbeddingType::F16))
+        encode_row(emb_type, query.data(), emb_len, query_row.data());
+
+    const bool max_best = is_dist_strategy_max_best(vec_cmp);
+    // heap top is the worst one
+    auto better = [max_best](const ScoredIndex &a, const ScoredIndex &b)
+    {
+        if (a.score != b.score)
+            return max_best ? a.score > b.score : a.score < b.score;
+        return a.index < b.index;
+    };
+
+    // rows to scan
+    std::vector<int64_t> selected_rows;
+    if (HasIndex())
+    {
+        const int n_lists = (int)list_offsets.size() - 1;
+        if (probes <= 0) probes = std::max(1, n_lists / 16);
+        probes = std::min(probes, n_lists);
+
+        std::vector<ScoredIndex> lists(n_lists);
+        for (int j = 0; j < n_lists; j++)
+            lists[j] = {vector_squared_distance(centroids.data() + (size_t)j * emb_len, query.data(), emb_len), j};
+        std::partial_sort(lists.begin(), lists.begin() + probes, lists.end(),
+                          [](const ScoredIndex &a, const ScoredIndex &b) { return a.score < b.score; });
+
+        for (int j = 0; j < probes; j++)
+        {
+            const int64_t l = lists[j].index;
+            selected_rows.insert(selected_rows.end(), list_items.begin() + list_offsets[l], list_items.begin() + list_offsets[l + 1]);
+        }
+        // rows are scanned in order, segment by segment
+        std::sort(selected_rows.begin(), selected_rows.end());
+    }
+    const int64_t n_rows = HasIndex() ? (int64_t)selected_rows.size() : n;
+    if (top_n > n_rows) top_n = (int)n_rows;
+    if (top_n <= 0) return;
+
+    // quantized embeddings: more candidates are selected, then re-scored with F32 embeddings
+    const bool rescore = (emb_type != EmbeddingType::F32) && HasExactEmbeddings();
+    const int n_candidates = rescore ? (int)std::min(n_rows, (int64_t)top_n * RESCORE_FACTOR) : top_n;
+
+    const int64_t MIN_ROWS_PER_THREAD = 4096;
+    const int n_threads = (int)std::max((int64_t)1, std::min((int64_t)std::max(1u, std::thread::hardware_concurrency()), n_rows / MIN_ROWS_PER_THREAD));
+    const int64_t rows_per_thread = (n_rows + n_threads - 1) / n_threads;
+    std::vector<std::vector<ScoredIndex>> heaps(n_threads);
+
+    utils::parallel_for(0, n_threads, [&](int64_t t) {
+        auto &heap = heaps[t];
+        heap.reserve(n_candidates);
+        const int64_t end = std::min(n_rows, (t + 1) * rows_per_thread);
+        size_t seg = 0;
+        for (int64_t k = t * rows_per_thread; k < end; k++)
+        {
+            const int64_t i = selected_rows.size() > 0 ? selected_rows[k] : k;
+            while (i >= segments[seg].first + segments[seg].count) seg++;
+            const Segment &s = segments[seg];
+            const float score = vector_measure(vec_cmp, emb_type, query.data(), query_row.data(), s.row_data() + (i - s.first) * row_size, emb_len,
+                                               vec_cmp == CosineSimilarity ? s.inv_norm_data()[i - s.first] : 1.0f);
+            const ScoredIndex item = {score, i};
+            if ((int)heap.size() < n_candidates)
+            {
+                heap.push_back(item);
+                std::push_heap(heap.begin(), heap.end(), better);
+            }
+            else if (better(item, heap.front()))
+            {
+                std::pop_heap(heap.begin(), heap.end(), better);
+                heap.back() = item;
+                std::push_heap(heap.begin(), heap.end(), better);
+            }
+        }
+    }, n_threads);
 
-    std::vector<size_t> order;
-    utils::ordering(scores, order, is_dist_strategy_max_best(vec_cmp));
+    std::vector<ScoredIndex> all;
+    for (auto &heap : heaps)
+        all.insert(all.end(), heap.begin(), heap.end());
+    std::partial_sort(all.begin(), all.begin() + n_candidates, all.end(), better);
 
-    if (top_n > (int)order.size()) top_n = (int)order.size();
+    if (rescore)
+    {
+        all.resize(n_candidates);
+        std::vector<float> v(emb_len);
+        OpenedFiles files;
+        for (auto &c : all)
+        {
+            ReadExactEmbeddings(c.index, 1, v.data(), files);
+            c.score = vector_measure(vec_cmp, EmbeddingType::F32, query.data(), nullptr, (const uint8_t *)v.data(), emb_len,
+                                     vec_cmp == CosineSimilarity ? vector_inv_norm(v.data(), emb_len) : 1.0f);
+        }
+        std::sort(all.begin(), all.end(), better);
+    }
 
     for (int i = 0; i < top_n; i++)
-        indices.push_back(order[i]);
+        indices.push_back(all[i].index);
 }
 
-size_t CVectorStore::GetSize(void)
+size_t CVectorStore::GetSize(void) const
 {
-    return contents.size();
+    return segments.size() > 0 ? (size_t)(segments.back().first + segments.back().count) : 0;
 }
 
 bool CVectorStore::GetRecord(int64_t index, std::string &content, std::string &meta)
 {
     if (index < 0) return false;
     if ((size_t)index >= GetSize()) return false;
-    content = contents[index];
-    meta = metadata[index];
+
+    const Segment &s = SegmentOf(index);
+    const int64_t i = index - s.first;
+    if (s.file)
+    {
+        const uint64_t *o = s.text_offsets + 2 * i;
+        content.assign(s.text + o[0], o[1] - o[0]);
+        meta.assign(s.text + o[1], o[2] - o[1]);
+    }
+    else
+    {
+        content = s.contents[i];
+        meta = s.metadata[i];
+    }
     return true;
 }
 
@@ -372,6 +1324,14 @@ DistanceStrategy ParseDistanceStrategy(const char *s)
     else return DistanceStrategy::EuclideanDistance;
 }
 
+EmbeddingType ParseEmbeddingType(const char *s)
+{
+    if (strcasecmp(s, "f16") == 0) return EmbeddingType::F16;
+    if (strcasecmp(s, "int8") == 0) return EmbeddingType::Int8;
+    if (strcasecmp(s, "binary") == 0) return EmbeddingType::Binary;
+    return EmbeddingType::F32;
+}
+
 namespace utils
 {
     std::string trim(const std::string& str)
@@ -420,6 +1380,13 @@ namespace utils
         return value.substr(value.size() - ending.size()) == ending;
     }
 
+    static thread_local bool parallel_worker = false;
+
+    bool is_parallel_worker(void)
+    {
+        return parallel_worker;
+    }
+
     void parallel_for(int64_t start, int64_t end, std::function<void(int64_t)> func, int num_threads)
     {
         // Determine number of threads to use
@@ -439,15 +1406,24 @@ namespace utils
         std::vector<std::thread> threads;
         threads.reserve(num_threads);
 
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
         for (int i = 0; i < num_threads; ++i) {
             const int64_t thread_start = start + i * chunk_size;
             const int64_t thread_end = std::min(thread_start + chunk_size, end);
 
             // Only create thread if there's work to do
             if (thread_start < thread_end) {
-                threads.emplace_back([=]() {
-                    for (int64_t j = thread_start; j < thread_end; ++j) {
-                        func(j);
+                threads.emplace_back([=, &func, &error, &error_mutex]() {
+                    parallel_worker = true;
+                    try {
+                        for (int64_t j = thread_start; j < thread_end; ++j) {
+                            func(j);
+                        }
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error) error = std::current_exception();
                     }
                 });
             }
@@ -459,6 +1435,8 @@ namespace utils
                 thread.join();
             }
         }
+
+        if (error) std::rethrow_exception(error);
     }
 
     std::string load_file(const char *fn)
@@ -480,6 +1458,15 @@ namespace utils
         return file.good();
     }
 
+    bool replace_file(const char *from, const char *to)
+    {
+#if defined(_WIN32)
+        return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        return std::rename(from, to) == 0;
+#endif
+    }
+
     std::string num2words(int value)
     {
         if (value < 0)
@@ -5,6 +5,13 @@
 #include <functional>
 #include <algorithm>
 #include <cstdint>
+#include <memory>
+#include <cstdio>
+
+namespace tokenizer
+{
+    class DataReader;
+}
 
 typedef std::vector<float> text_vector;
 
@@ -18,32 +25,104 @@ enum DistanceStrategy
 
 DistanceStrategy ParseDistanceStrategy(const char *s);
 
+enum class EmbeddingType
+{
+    F32,
+    F16,
+    Int8,       // per-vector scale
+    Binary,     // sign bits
+};
+
+EmbeddingType ParseEmbeddingType(const char *s);
+
 class CVectorStore
 {
 public:
+    // `text_emb`: embeddings of a batch of texts are stored one after another
     CVectorStore(DistanceStrategy vec_cmp, int emb_len,
-                std::function<void (const std::string &, float *)> text_emb, const char *fn);
+                std::function<void (const std::vector<std::string> &, float *)> text_emb, const char *fn);
 
     CVectorStore(DistanceStrategy vec_cmp, const char *fn);
     CVectorStore(DistanceStrategy vec_cmp, const std::vector<std::string> &files);
 
-    void ExportDB(const char *fn);
+    // `with_f32`: also store F32 embeddings, which are used to re-score candidates of quantized embeddings
+    void ExportDB(const char *fn, EmbeddingType type = EmbeddingType::F32, bool with_f32 = false);
 
-    void Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n = 20);
+    // IVF (inverted file) index: records are clustered into `n_lists` lists, and
+    // a query only scans the lists whose centroids are nearest to it.
+    void BuildIndex(int n_lists, int iterations = 10);
+    bool HasIndex(void) const;
 
-    size_t GetSize(void);
+    // `probes`: number of lists to scan when indexed. more probes, better recall. (<= 0: default)
+    void Query(const text_vector &vec, std::vector<int64_t> &indices, int top_n = 20, int probes = 0);
 
+    size_t GetSize(void) const;
+
+    // text of mapped DB files is fetched on demand
     bool GetRecord(int64_t index, std::string &content, std::string &meta);
 
+    static size_t RowSize(EmbeddingType type, int emb_len);
+
 protected:
     void Clear();
-    void FromPlainData(std::function<void (const std::string &, float *)> text_emb, const char *fn);
+    void FromPlainData(const char *fn);
     void LoadDB(const char *fn);
+    bool LoadMappedDB(const char *fn);
+    void LoadDBToMemory(const char *fn);
+    void CheckEmbeddingType(const char *fn, int len, EmbeddingType type);
+    void PrepareNorms(void);
+    bool LoadIndex(const std::string &fn);
+    void ExportIndex(const std::string &fn);
+    void ClearIndex(void);
+    void NormalizedRecord(int64_t index, float *out);
+    bool HasExactEmbeddings(void) const;
+    struct FileCloser { void operator()(FILE *f) const { fclose(f); } };
+    typedef std::vector<std::unique_ptr<FILE, FileCloser>> OpenedFiles;
+    void ReadExactEmbeddings(int64_t first, int64_t count, float *out);
+    // files of segments are opened on demand (one per segment), and kept in `files` for later reads
+    void ReadExactEmbeddings(int64_t first, int64_t count, float *out, OpenedFiles &files);
+
+    // records of a DB file (or of plain data)
+    struct Segment
+    {
+        int64_t first = 0;
+        int64_t count = 0;
+
+        // loaded into memory
+        std::vector<std::string> contents;
+        std::vector<std::string> metadata;
+        std::vector<uint8_t> rows;
+
+        // mapped
+        std::shared_ptr<tokenizer::DataReader> file;
+        const uint8_t  *mapped_rows = nullptr;
+        const float    *mapped_inv_norms = nullptr;
+        const uint64_t *text_offsets = nullptr;   // 2 * count + 1, content & meta of each record
+        const char     *text = nullptr;
+
+        // F32 embeddings for re-scoring
+        std::string fn;
+        int64_t exact_offset = -1;              // < 0: not available
+        const float *exact = nullptr;           // mapped
+
+        // inverse norms of rows for CosineSimilarity, if not mapped
+        std::vector<float> inv_norms;
+
+        const uint8_t *row_data(void) const { return file ? mapped_rows : rows.data(); }
+        const float   *inv_norm_data(void) const { return mapped_inv_norms ? mapped_inv_norms : inv_norms.data(); }
+    };
+
+    const Segment &SegmentOf(int64_t index) const;
+    const uint8_t *Row(int64_t index) const;
 
     DistanceStrategy vec_cmp;
     int emb_len;
+    EmbeddingType emb_type;
+    size_t row_size;
+
+    std::vector<Segment> segments;
 
-    std::vector<std::string> contents;
-    std::vector<std::string> metadata;
-    std::vector<float> embeddings;
+    std::vector<float>   centroids;     // n_lists * emb_len
+    std::vector<int64_t> list_offsets;  // n_lists + 1
+    std::vector<int64_t> list_items;    // record indices grouped by lists
 };